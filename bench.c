@@ -0,0 +1,360 @@
+/* Benchmarks for smallsh's launch, parse, expansion and reaping paths
+ * Builds smallsh.c without its main and drives the shell's own functions directly, printing one result per
+ * benchmark as JSON (default) or CSV (-c) so runs from different builds can be compared.
+ * Usage: bench [-c] [-n scale] [-t] where scale multiplies every iteration count (default 1). With -t, the
+ * split kernels are checked against strtok on random lines instead. */
+#define SMALLSH_NO_MAIN
+#include "smallsh.c"
+
+struct bench_result {
+  char const *name;
+  size_t iterations;
+  double seconds;
+  double rate;
+  char const *unit;
+};
+
+/* Current CLOCK_MONOTONIC time in seconds
+ * Returns: seconds since an arbitrary point */
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/* Set up the signal state and event loop the launch and reaping paths expect, as main does
+ * Parameters: struct shell_state *sh, enum launch_mode mode
+ * Returns: 0 on success, -1 on failure */
+static int bench_shell_init(struct shell_state *sh, enum launch_mode mode) {
+  *sh = (struct shell_state) { .launch_mode = mode };
+  if (sigaction(SIGINT, NULL, &sh->SIGINT_init_disp_sa) != 0) return -1;
+  if (sigaction(SIGTSTP, NULL, &sh->SIGTSTP_init_disp_sa) != 0) return -1;
+  return events_init(sh);
+}
+
+/* Release what bench_shell_init and the benchmarks left in a shell_state
+ * Parameters: struct shell_state *sh
+ * Returns: nothing */
+static void bench_shell_free(struct shell_state *sh) {
+  close(sh->epoll_fd);
+  close(sh->sigchld_fd);
+  sigprocmask(SIG_SETMASK, &sh->orig_sigmask, NULL);
+  path_cache_reset(&sh->path_cache);
+  free(sh->path_cache.slots);
+  free(sh->jobs.slots);
+  free(sh->jobs.index);
+  free(sh->events);
+  for (size_t i = 0; i < sh->stats.num_commands; ++i) free(sh->stats.commands[i].name);
+  free(sh->stats.commands);
+  free(sh->stats.children);
+}
+
+/* Run /bin/true in the foreground repeatedly through run_pipeline
+ * Parameters: enum launch_mode mode, size_t iterations, struct bench_result *result
+ * Returns: 0 on success, -1 on failure */
+static int bench_launch(enum launch_mode mode, size_t iterations, struct bench_result *result) {
+  struct shell_state sh;
+  if (bench_shell_init(&sh, mode) != 0) return -1;
+  char *argv[] = { "/bin/true", NULL };
+  struct command cmd = { .argv = argv, .argc = 1 };
+  int status = 0;
+  pid_t bg_pid = 0;
+  struct arena arena = {0}; /* Per line in the shell */
+
+  double start = now_seconds();
+  for (size_t i = 0; i < iterations; ++i) {
+    arena_reset(&arena);
+    if (run_pipeline(&sh, &arena, &cmd, 1, false, NULL, &status, &bg_pid, NULL) != 0 || status != 0) return -1;
+  }
+  result->seconds = now_seconds() - start;
+  result->name = mode == LAUNCH_SPAWN ? "launch_spawn" : "launch_fork";
+  result->iterations = iterations;
+  result->rate = iterations / result->seconds;
+  result->unit = "commands/s";
+  arena_free(&arena);
+  bench_shell_free(&sh);
+  return 0;
+}
+
+/* Split, expand and parse a long line of many short words, including pipes and a redirection
+ * Parameters: bool cached (look the line up in a parse cache, so every iteration after the first only expands
+ *             it), size_t iterations, struct bench_result *result
+ * Returns: 0 on success, -1 on failure */
+static int bench_tokenize(bool cached, size_t iterations, struct bench_result *result) {
+  size_t const num_words = 20000;
+  char const *const words[] = { "cmd", "--flag", "argument", "x", "|", "filter", "-v", "value" };
+  size_t line_len = 0;
+  char *line = malloc(num_words * 16);
+  if (!line) return -1;
+  for (size_t i = 0; i < num_words; ++i) {
+    // A pipe must not start or end the line, and only the last stage may carry the redirection
+    char const *word = words[i % (sizeof words / sizeof *words)];
+    if (i == 0 || i + 1 == num_words) word = "word";
+    line_len += sprintf(line + line_len, "%s ", word);
+  }
+  line_len += sprintf(line + line_len, "> out");
+  char *work = malloc(line_len + 1);
+  if (!work) return -1;
+
+  struct arena arena = {0};
+  struct ifs_table ifs = {0};
+  struct var_store vars = {0};
+  if (var_store_import(&vars, environ) != 0) return -1;
+  struct expand_ctx expand = { .home = "/home/user", .exit_status = "0", .shell_pid = "12345", .vars = &vars };
+  struct parse_cache cache = {0};
+  double start = now_seconds();
+  for (size_t i = 0; i < iterations; ++i) {
+    memcpy(work, line, line_len + 1); /* Splitting is done in place */
+    arena_reset(&arena);
+    struct parsed_line parsed;
+    if (cached) {
+      struct compiled_line *compiled;
+      if (parse_cache_lookup(&cache, &arena, &ifs, &vars, work, line_len, &compiled) != PARSE_OK) return -1;
+      if (instantiate_line(&arena, compiled, NULL, &expand, &parsed) != 0) return -1;
+    } else if (parse_line(&arena, &ifs, work, line_len, &expand, &parsed) != PARSE_OK) {
+      return -1;
+    }
+  }
+  result->seconds = now_seconds() - start;
+  result->name = cached ? "tokenize_long_line_cached" : "tokenize_long_line";
+  result->iterations = iterations;
+  result->rate = (double) line_len * iterations / result->seconds / 1e6;
+  result->unit = "MB/s";
+  parse_cache_clear(&cache);
+  arena_free(&arena);
+  free(ifs.ifs);
+  free(work);
+  free(line);
+  return 0;
+}
+
+/* Split a multi-megabyte line of arguments into words with one classify kernel
+ * Parameters: char const *kernel (scalar, sse2 or avx2), char const *name (of the result), size_t iterations,
+ *             struct bench_result *result
+ * Returns: 0 on success, 1 if the CPU lacks the kernel (result left unset), -1 on failure */
+static int bench_split(char const *kernel, char const *name, size_t iterations, struct bench_result *result) {
+  size_t const line_len = 4 << 20;
+  char *line = malloc(line_len + 1), *work = malloc(line_len + 1);
+  if (!line || !work) return -1;
+  for (size_t i = 0; i < line_len; ++i) line[i] = i % 9 == 8 ? ' ' : "argument"[i % 9];
+  line[line_len] = '\0';
+
+  setenv("SMALLSH_TOKENIZER", kernel, 1);
+  struct ifs_table table = {0};
+  struct var_store vars = {0}; /* IFS unset, so the default delimiters */
+  if (ifs_table_update(&table, &vars) != 0) return -1;
+  unsetenv("SMALLSH_TOKENIZER");
+  int skipped = strcmp(table.kernel, kernel) != 0;
+
+  struct arena arena = {0};
+  double start = now_seconds();
+  for (size_t i = 0; !skipped && i < iterations; ++i) {
+    memcpy(work, line, line_len + 1);
+    arena_reset(&arena);
+    struct token_span *spans;
+    size_t num_spans;
+    if (split_words(&arena, &table, work, line_len, &spans, &num_spans) != 0) return -1;
+  }
+  if (!skipped) {
+    result->seconds = now_seconds() - start;
+    result->name = name;
+    result->iterations = iterations;
+    result->rate = (double) line_len * iterations / result->seconds / 1e6;
+    result->unit = "MB/s";
+  }
+  arena_free(&arena);
+  free(table.ifs);
+  free(work);
+  free(line);
+  return skipped;
+}
+
+/* Compare every available split kernel against strtok on random lines, whose lengths cross the 16, 32 and
+ * 64-byte block boundaries of the kernels, under random IFS sets of up to one more delimiter than the SIMD
+ * kernels take
+ * Parameters: size_t iterations (lines per kernel), unsigned seed
+ * Returns: 0 if every kernel agreed with strtok on every line, 1 on a mismatch (printed), -1 on failure */
+static int check_split(size_t iterations, unsigned seed) {
+  char const *const kernels[] = { "scalar", "sse2", "avx2" };
+  // Bytes lines are made of; '$' is left out so that lines never take the command substitution path
+  unsigned char const pool[] = " \t\n:,;|ab/\x7f\x80\xff-=";
+  srand(seed);
+  char line[260], work[260], expected[260];
+  struct arena arena = {0};
+  struct var_store vars = {0};
+  struct ifs_table table = {0};
+  int result = 0;
+  for (size_t k = 0; k < sizeof kernels / sizeof *kernels && result == 0; ++k) {
+    setenv("SMALLSH_TOKENIZER", kernels[k], 1);
+    size_t checked = 0;
+    for (size_t n = 0; n < iterations && result == 0; ++n) {
+      char ifs[IFS_SIMD_MAX_DELIMS + 2];
+      size_t num_delims = 1 + (size_t) rand() % (IFS_SIMD_MAX_DELIMS + 1);
+      for (size_t i = 0; i < num_delims; ++i) ifs[i] = pool[rand() % (sizeof pool - 1)];
+      ifs[num_delims] = '\0';
+      // The kernel is chosen again whenever IFS changes
+      if (var_set(&vars, "IFS", 3, ifs, false) != 0 || ifs_table_update(&table, &vars) != 0) return -1;
+      if (strcmp(table.kernel, kernels[k]) != 0 && table.num_delims <= IFS_SIMD_MAX_DELIMS) break; /* Not on this CPU */
+
+      size_t len = (size_t) rand() % 256;
+      for (size_t i = 0; i < len; ++i) line[i] = pool[rand() % (sizeof pool - 1)];
+      line[len] = '\0';
+      memcpy(work, line, len + 1);
+      memcpy(expected, line, len + 1);
+      arena_reset(&arena);
+      struct token_span *spans;
+      size_t num_spans, word = 0;
+      if (split_words(&arena, &table, work, len, &spans, &num_spans) != 0) return -1;
+      for (char *token = strtok(expected, ifs); token && result == 0; token = strtok(NULL, ifs), ++word) {
+        if (word >= num_spans || spans[word].start != (size_t) (token - expected) ||
+            strcmp(work + spans[word].start, token) != 0) {
+          result = 1;
+        }
+      }
+      if (result == 0 && word != num_spans) result = 1;
+      if (result != 0) {
+        fprintf(stderr, "check_split: %s kernel differs from strtok: IFS of %zu bytes, line of %zu bytes:",
+                kernels[k], num_delims, len);
+        for (size_t i = 0; i < len; ++i) fprintf(stderr, " %02x", (unsigned char) line[i]);
+        fprintf(stderr, "\n");
+      }
+      checked++;
+    }
+    if (result == 0) printf("check_split: %s: %zu lines agree with strtok\n", kernels[k], checked);
+  }
+  unsetenv("SMALLSH_TOKENIZER");
+  arena_free(&arena);
+  free(table.ifs);
+  return result;
+}
+
+/* Expand words dense with $$, $?, $! and ${NAME} parameters
+ * Parameters: size_t iterations, struct bench_result *result
+ * Returns: 0 on success, -1 on failure */
+static int bench_expand(size_t iterations, struct bench_result *result) {
+  char word[4096];
+  size_t word_len = 0;
+  char const *const params[] = { "$$", "$?", "$!", "${HOME}", "~/", "-" };
+  for (size_t i = 0; word_len + 16 < sizeof word; ++i) {
+    // ~/ only expands at the start of a word
+    char const *param = params[i % 6];
+    if (i > 0 && param[0] == '~') param = "x";
+    word_len += sprintf(word + word_len, "%s", param);
+  }
+
+  struct arena arena = {0};
+  struct var_store vars = {0};
+  if (var_store_import(&vars, environ) != 0 || var_set(&vars, "HOME", 4, "/home/user", true) != 0) return -1;
+  struct expand_ctx expand = {
+    .home = "/home/user", .exit_status = "0", .shell_pid = "12345", .bg_pid = "54321", .vars = &vars,
+  };
+  size_t out_bytes = 0;
+  double start = now_seconds();
+  for (size_t i = 0; i < iterations; ++i) {
+    arena_reset(&arena);
+    char *expanded = expand_word(&arena, word, &expand);
+    if (!expanded) return -1;
+    out_bytes += strlen(expanded);
+  }
+  result->seconds = now_seconds() - start;
+  result->name = "expand_dense_params";
+  result->iterations = iterations;
+  result->rate = (double) word_len * iterations / result->seconds / 1e6;
+  result->unit = "MB/s";
+  arena_free(&arena);
+  return out_bytes > 0 ? 0 : -1;
+}
+
+/* Start many background jobs at once, then reap them all through the event loop
+ * Parameters: size_t num_jobs, struct bench_result *result
+ * Returns: 0 on success, -1 on failure */
+static int bench_reap(size_t num_jobs, struct bench_result *result) {
+  struct shell_state sh;
+  if (bench_shell_init(&sh, LAUNCH_SPAWN) != 0) return -1;
+  char *argv[] = { "/bin/true", NULL };
+  struct command cmd = { .argv = argv, .argc = 1 };
+  int status = 0;
+  pid_t bg_pid = 0;
+  struct arena arena = {0}; /* Per line in the shell */
+
+  double start = now_seconds();
+  for (size_t i = 0; i < num_jobs; ++i) {
+    arena_reset(&arena);
+    if (run_pipeline(&sh, &arena, &cmd, 1, true, "/bin/true", &status, &bg_pid, NULL) != 0) return -1;
+    sh.num_events = 0; /* Nothing is reported here, so the queue is dropped as it fills */
+  }
+  for (;;) {
+    if (reap_children(&sh) != 0) return -1;
+    sh.num_events = 0;
+    size_t live = 0;
+    for (size_t i = 0; i < sh.jobs.num_slots; ++i) live += sh.jobs.slots[i].pid != 0 && sh.jobs.slots[i].state != JOB_DONE;
+    if (live == 0) break;
+    if (wait_for_events(&sh, -1) == -1 && errno != EINTR) return -1;
+  }
+  result->seconds = now_seconds() - start;
+  result->name = "background_reap";
+  result->iterations = num_jobs;
+  result->rate = num_jobs / result->seconds;
+  result->unit = "jobs/s";
+  arena_free(&arena);
+  bench_shell_free(&sh);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  bool csv = false, check = false;
+  size_t scale = 1;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-c") == 0) {
+      csv = true;
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      scale = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-t") == 0) {
+      check = true;
+    } else {
+      fprintf(stderr, "Usage: %s [-c] [-n scale] [-t]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (scale == 0) scale = 1;
+  if (check) {
+    int check_result = check_split(100000 * scale, 1);
+    if (check_result == -1) fprintf(stderr, "check_split failed: %s\n", strerror(errno));
+    return check_result == 0 ? 0 : 1;
+  }
+
+  struct bench_result results[10];
+  size_t num_results = 0;
+  if (bench_launch(LAUNCH_SPAWN, 2000 * scale, &results[num_results++]) != 0) goto fail;
+  if (bench_launch(LAUNCH_FORK, 2000 * scale, &results[num_results++]) != 0) goto fail;
+  if (bench_tokenize(false, 200 * scale, &results[num_results++]) != 0) goto fail;
+  if (bench_tokenize(true, 200 * scale, &results[num_results++]) != 0) goto fail;
+  char const *const kernels[][2] = {
+    { "scalar", "split_words_scalar" }, { "sse2", "split_words_sse2" }, { "avx2", "split_words_avx2" },
+  };
+  for (size_t k = 0; k < 3; ++k) {
+    int split_result = bench_split(kernels[k][0], kernels[k][1], 20 * scale, &results[num_results]);
+    if (split_result == -1) goto fail;
+    if (split_result == 0) num_results++;
+  }
+  if (bench_expand(5000 * scale, &results[num_results++]) != 0) goto fail;
+  if (bench_reap(1000 * scale, &results[num_results++]) != 0) goto fail;
+
+  if (csv) printf("name,iterations,seconds,rate,unit\n");
+  else printf("[\n");
+  for (size_t i = 0; i < num_results; ++i) {
+    struct bench_result const *r = &results[i];
+    if (csv) {
+      printf("%s,%zu,%.6f,%.2f,%s\n", r->name, r->iterations, r->seconds, r->rate, r->unit);
+    } else {
+      printf("  {\"name\": \"%s\", \"iterations\": %zu, \"seconds\": %.6f, \"rate\": %.2f, \"unit\": \"%s\"}%s\n",
+             r->name, r->iterations, r->seconds, r->rate, r->unit, i + 1 < num_results ? "," : "");
+    }
+  }
+  if (!csv) printf("]\n");
+  return 0;
+
+fail:
+  fprintf(stderr, "Benchmark %zu failed: %s\n", num_results, strerror(errno));
+  return 1;
+}
@@ -1,12 +1,14 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE /* splice, tee and F_SETPIPE_SZ */
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h> /* For strtoimax */
 #include <stddef.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h> /* For pid_t type */
 #include <sys/wait.h>
+#include <sys/resource.h> /* For wait4 and struct rusage */
 #include <sys/stat.h>
 #include <signal.h>
 #include <errno.h>
@@ -14,107 +16,6748 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <assert.h>
 #include <signal.h>
+#include <spawn.h>
+#include <sched.h> /* For sched_setaffinity */
+#include <time.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h> /* For the server socket */
+#include <sys/inotify.h> /* Keeps the PATH executable index current */
+#include <sys/ioctl.h> /* For TIOCGWINSZ */
+#include <termios.h>
+#include <sys/mman.h> /* For memfd_create */
+#include <sys/sendfile.h>
+#include <sys/syscall.h> /* For SYS_getdents64 */
+#include <dirent.h> /* For the d_type values */
+#include <limits.h> /* For PATH_MAX */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> /* SSE2/AVX2 kernels of the word splitter */
+#endif
 
-/* Free word_tokens function adapted from free_file_list function in CS344 tree assignment skeleton code
-* Parameters: char **word_token_array (array of pointers to word tokens created by strtok)
-*             size_t token_num (number of tokens created)
-* Returns:    no return value */
-static void free_word_tokens(char **word_token_array, size_t token_num) {
-  for (size_t i = 0; i < token_num; i++) {
-    free(word_token_array[i]);
-  }
-  free(word_token_array);
-}
-
-/* String search function copied from instructor's string search function video
-* Parameters: char *restrict *restrict orig_str (string to be searched), 
-*             char const *restrict pattern (substring to search for), 
-*             char const *restruct sub (substitution string for found pattern)
-* Returns:    char *expanded_str (contains orig_str with the pattern replaced or is orig_str if pattern not found) */
-char *str_gsub(char *restrict *restrict orig_str, char const *restrict pattern, char const *restrict sub) {
-  char *expanded_str = *orig_str;
-  size_t orig_str_len = strlen(expanded_str);
-  size_t const pattern_len = strlen(pattern), sub_len = strlen(sub);
-  
-  // If pattern exists in expanded_str, replace
-  for (;(expanded_str = strstr(expanded_str, pattern));) {
-    ptrdiff_t offset = expanded_str - *orig_str; /* Track current place in expanded_str */
-    if (sub_len > pattern_len) {
-      expanded_str = realloc(*orig_str, sizeof **orig_str * (orig_str_len + sub_len - pattern_len + 1));
-      if (!expanded_str) goto str_gsub_return; /* Error check realloc */
-      *orig_str = expanded_str;
-      expanded_str = *orig_str + offset;
+extern char **environ;
+
+/* Launch engines for non-built-in commands. LAUNCH_FORK duplicates the shell with fork() and redirects
+ * in the child; LAUNCH_SPAWN uses posix_spawnp(), which glibc implements with a vfork-style clone so the
+ * shell's page tables are never copied. Default is chosen at build time with -DSMALLSH_DEFAULT_LAUNCH
+ * and may be overridden at runtime by setting SMALLSH_LAUNCH to "fork" or "spawn". */
+enum launch_mode { LAUNCH_FORK, LAUNCH_SPAWN };
+#ifndef SMALLSH_DEFAULT_LAUNCH
+#define SMALLSH_DEFAULT_LAUNCH LAUNCH_SPAWN
+#endif
+
+/* Bump allocator for everything that only lives as long as one command line: the token vector, expanded
+ * words and redirection filenames. Chunks are kept across arena_reset so that, once the arena has grown
+ * to fit the longest line seen, parsing a line makes no malloc calls at all. */
+#define ARENA_CHUNK_SIZE 65536
+
+union arena_align { long double ld; long long ll; void *ptr; }; /* C99 stand-in for max_align_t */
+#define ARENA_ALIGN (sizeof (union arena_align))
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;
+  size_t used;
+  union arena_align data[];
+};
+
+struct arena {
+  struct arena_chunk *head;
+  struct arena_chunk *current;
+};
+
+/* Allocate size bytes from the arena, aligned for any type
+ * Parameters: struct arena *arena, size_t size
+ * Returns: pointer to the new block, or NULL if a new chunk could not be allocated */
+static void *arena_alloc(struct arena *arena, size_t size) {
+  size = ARENA_ROUND(size);
+  struct arena_chunk *chunk = arena->current;
+  // Move forward through chunks emptied by the last reset before allocating a new one
+  while (chunk && chunk->size - chunk->used < size) {
+    if (!chunk->next) {
+      chunk = NULL;
+      break;
+    }
+    chunk = chunk->next;
+  }
+  if (!chunk) {
+    size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+    chunk = malloc(sizeof *chunk + chunk_size);
+    if (!chunk) return NULL;
+    chunk->size = chunk_size;
+    chunk->used = 0;
+    chunk->next = NULL;
+    if (arena->current) {
+      chunk->next = arena->current->next;
+      arena->current->next = chunk;
+    } else {
+      arena->head = chunk;
+    }
+  }
+  arena->current = chunk;
+  void *block = (char *) chunk->data + chunk->used;
+  chunk->used += size;
+  return block;
+}
+
+/* Resize a block from the arena, extending it in place when it was the most recent allocation
+ * Parameters: struct arena *arena, void *block (may be NULL), size_t old_size, size_t new_size
+ * Returns: pointer to the resized block, or NULL on allocation failure (block is left untouched) */
+static void *arena_realloc(struct arena *arena, void *block, size_t old_size, size_t new_size) {
+  struct arena_chunk *chunk = arena->current;
+  size_t old_aligned = ARENA_ROUND(old_size);
+  size_t new_aligned = ARENA_ROUND(new_size);
+  if (block && chunk && (char *) block + old_aligned == (char *) chunk->data + chunk->used
+      && chunk->used - old_aligned + new_aligned <= chunk->size) {
+    chunk->used = chunk->used - old_aligned + new_aligned;
+    return block;
+  }
+  void *new_block = arena_alloc(arena, new_size);
+  if (new_block && block) memcpy(new_block, block, old_size < new_size ? old_size : new_size);
+  return new_block;
+}
+
+/* Release every allocation at once, keeping the chunks for the next command line
+ * Parameters: struct arena *arena
+ * Returns: nothing */
+static void arena_reset(struct arena *arena) {
+  for (struct arena_chunk *chunk = arena->head; chunk; chunk = chunk->next) chunk->used = 0;
+  arena->current = arena->head;
+}
+
+/* Return all of the arena's chunks to the heap
+ * Parameters: struct arena *arena
+ * Returns: nothing */
+static void arena_free(struct arena *arena) {
+  struct arena_chunk *chunk = arena->head;
+  while (chunk) {
+    struct arena_chunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  arena->head = arena->current = NULL;
+}
+
+/* FNV-1a hash used by the variable store and the PATH cache
+ * Parameters: char const *bytes, size_t len
+ * Returns: 64-bit hash of the bytes */
+static uint64_t hash_bytes(char const *bytes, size_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char) bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/* FNV-1a hash of a NUL terminated string
+ * Parameters: char const *str
+ * Returns: 64-bit hash of str */
+static uint64_t hash_str(char const *str) {
+  return hash_bytes(str, strlen(str));
+}
+
+/* Shell variables. An open addressing table maps names to entries whose text is a single "NAME=value"
+ * allocation, so the envp handed to exec is an array of pointers into the entries. That array is rebuilt
+ * only when an exported variable has changed since it was last built. Every change bumps generation, which
+ * lets caches derived from a variable (the PATH cache, the IFS table) skip rechecking it on every line. */
+struct var_entry {
+  char *text;       /* "NAME=value"; NULL for an empty slot */
+  size_t name_len;
+  bool has_value;   /* false for a name exported before it was assigned */
+  bool exported;
+};
+
+struct var_store {
+  struct var_entry *slots;
+  size_t capacity;      /* Power of two, at least twice count */
+  size_t count;
+  uint64_t generation;
+  char **envp;          /* NULL terminated, valid while envp_stale is false */
+  size_t envp_cap;
+  bool envp_stale;
+};
+
+/* Check whether a string is a valid variable name (letters, digits and _, not starting with a digit)
+ * Parameters: char const *name, size_t len
+ * Returns: true if it is */
+static bool is_var_name(char const *name, size_t len) {
+  if (len == 0 || isdigit((unsigned char) name[0])) return false;
+  for (size_t i = 0; i < len; ++i) {
+    if (!isalnum((unsigned char) name[i]) && name[i] != '_') return false;
+  }
+  return true;
+}
+
+/* Find the slot for a name, or the empty slot where it belongs
+ * Parameters: struct var_store const *store (capacity must be nonzero), char const *name, size_t len
+ * Returns: pointer to the matching or empty slot */
+static struct var_entry *var_slot(struct var_store const *store, char const *name, size_t len) {
+  size_t mask = store->capacity - 1;
+  for (size_t i = hash_bytes(name, len) & mask;; i = (i + 1) & mask) {
+    struct var_entry *entry = &store->slots[i];
+    if (!entry->text || (entry->name_len == len && memcmp(entry->text, name, len) == 0)) return entry;
+  }
+}
+
+/* Look up a variable by a name that need not be NUL terminated
+ * Parameters: struct var_store const *store, char const *name, size_t len
+ * Returns: the value, or NULL if the variable is not set */
+static char const *var_get_n(struct var_store const *store, char const *name, size_t len) {
+  if (store->capacity == 0) return NULL;
+  struct var_entry const *entry = var_slot(store, name, len);
+  return entry->text && entry->has_value ? entry->text + len + 1 : NULL;
+}
+
+/* Look up a variable
+ * Parameters: struct var_store const *store, char const *name
+ * Returns: the value, or NULL if the variable is not set */
+static char const *var_get(struct var_store const *store, char const *name) {
+  return var_get_n(store, name, strlen(name));
+}
+
+/* Double the number of slots, rehashing existing entries
+ * Parameters: struct var_store *store
+ * Returns: 0 on success, -1 if allocation failed */
+static int var_store_grow(struct var_store *store) {
+  size_t new_capacity = store->capacity ? store->capacity * 2 : 128;
+  struct var_store old = *store;
+  store->slots = calloc(new_capacity, sizeof *store->slots);
+  if (!store->slots) {
+    store->slots = old.slots;
+    return -1;
+  }
+  store->capacity = new_capacity;
+  for (size_t i = 0; i < old.capacity; ++i) {
+    if (old.slots[i].text) *var_slot(store, old.slots[i].text, old.slots[i].name_len) = old.slots[i];
+  }
+  free(old.slots);
+  return 0;
+}
+
+/* Set a variable, or with a NULL value only mark it for export
+ * Parameters: struct var_store *store, char const *name, size_t name_len,
+ *             char const *value (NULL leaves the value as it is), bool export (true also exports it; false
+ *             keeps the current export flag)
+ * Returns: 0 on success, -1 if allocation failed */
+static int var_set(struct var_store *store, char const *name, size_t name_len, char const *value, bool export) {
+  if ((store->count + 1) * 2 > store->capacity && var_store_grow(store) != 0) return -1;
+  struct var_entry *entry = var_slot(store, name, name_len);
+  if (!entry->text || value) {
+    size_t value_len = value ? strlen(value) : 0;
+    char *text = malloc(name_len + value_len + 2);
+    if (!text) return -1;
+    memcpy(text, name, name_len);
+    text[name_len] = '=';
+    if (value) memcpy(text + name_len + 1, value, value_len);
+    text[name_len + 1 + value_len] = '\0';
+    if (!entry->text) {
+      store->count++;
+      *entry = (struct var_entry) { .name_len = name_len };
+    }
+    free(entry->text);
+    entry->text = text;
+    entry->has_value = entry->has_value || value;
+  }
+  if (export) entry->exported = true;
+  if (entry->exported) store->envp_stale = true;
+  store->generation++;
+  return 0;
+}
+
+/* Remove a variable; later entries of its probe run are shifted back so lookups never need tombstones
+ * Parameters: struct var_store *store, char const *name
+ * Returns: nothing */
+static void var_unset(struct var_store *store, char const *name) {
+  if (store->capacity == 0) return;
+  struct var_entry *entry = var_slot(store, name, strlen(name));
+  if (!entry->text) return;
+  if (entry->exported) store->envp_stale = true;
+  free(entry->text);
+  store->count--;
+  store->generation++;
+
+  size_t mask = store->capacity - 1;
+  size_t hole = entry - store->slots;
+  for (size_t i = (hole + 1) & mask; store->slots[i].text; i = (i + 1) & mask) {
+    size_t home = hash_bytes(store->slots[i].text, store->slots[i].name_len) & mask;
+    // Move the entry into the hole unless its home lies cyclically between the hole and its position
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      store->slots[hole] = store->slots[i];
+      hole = i;
+    }
+  }
+  store->slots[hole] = (struct var_entry) {0};
+}
+
+/* Load an environment into the store, marking every variable as exported
+ * Parameters: struct var_store *store, char **env (NULL terminated "NAME=value" strings)
+ * Returns: 0 on success, -1 if allocation failed */
+static int var_store_import(struct var_store *store, char **env) {
+  for (; *env; ++env) {
+    char const *equals = strchr(*env, '=');
+    if (!equals || !is_var_name(*env, equals - *env)) continue;
+    if (var_set(store, *env, equals - *env, equals + 1, true) != 0) return -1;
+  }
+  return 0;
+}
+
+/* Get the environment for exec, rebuilding it first if an exported variable changed since the last call
+ * Parameters: struct var_store *store
+ * Returns: NULL terminated array of "NAME=value" strings owned by the store, or NULL if allocation failed */
+static char **var_envp(struct var_store *store) {
+  if (store->envp && !store->envp_stale) return store->envp;
+  size_t count = 0;
+  for (size_t i = 0; i < store->capacity; ++i) count += store->slots[i].exported && store->slots[i].has_value;
+  if (count + 1 > store->envp_cap) {
+    char **grown = realloc(store->envp, sizeof *grown * (count + 1));
+    if (!grown) return NULL;
+    store->envp = grown;
+    store->envp_cap = count + 1;
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < store->capacity; ++i) {
+    if (store->slots[i].exported && store->slots[i].has_value) store->envp[n++] = store->slots[i].text;
+  }
+  store->envp[n] = NULL;
+  store->envp_stale = false;
+  return store->envp;
+}
+
+/* Values substituted by the parameter expander. The $$ string is formatted once at startup; $? and $! are
+ * formatted once per line rather than once per word. */
+struct builtin_ctx;
+
+struct expand_ctx {
+  char const *home;        /* Replaces a leading ~ in ~/ */
+  char shell_pid[24];      /* $$ */
+  char exit_status[24];    /* $? */
+  char bg_pid[24];         /* $! (empty until a background command has run) */
+  struct var_store const *vars; /* ${NAME}; an unset variable expands to "" */
+  struct builtin_ctx *exec;     /* Runs $(...) substitutions; without it they are left as they are */
+};
+
+static char *run_substitution(struct arena *arena, struct builtin_ctx *ctx, char const *command, size_t len);
+
+/* Recognize the parameter starting at word[0], which must be a '$'
+ * Parameters: char const *word, struct expand_ctx const *ctx,
+ *             size_t *param_len (set to the number of characters the parameter occupies)
+ * Returns: the substitution string, or NULL if word does not start a parameter */
+static char const *match_param(char const *word, struct expand_ctx const *ctx, size_t *param_len) {
+  switch (word[1]) {
+    case '$': *param_len = 2; return ctx->shell_pid;
+    case '?': *param_len = 2; return ctx->exit_status;
+    case '!': *param_len = 2; return ctx->bg_pid;
+    case '{': {
+      char const *close = strchr(word + 2, '}');
+      if (!close || close == word + 2) return NULL;
+      size_t name_len = close - (word + 2);
+      for (size_t i = 0; i < name_len; ++i) {
+        if (!isalnum((unsigned char) word[2 + i]) && word[2 + i] != '_') return NULL;
+      }
+      char const *value = ctx->vars ? var_get_n(ctx->vars, word + 2, name_len) : NULL;
+      *param_len = name_len + 3;
+      return value ? value : "";
+    }
+    default: return NULL;
+  }
+}
+
+/* Find the end of a $(...) command substitution; parentheses inside it nest
+ * Parameters: char const *start (points at the '$' of "$(")
+ * Returns: pointer to the matching ')', or NULL if the substitution is not closed */
+static char const *substitution_end(char const *start) {
+  size_t depth = 0;
+  for (char const *c = start + 1; *c; ++c) {
+    if (*c == '(') depth++;
+    else if (*c == ')' && --depth == 0) return c;
+  }
+  return NULL;
+}
+
+/* Append bytes to a string being built in the arena, doubling its capacity as needed
+ * Parameters: struct arena *arena, char **buf, size_t *len, size_t *cap, char const *bytes, size_t count
+ * Returns: 0 on success, -1 on allocation failure */
+static int arena_append(struct arena *arena, char **buf, size_t *len, size_t *cap, char const *bytes, size_t count) {
+  if (*len + count + 1 > *cap) {
+    size_t new_cap = *cap ? *cap * 2 : 64;
+    while (new_cap < *len + count + 1) new_cap *= 2;
+    char *grown = arena_realloc(arena, *buf, *cap, new_cap);
+    if (!grown) return -1;
+    *buf = grown;
+    *cap = new_cap;
+  }
+  memcpy(*buf + *len, bytes, count);
+  *len += count;
+  (*buf)[*len] = '\0';
+  return 0;
+}
+
+/* Parameter expansion of a word containing $(...) command substitutions. Each command runs once, as the
+ * expansion reaches it, so the word is built in a single pass into a growing buffer instead of being sized
+ * first. As elsewhere, substituted text is never rescanned.
+ * Parameters: struct arena *arena (holds the expanded word), char const *word, struct expand_ctx const *ctx
+ * Returns: the expanded word, or NULL on a fatal error */
+static char *expand_word_substituting(struct arena *arena, char const *word, struct expand_ctx const *ctx) {
+  char *out = NULL;
+  size_t out_len = 0, out_cap = 0;
+  char const *in = word;
+  if (word[0] == '~' && word[1] == '/') {
+    if (arena_append(arena, &out, &out_len, &out_cap, ctx->home, strlen(ctx->home)) != 0) return NULL;
+    in++;
+  }
+  while (*in) {
+    char const *next = strchr(in, '$');
+    if (!next) next = in + strlen(in);
+    if (arena_append(arena, &out, &out_len, &out_cap, in, next - in) != 0) return NULL;
+    in = next;
+    if (!*in) break;
+    char const *sub;
+    size_t param_len;
+    char const *end = in[1] == '(' ? substitution_end(in) : NULL;
+    if (end) {
+      if (!(sub = run_substitution(arena, ctx->exec, in + 2, end - (in + 2)))) return NULL;
+      param_len = end + 1 - in;
+    } else if (!(sub = match_param(in, ctx, &param_len))) {
+      sub = "$"; /* A '$' that starts nothing is kept */
+      param_len = 1;
+    }
+    if (arena_append(arena, &out, &out_len, &out_cap, sub, strlen(sub)) != 0) return NULL;
+    in += param_len;
+  }
+  if (!out && arena_append(arena, &out, &out_len, &out_cap, "", 0) != 0) return NULL;
+  return out;
+}
+
+/* Single-pass parameter expansion of ~/, $$, $?, $!, ${NAME} and $(...)
+ * The word is scanned once to size the result, then written left to right into one arena allocation.
+ * Substituted text is never rescanned. Words with a command substitution go to expand_word_substituting.
+ * Parameters: struct arena *arena (holds the expanded word), char const *word, struct expand_ctx const *ctx
+ * Returns: the expanded word, word itself if it contains nothing to expand, or NULL on allocation failure
+ *          or a fatal error while running a substitution */
+static char *expand_word(struct arena *arena, char const *word, struct expand_ctx const *ctx) {
+  bool expand_home = word[0] == '~' && word[1] == '/';
+  char const *dollar = strchr(word, '$');
+  if (!expand_home && !dollar) return (char *) word;
+  if (ctx->exec && dollar && strstr(dollar, "$(")) return expand_word_substituting(arena, word, ctx);
+
+  // Sizing pass
+  size_t home_len = strlen(ctx->home);
+  size_t out_len = 0;
+  char const *in = word;
+  if (expand_home) {
+    out_len += home_len;
+    in++;
+  }
+  while (*in) {
+    size_t param_len;
+    char const *sub = *in == '$' ? match_param(in, ctx, &param_len) : NULL;
+    if (sub) {
+      out_len += strlen(sub);
+      in += param_len;
+    } else {
+      out_len++;
+      in++;
+    }
+  }
+
+  // Writing pass
+  char *expanded = arena_alloc(arena, out_len + 1);
+  if (!expanded) return NULL;
+  char *out = expanded;
+  in = word;
+  if (expand_home) {
+    memcpy(out, ctx->home, home_len);
+    out += home_len;
+    in++;
+  }
+  while (*in) {
+    char const *next = strchr(in, '$');
+    if (!next) next = in + strlen(in);
+    memcpy(out, in, next - in); /* Copy the literal run up to the next '$' */
+    out += next - in;
+    in = next;
+    if (!*in) break;
+    size_t param_len;
+    char const *sub = match_param(in, ctx, &param_len);
+    if (sub) {
+      size_t sub_len = strlen(sub);
+      memcpy(out, sub, sub_len);
+      out += sub_len;
+      in += param_len;
+    } else {
+      *out++ = *in++;
+    }
+  }
+  *out = '\0';
+  return expanded;
+}
+
+/* IFS word splitter. IFS is turned into a 256-bit membership table, and the distinct delimiter bytes are kept
+ * for the SIMD kernels, only when its value changes. The line is classified 64 bytes at a time into a bitmask
+ * of delimiter positions, and words are read off the mask's transitions, so the per-byte work is a table
+ * lookup (scalar) or a few vector compares (SSE2/AVX2) instead of strtok's scan of the delimiter string.
+ * The same pass marks each '$', so a command substitution is found without scanning the line separately.
+ * The kernel is chosen at runtime from the CPU's features, or with SMALLSH_TOKENIZER=scalar|sse2|avx2. */
+#define IFS_SIMD_MAX_DELIMS 8 /* Beyond this many distinct bytes the vector compares lose to the table */
+
+struct ifs_table;
+typedef uint64_t classify_fn(struct ifs_table const *table, unsigned char const *block, uint64_t *dollars);
+
+struct ifs_table {
+  char *ifs;                                    /* Copy of the IFS value the table was built from */
+  uint64_t bits[4];                             /* Bit b set when byte b is a delimiter */
+  unsigned char delims[IFS_SIMD_MAX_DELIMS];
+  size_t num_delims;                            /* Distinct delimiter bytes, more than the max means table only */
+  classify_fn *classify;                        /* Delimiter mask of 64 bytes */
+  char const *kernel;                           /* Name of the classify function, for benchmarks */
+  uint64_t generation;                          /* Variable store generation IFS was last checked at */
+  uint64_t version;                             /* Bumped each time the delimiters change */
+};
+
+struct token_span {
+  size_t start;
+  size_t len;
+};
+
+/* Classify 64 bytes with the membership table
+ * Parameters: struct ifs_table const *table, unsigned char const *block (64 readable bytes),
+ *             uint64_t *dollars (set to the bitmask of the '$' bytes)
+ * Returns: bitmask with bit i set when block[i] is a delimiter */
+static uint64_t classify_scalar(struct ifs_table const *table, unsigned char const *block, uint64_t *dollars) {
+  uint64_t mask = 0, dollar_mask = 0;
+  for (size_t i = 0; i < 64; ++i) {
+    mask |= ((table->bits[block[i] >> 6] >> (block[i] & 63)) & 1) << i;
+    dollar_mask |= (uint64_t) (block[i] == '$') << i;
+  }
+  *dollars = dollar_mask;
+  return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Classify 64 bytes by comparing 16 at a time against each delimiter byte
+ * Parameters and return value as for classify_scalar */
+__attribute__((target("sse2")))
+static uint64_t classify_sse2(struct ifs_table const *table, unsigned char const *block, uint64_t *dollars) {
+  uint64_t mask = 0, dollar_mask = 0;
+  for (size_t part = 0; part < 4; ++part) {
+    __m128i bytes = _mm_loadu_si128((__m128i const *) (block + 16 * part));
+    __m128i hits = _mm_setzero_si128();
+    for (size_t d = 0; d < table->num_delims; ++d) {
+      hits = _mm_or_si128(hits, _mm_cmpeq_epi8(bytes, _mm_set1_epi8((char) table->delims[d])));
+    }
+    mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(hits) << (16 * part);
+    dollar_mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('$'))) << (16 * part);
+  }
+  *dollars = dollar_mask;
+  return mask;
+}
+
+/* Classify 64 bytes by comparing 32 at a time against each delimiter byte
+ * Parameters and return value as for classify_scalar */
+__attribute__((target("avx2")))
+static uint64_t classify_avx2(struct ifs_table const *table, unsigned char const *block, uint64_t *dollars) {
+  __m256i low = _mm256_loadu_si256((__m256i const *) block);
+  __m256i high = _mm256_loadu_si256((__m256i const *) (block + 32));
+  __m256i low_hits = _mm256_setzero_si256(), high_hits = _mm256_setzero_si256();
+  for (size_t d = 0; d < table->num_delims; ++d) {
+    __m256i delim = _mm256_set1_epi8((char) table->delims[d]);
+    low_hits = _mm256_or_si256(low_hits, _mm256_cmpeq_epi8(low, delim));
+    high_hits = _mm256_or_si256(high_hits, _mm256_cmpeq_epi8(high, delim));
+  }
+  __m256i dollar = _mm256_set1_epi8('$');
+  *dollars = (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(low, dollar))
+             | (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(high, dollar)) << 32;
+  return (uint64_t) (uint32_t) _mm256_movemask_epi8(low_hits)
+         | (uint64_t) (uint32_t) _mm256_movemask_epi8(high_hits) << 32;
+}
+#endif
+
+/* Rebuild the delimiter table if IFS has changed since it was last built, choosing the classify kernel
+ * IFS is only looked up again when some variable has changed since the last call.
+ * Parameters: struct ifs_table *table, struct var_store const *vars
+ * Returns: 0 on success, -1 if allocation failed */
+static int ifs_table_update(struct ifs_table *table, struct var_store const *vars) {
+  if (table->ifs && table->generation == vars->generation) return 0;
+  table->generation = vars->generation;
+  char const *ifs = var_get(vars, "IFS");
+  if (!ifs) ifs = " \t\n"; /* Default delimiters when IFS is unset */
+  if (table->ifs && strcmp(table->ifs, ifs) == 0) return 0;
+
+  char *copy = strdup(ifs);
+  if (!copy) return -1;
+  free(table->ifs);
+  table->ifs = copy;
+  table->version++;
+  memset(table->bits, 0, sizeof table->bits);
+  table->num_delims = 0;
+  for (unsigned char const *c = (unsigned char const *) ifs; *c; ++c) {
+    if ((table->bits[*c >> 6] >> (*c & 63)) & 1) continue;
+    table->bits[*c >> 6] |= (uint64_t) 1 << (*c & 63);
+    if (table->num_delims < IFS_SIMD_MAX_DELIMS) table->delims[table->num_delims] = *c;
+    table->num_delims++;
+  }
+
+  table->classify = classify_scalar;
+  table->kernel = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+  char const *requested = getenv("SMALLSH_TOKENIZER");
+  if (table->num_delims <= IFS_SIMD_MAX_DELIMS && (!requested || strcmp(requested, "scalar") != 0)) {
+    if (__builtin_cpu_supports("avx2") && (!requested || strcmp(requested, "avx2") == 0)) {
+      table->classify = classify_avx2;
+      table->kernel = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+      table->classify = classify_sse2;
+      table->kernel = "sse2";
+    }
+  }
+#endif
+  return 0;
+}
+
+/* Append a word's span to a vector held in the arena, growing the vector geometrically
+ * Parameters: struct arena *arena, struct token_span **spans (vector), size_t *count, size_t *capacity,
+ *             size_t start, size_t len
+ * Returns: 0 on success, -1 on allocation failure */
+static int push_span(struct arena *arena, struct token_span **spans, size_t *count, size_t *capacity,
+                     size_t start, size_t len) {
+  if (*count == *capacity) {
+    size_t new_capacity = *capacity ? *capacity * 2 : 16;
+    struct token_span *grown = arena_realloc(arena, *spans, sizeof **spans * *capacity, sizeof **spans * new_capacity);
+    if (!grown) return -1;
+    *spans = grown;
+    *capacity = new_capacity;
+  }
+  (*spans)[(*count)++] = (struct token_span) { .start = start, .len = len };
+  return 0;
+}
+
+/* Find where the word holding a command substitution ends; delimiters between the parentheses do not end it
+ * Scans a byte at a time against the membership table, tracking how deeply parentheses nest.
+ * Parameters: struct ifs_table const *table, char const *line, size_t len (line[len] must be '\0'),
+ *             size_t i (position of the '$' of a "$(")
+ * Returns: position of the delimiter that ends the word, or len */
+static size_t substitution_word_end(struct ifs_table const *table, char const *line, size_t len, size_t i) {
+  for (size_t depth = 0; i < len; ++i) {
+    unsigned char c = line[i];
+    if (depth == 0 && ((table->bits[c >> 6] >> (c & 63)) & 1)) break;
+    if (c == '$' && line[i + 1] == '(') {
+      depth++;
+      i++;
+    } else if (depth > 0 && c == '(') {
+      depth++;
+    } else if (depth > 0 && c == ')') {
+      depth--;
+    }
+  }
+  return i;
+}
+
+/* Find the words of a line, terminating each in place
+ * The line is classified in 64-byte blocks; a final partial block is copied into a buffer and the bytes past
+ * the end count as delimiters. Each bit where the mask changes value starts or ends a word. A block holding a
+ * "$(" is read only up to it, the word containing the substitution is found by substitution_word_end, and
+ * classification resumes after that word, so only the substitution's own bytes are scanned one at a time.
+ * Parameters: struct arena *arena (holds the spans), struct ifs_table const *table,
+ *             char *line, size_t len (line[len] must be '\0'),
+ *             struct token_span **spans (set to the words found), size_t *num_spans
+ * Returns: 0 on success, -1 if allocation failed */
+static int split_words(struct arena *arena, struct ifs_table const *table, char *line, size_t len,
+                       struct token_span **spans, size_t *num_spans) {
+  size_t capacity = 0, word_start = 0;
+  uint64_t prev_delim = 1; /* The line is treated as if preceded by a delimiter */
+  *spans = NULL;
+  *num_spans = 0;
+
+  for (size_t base = 0; base < len;) {
+    uint64_t delims, dollars;
+    if (len - base >= 64) {
+      delims = table->classify(table, (unsigned char const *) line + base, &dollars);
+    } else {
+      unsigned char tail[64];
+      memcpy(tail, line + base, len - base);
+      delims = table->classify(table, tail, &dollars) | (~(uint64_t) 0 << (len - base));
+    }
+
+    // The first "$(" in the block, skipping a '$' that is a delimiter itself (and the padding past the end)
+    size_t sub = 64;
+    for (uint64_t candidates = dollars & ~delims; candidates; candidates &= candidates - 1) {
+      size_t i = (size_t) __builtin_ctzll(candidates);
+      if (line[base + i + 1] == '(') {
+        sub = i;
+        break;
+      }
+    }
+
+    // Bit i of changes is set where byte i differs in class from the byte before it
+    uint64_t changes = delims ^ ((delims << 1) | prev_delim);
+    if (sub < 64) changes &= ((uint64_t) 2 << sub) - 1; /* Up to and including the '$' */
+    for (; changes; changes &= changes - 1) {
+      size_t i = (size_t) __builtin_ctzll(changes);
+      if (!((delims >> i) & 1)) {
+        word_start = base + i;
+        continue;
+      }
+      if (push_span(arena, spans, num_spans, &capacity, word_start, base + i - word_start) != 0) return -1;
+      line[base + i] = '\0';
+    }
+    if (sub == 64) {
+      prev_delim = delims >> 63;
+      base += 64;
+      continue;
+    }
+
+    size_t word_end = substitution_word_end(table, line, len, base + sub);
+    if (push_span(arena, spans, num_spans, &capacity, word_start, word_end - word_start) != 0) return -1;
+    line[word_end] = '\0';
+    prev_delim = 1;
+    base = word_end + 1;
+  }
+  // A word running up to a 64-byte boundary at the end of the line is already terminated by the line's NUL
+  if (!prev_delim && push_span(arena, spans, num_spans, &capacity, word_start, len - word_start) != 0) return -1;
+  return 0;
+}
+
+/* Block-buffered line reader for scripts and -c strings. Input is read with large read(2) calls into one
+ * reusable buffer and lines are split in place, so a line costs no allocation and no stdio call. */
+#define READER_BLOCK_SIZE 65536
+
+struct line_reader {
+  int fd;        /* -1 when reading a fixed string */
+  char *buf;
+  size_t cap;
+  size_t start;  /* First byte not yet returned */
+  size_t end;    /* One past the last byte read */
+  bool eof;
+  bool owns_buf;
+  int (*wait_input)(void *arg, int fd); /* Called before each read when set; lets the shell wait on other events */
+  void *wait_arg;
+  /* Reads whole lines instead of the buffer when set (the interactive line editor), taking the prompt the
+   * caller printed so it can be redrawn */
+  ssize_t (*edit_line)(void *arg, char const *prompt, char **line);
+  void *edit_arg;
+  char const *prompt;  /* Printed before the next line; cleared once it has been read */
+};
+
+/* Set up a reader over a file descriptor
+ * Parameters: struct line_reader *reader, int fd
+ * Returns: 0 on success, -1 if the buffer could not be allocated */
+static int reader_open_fd(struct line_reader *reader, int fd) {
+  *reader = (struct line_reader) { .fd = fd, .cap = READER_BLOCK_SIZE, .owns_buf = true };
+  reader->buf = malloc(reader->cap);
+  return reader->buf ? 0 : -1;
+}
+
+/* Set up a reader over a writable string, such as the argument to -c, which is split in place
+ * Parameters: struct line_reader *reader, char *str
+ * Returns: nothing */
+static void reader_open_string(struct line_reader *reader, char *str) {
+  size_t len = strlen(str);
+  /* The terminating NUL is writable too, so an unterminated final line can still be terminated in place */
+  *reader = (struct line_reader) { .fd = -1, .buf = str, .cap = len + 1, .end = len, .eof = true };
+}
+
+/* Return the next line with its newline replaced by a NUL; the line stays valid until the next call
+ * Parameters: struct line_reader *reader, char **line (set to the start of the line)
+ * Returns: length of the line, or -1 at end of input or on a read error (errno is nonzero for errors, and is
+ *          EINTR when a signal interrupted the wait; any partial line is kept for the next call) */
+static ssize_t reader_next_line(struct line_reader *reader, char **line) {
+  if (reader->edit_line) {
+    char const *prompt = reader->prompt ? reader->prompt : "";
+    reader->prompt = NULL;
+    return reader->edit_line(reader->edit_arg, prompt, line);
+  }
+  size_t scanned = reader->start;
+  for (;;) {
+    char *newline = memchr(reader->buf + scanned, '\n', reader->end - scanned);
+    if (newline || (reader->eof && reader->start < reader->end)) {
+      size_t line_end = newline ? (size_t) (newline - reader->buf) : reader->end;
+      if (!newline && reader->end == reader->cap) {
+        // Final unterminated line fills the buffer exactly; there is no byte left to terminate it in place
+        char *grown = realloc(reader->buf, reader->cap + 1);
+        if (!grown) return -1;
+        reader->buf = grown;
+        reader->cap++;
+      }
+      reader->buf[line_end] = '\0';
+      *line = reader->buf + reader->start;
+      ssize_t line_length = line_end - reader->start;
+      reader->start = newline ? line_end + 1 : reader->end;
+      return line_length;
+    }
+    if (reader->eof) return -1;
+
+    // Keep the partial line, moving it to the front of the buffer and growing the buffer if it is full
+    if (reader->start > 0) {
+      memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+      reader->end -= reader->start;
+      reader->start = 0;
+    }
+    scanned = reader->end;
+    if (reader->end == reader->cap) {
+      char *grown = realloc(reader->buf, reader->cap * 2);
+      if (!grown) return -1;
+      reader->buf = grown;
+      reader->cap *= 2;
+    }
+    if (reader->wait_input && reader->wait_input(reader->wait_arg, reader->fd) == -1) return -1;
+    ssize_t got = read(reader->fd, reader->buf + reader->end, reader->cap - reader->end);
+    if (got == -1) return -1;
+    if (got == 0) reader->eof = true;
+    reader->end += got;
+  }
+}
+
+/* Release a reader's buffer and file descriptor
+ * Parameters: struct line_reader *reader
+ * Returns: nothing */
+static void reader_close(struct line_reader *reader) {
+  if (reader->owns_buf) free(reader->buf);
+  if (reader->fd > STDERR_FILENO) close(reader->fd);
+  reader->buf = NULL;
+}
+
+/* Signal handler for SIGINT that does nothing per project specs 
+ * based on examples in CS344's signal handling modules
+ * Parameters: int signal_no (signal number)
+ * Returns: nothing */
+void handle_SIGINT(int signal_no) {
+}
+
+/* Send all children processes in same process group a SIGINT signal prior to exiting
+ * Parameters: None
+ * Returns: 0 on success, -1 if an error occurred */
+int handle_child_procs_exit(void) {
+  pid_t proc_pid;
+  int proc_status;
+  while ((proc_pid = waitpid(0, &proc_status, WUNTRACED | WCONTINUED | WNOHANG)) > 0) {
+    if (kill(proc_pid, SIGINT) == -1) err(errno, "Unable to send SIGINT signal");
+    return -1;
+  }
+  return 0;
+}
+
+/* Hashed PATH lookup cache. Maps command names to the absolute path found by walking PATH so that
+ * repeated launches skip execvp's failed execve per PATH directory. Open addressing with linear probing;
+ * an entry whose path is NULL has gone stale and is treated as a miss. */
+struct path_cache_entry {
+  char *name;
+  char *path;
+  size_t hits;
+};
+
+struct path_cache {
+  struct path_cache_entry *slots;
+  size_t capacity; /* Always a power of two */
+  size_t count;
+  char *path_var;  /* Copy of PATH the entries were resolved against */
+  uint64_t generation; /* Variable store generation PATH was last checked at */
+  char *uncached;  /* Last path found through a relative PATH element, which depends on the directory */
+  size_t hits;
+  size_t misses;
+};
+
+/* Drop every entry and counter in the PATH cache
+ * Parameters: struct path_cache *cache
+ * Returns: nothing */
+static void path_cache_reset(struct path_cache *cache) {
+  for (size_t i = 0; i < cache->capacity; ++i) {
+    free(cache->slots[i].name);
+    free(cache->slots[i].path);
+  }
+  free(cache->slots);
+  free(cache->path_var);
+  free(cache->uncached);
+  *cache = (struct path_cache) {0};
+}
+
+/* Find the slot for name, or the empty slot where it belongs
+ * Parameters: struct path_cache *cache (capacity must be nonzero), char const *name
+ * Returns: pointer to the matching or empty slot */
+static struct path_cache_entry *path_cache_slot(struct path_cache *cache, char const *name) {
+  size_t mask = cache->capacity - 1;
+  for (size_t i = hash_str(name) & mask;; i = (i + 1) & mask) {
+    if (!cache->slots[i].name || strcmp(cache->slots[i].name, name) == 0) return &cache->slots[i];
+  }
+}
+
+/* Double the number of slots in the PATH cache, rehashing existing entries
+ * Parameters: struct path_cache *cache
+ * Returns: 0 on success, -1 if allocation failed */
+static int path_cache_grow(struct path_cache *cache) {
+  size_t new_capacity = cache->capacity ? cache->capacity * 2 : 64;
+  struct path_cache old = *cache;
+  cache->slots = calloc(new_capacity, sizeof *cache->slots);
+  if (!cache->slots) {
+    cache->slots = old.slots;
+    return -1;
+  }
+  cache->capacity = new_capacity;
+  for (size_t i = 0; i < old.capacity; ++i) {
+    if (old.slots[i].name) *path_cache_slot(cache, old.slots[i].name) = old.slots[i];
+  }
+  free(old.slots);
+  return 0;
+}
+
+/* Walk the PATH directories for an executable regular file called name
+ * Parameters: char const *path_var (value of PATH), char const *name (command name without a slash),
+ *             bool *cwd_dependent (set when an empty or relative element was searched, so that the result can
+ *             change with the working directory)
+ * Returns: malloc'd path, or NULL if no directory holds an executable name */
+static char *search_path(char const *path_var, char const *name, bool *cwd_dependent) {
+  size_t name_len = strlen(name);
+  char const *dir = path_var;
+  *cwd_dependent = false;
+  for (;;) {
+    char const *dir_end = strchr(dir, ':');
+    size_t dir_len = dir_end ? (size_t) (dir_end - dir) : strlen(dir);
+    char *candidate = malloc(dir_len + name_len + 3);
+    if (!candidate) return NULL;
+    if (dir_len == 0) {
+      memcpy(candidate, "./", 2); /* Empty PATH element means the current directory */
+      memcpy(candidate + 2, name, name_len + 1);
+    } else {
+      memcpy(candidate, dir, dir_len);
+      candidate[dir_len] = '/';
+      memcpy(candidate + dir_len + 1, name, name_len + 1);
+    }
+    if (candidate[0] != '/') *cwd_dependent = true;
+    struct stat sb;
+    if (stat(candidate, &sb) == 0 && S_ISREG(sb.st_mode) && access(candidate, X_OK) == 0) return candidate;
+    free(candidate);
+    if (!dir_end) break;
+    dir = dir_end + 1;
+  }
+  errno = 0; /* Failed stat/access calls are expected while searching */
+  return NULL;
+}
+
+/* Resolve a command name through the PATH cache, filling the cache on a miss
+ * The cache is flushed when PATH differs from the value it was built against, and a cached path that is
+ * no longer executable is re-resolved. Paths found only by searching an empty or relative element are not cached.
+ * PATH is only looked up again when some variable has changed since the last call.
+ * Parameters: struct path_cache *cache, struct var_store const *vars, char const *name (command name)
+ * Returns: path owned by the cache and valid until the next lookup, or NULL if name contains a slash or was
+ *          not found */
+static char const *path_cache_lookup(struct path_cache *cache, struct var_store const *vars, char const *name) {
+  if (strchr(name, '/')) return NULL;
+  if (!cache->path_var || cache->generation != vars->generation) {
+    char const *path_var = var_get(vars, "PATH");
+    if (!path_var) path_var = "/bin:/usr/bin"; /* Same default search path execvp uses */
+    if (!cache->path_var || strcmp(cache->path_var, path_var) != 0) {
+      size_t hits = cache->hits, misses = cache->misses;
+      path_cache_reset(cache);
+      cache->hits = hits;
+      cache->misses = misses;
+      cache->path_var = strdup(path_var);
+      if (!cache->path_var) return NULL;
+    }
+    cache->generation = vars->generation;
+  }
+  char const *path_var = cache->path_var;
+  if ((cache->count + 1) * 2 > cache->capacity && path_cache_grow(cache) != 0) return NULL;
+
+  struct path_cache_entry *entry = path_cache_slot(cache, name);
+  if (entry->path) {
+    if (access(entry->path, X_OK) == 0) {
+      entry->hits++;
+      cache->hits++;
+      return entry->path;
+    }
+    free(entry->path); /* Stale: binary moved or removed since it was cached */
+    entry->path = NULL;
+  }
+
+  cache->misses++;
+  bool cwd_dependent;
+  char *path = search_path(path_var, name, &cwd_dependent);
+  if (!path) return NULL;
+  // A hit at or past a relative element could be a different file after cd, so it is not cached
+  if (cwd_dependent) {
+    free(cache->uncached);
+    cache->uncached = path;
+    return path;
+  }
+  if (!entry->name) {
+    entry->name = strdup(name);
+    if (!entry->name) {
+      free(path);
+      return NULL;
+    }
+    cache->count++;
+  }
+  entry->path = path;
+  entry->hits = 1;
+  return entry->path;
+}
+
+/* Pick the launch engine from the SMALLSH_LAUNCH environment variable, falling back to the build default
+ * Parameters: None
+ * Returns: LAUNCH_FORK or LAUNCH_SPAWN */
+static enum launch_mode get_launch_mode(void) {
+  char const *mode = getenv("SMALLSH_LAUNCH");
+  if (mode && strcmp(mode, "fork") == 0) return LAUNCH_FORK;
+  if (mode && strcmp(mode, "spawn") == 0) return LAUNCH_SPAWN;
+  return SMALLSH_DEFAULT_LAUNCH;
+}
+
+/* Process settings a command's launch prefixes apply between fork and exec */
+#define LAUNCH_MAX_LIMITS 8
+
+struct launch_attrs {
+  bool has_affinity;
+  cpu_set_t affinity;
+  bool has_nice;
+  int nice;          /* Added to the niceness the child inherits */
+  struct {
+    int resource;
+    rlim_t value;    /* Soft and hard limit */
+  } limits[LAUNCH_MAX_LIMITS];
+  size_t num_limits;
+};
+
+/* Redirections of a command, applied in order once its pipe ends are in place */
+enum redir_kind {
+  REDIR_READ,        /* [N]< file */
+  REDIR_WRITE,       /* [N]> file, truncating it */
+  REDIR_APPEND,      /* [N]>> file */
+  REDIR_READ_WRITE,  /* [N]<> file, created if missing */
+  REDIR_DUP,         /* [N]>&M or [N]<&M */
+  REDIR_STRING,      /* [N]<<< word: the word and a newline */
+  REDIR_HEREDOC,     /* [N]<< DELIM: the input lines up to DELIM */
+};
+
+struct redirection {
+  enum redir_kind kind;
+  int fd;            /* Descriptor redirected */
+  int source_fd;     /* REDIR_DUP: descriptor copied, or -1 to close fd. REDIR_STRING and REDIR_HEREDOC: memfd
+                      * holding the text while the command is launched, otherwise -1 */
+  char *target;      /* File name or text; NULL for REDIR_DUP */
+};
+
+/* A simple command within a pipeline */
+struct command {
+  char **argv;       /* NULL terminated; argv[0] is NULL for a stage made only of redirections */
+  size_t argc;
+  struct redirection *redirs;
+  size_t num_redirs;
+  char **assigns;    /* Leading NAME=value words, added to the command's environment */
+  size_t num_assigns;
+  struct launch_attrs *attrs; /* From affinity, nice and limit prefixes, or NULL */
+};
+
+/* Background job table. Jobs live in a slot array whose free slots form a linked free list, and an open
+ * addressing index maps every process of a job to its slot, so the reaper finds a child's job in O(1). */
+enum job_state { JOB_RUNNING, JOB_STOPPED, JOB_DONE };
+
+struct job {
+  pid_t pid;            /* Last process of the pipeline, used for $! and as the job's id; 0 for a free slot */
+  int number;           /* %n */
+  enum job_state state;
+  int status;           /* Wait status of pid once it has finished */
+  size_t live_procs;    /* Processes of the pipeline not yet finished */
+  bool quiet;           /* Not reported before the prompt; set for jobs the parallel builtin tracks itself */
+  char *command;        /* Command text as it was run */
+  struct timespec started_at;  /* CLOCK_MONOTONIC */
+  struct timespec finished_at;
+  size_t next_free;     /* Free list link while the slot is unused */
+};
+
+struct job_index_entry {
+  pid_t pid;   /* 0 for an empty entry */
+  size_t slot;
+};
+
+/* Exit status of a job pruned after its done notice, kept so that wait can still report it */
+struct finished_job {
+  pid_t pid;
+  int status;
+};
+
+#define JOB_FINISHED_KEEP 64 /* Pruned jobs whose status wait can still report */
+
+struct job_table {
+  struct job *slots;
+  size_t num_slots;
+  size_t free_head;     /* First free slot, or num_slots when none is free */
+  size_t count;         /* Jobs in use */
+  int next_number;      /* Number for the next job; numbering starts again at 1 once the table empties */
+  struct job_index_entry *index;
+  size_t index_cap;     /* Power of two */
+  size_t index_count;
+  struct finished_job finished[JOB_FINISHED_KEEP]; /* Ring of the most recently pruned jobs */
+  size_t num_finished;  /* Jobs ever pruned; the ring holds the last JOB_FINISHED_KEEP of them */
+};
+
+/* Find the index entry for pid, or the empty entry where it belongs
+ * Parameters: struct job_table *jobs (index_cap must be nonzero), pid_t pid
+ * Returns: pointer to the entry */
+static struct job_index_entry *job_index_entry(struct job_table *jobs, pid_t pid) {
+  size_t mask = jobs->index_cap - 1;
+  for (size_t i = ((uint32_t) pid * 2654435761u) & mask;; i = (i + 1) & mask) {
+    if (jobs->index[i].pid == 0 || jobs->index[i].pid == pid) return &jobs->index[i];
+  }
+}
+
+/* Map a process id to a job slot in the index, growing the index as needed
+ * Parameters: struct job_table *jobs, pid_t pid, size_t slot
+ * Returns: 0 on success, -1 if allocation failed */
+static int job_index_add(struct job_table *jobs, pid_t pid, size_t slot) {
+  if ((jobs->index_count + 1) * 2 > jobs->index_cap) {
+    size_t old_cap = jobs->index_cap;
+    struct job_index_entry *old_index = jobs->index;
+    jobs->index_cap = old_cap ? old_cap * 2 : 64;
+    jobs->index = calloc(jobs->index_cap, sizeof *jobs->index);
+    if (!jobs->index) {
+      jobs->index = old_index;
+      jobs->index_cap = old_cap;
+      return -1;
+    }
+    for (size_t i = 0; i < old_cap; ++i) {
+      if (old_index[i].pid != 0) *job_index_entry(jobs, old_index[i].pid) = old_index[i];
+    }
+    free(old_index);
+  }
+  struct job_index_entry *entry = job_index_entry(jobs, pid);
+  if (entry->pid == 0) jobs->index_count++;
+  entry->pid = pid;
+  entry->slot = slot;
+  return 0;
+}
+
+/* Remove a process id from the index, shifting later entries of its probe run back into the gap
+ * Parameters: struct job_table *jobs, pid_t pid
+ * Returns: nothing */
+static void job_index_remove(struct job_table *jobs, pid_t pid) {
+  if (jobs->index_cap == 0) return;
+  size_t mask = jobs->index_cap - 1;
+  struct job_index_entry *entry = job_index_entry(jobs, pid);
+  if (entry->pid == 0) return;
+  size_t gap = entry - jobs->index;
+  for (size_t i = (gap + 1) & mask; jobs->index[i].pid != 0; i = (i + 1) & mask) {
+    size_t home = ((uint32_t) jobs->index[i].pid * 2654435761u) & mask;
+    // Move the entry into the gap unless its home lies cyclically between the gap and its position
+    if (((i - home) & mask) >= ((i - gap) & mask)) {
+      jobs->index[gap] = jobs->index[i];
+      gap = i;
+    }
+  }
+  jobs->index[gap].pid = 0;
+  jobs->index_count--;
+}
+
+/* Look up the job a running process belongs to
+ * Parameters: struct job_table *jobs, pid_t pid
+ * Returns: the job, or NULL if pid is not a running part of a job */
+static struct job *job_find_pid(struct job_table *jobs, pid_t pid) {
+  if (jobs->index_cap == 0 || pid <= 0) return NULL;
+  struct job_index_entry *entry = job_index_entry(jobs, pid);
+  return entry->pid ? &jobs->slots[entry->slot] : NULL;
+}
+
+/* Add a job for a background pipeline
+ * Parameters: struct job_table *jobs, pid_t const *pids (processes of the pipeline, last one identifies the job),
+ *             size_t num_pids, char const *command (text to show in jobs)
+ * Returns: the new job, or NULL if allocation failed */
+static struct job *job_add(struct job_table *jobs, pid_t const *pids, size_t num_pids, char const *command) {
+  if (jobs->free_head == jobs->num_slots) {
+    size_t new_num = jobs->num_slots ? jobs->num_slots * 2 : 16;
+    struct job *grown = realloc(jobs->slots, sizeof *grown * new_num);
+    if (!grown) return NULL;
+    for (size_t i = jobs->num_slots; i < new_num; ++i) grown[i] = (struct job) { .next_free = i + 1 };
+    jobs->slots = grown;
+    jobs->free_head = jobs->num_slots;
+    jobs->num_slots = new_num;
+  }
+
+  // Job numbers keep counting up, starting again at 1 once the table empties
+  int number = jobs->count > 0 ? jobs->next_number : 1;
+
+  size_t slot = jobs->free_head;
+  struct job *job = &jobs->slots[slot];
+  char *command_copy = strdup(command);
+  if (!command_copy) return NULL;
+  for (size_t i = 0; i < num_pids; ++i) {
+    if (job_index_add(jobs, pids[i], slot) != 0) {
+      while (i-- > 0) job_index_remove(jobs, pids[i]);
+      free(command_copy);
+      return NULL;
+    }
+  }
+  jobs->free_head = job->next_free;
+  jobs->next_number = number + 1;
+  *job = (struct job) {
+    .pid = pids[num_pids - 1], .number = number, .state = JOB_RUNNING,
+    .live_procs = num_pids, .command = command_copy,
+  };
+  clock_gettime(CLOCK_MONOTONIC, &job->started_at);
+  jobs->count++;
+  return job;
+}
+
+/* Remove a finished job, returning its slot to the free list
+ * Parameters: struct job_table *jobs, struct job *job (its processes must all have been reaped, which has
+ *             already removed them from the index)
+ * Returns: nothing */
+static void job_remove(struct job_table *jobs, struct job *job) {
+  free(job->command);
+  size_t slot = job - jobs->slots;
+  *job = (struct job) { .next_free = jobs->free_head };
+  jobs->free_head = slot;
+  jobs->count--;
+}
+
+/* Remove a finished job whose done notice has been printed, remembering its status for wait
+ * Parameters: struct job_table *jobs, struct job *job (in state JOB_DONE)
+ * Returns: nothing */
+static void job_prune(struct job_table *jobs, struct job *job) {
+  jobs->finished[jobs->num_finished++ % JOB_FINISHED_KEEP] = (struct finished_job) { job->pid, job->status };
+  job_remove(jobs, job);
+}
+
+/* Look up the status of a pruned job
+ * Parameters: struct job_table const *jobs, pid_t pid, int *status (set when found)
+ * Returns: true if pid is one of the last JOB_FINISHED_KEEP pruned jobs */
+static bool job_finished_status(struct job_table const *jobs, pid_t pid, int *status) {
+  size_t kept = jobs->num_finished < JOB_FINISHED_KEEP ? jobs->num_finished : JOB_FINISHED_KEEP;
+  // Newest first, in case the pid has been reused
+  for (size_t i = 1; i <= kept; ++i) {
+    struct finished_job const *finished = &jobs->finished[(jobs->num_finished - i) % JOB_FINISHED_KEEP];
+    if (finished->pid == pid) {
+      *status = finished->status;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* qsort comparison of jobs by number
+ * Parameters: void const *a, void const *b (struct job const **)
+ * Returns: negative, zero or positive as a's number is below, equal to or above b's */
+static int compare_job_numbers(void const *a, void const *b) {
+  int x = (*(struct job const *const *) a)->number, y = (*(struct job const *const *) b)->number;
+  return (x > y) - (x < y);
+}
+
+/* Record a state change of one of a job's processes
+ * Parameters: struct job_table *jobs, struct job *job, pid_t pid, int status (wait status),
+ *             struct timespec const *when (time the change was reaped)
+ * Returns: nothing */
+static void job_update(struct job_table *jobs, struct job *job, pid_t pid, int status, struct timespec const *when) {
+  if (WIFSTOPPED(status)) {
+    job->state = JOB_STOPPED;
+    return;
+  }
+  job->state = JOB_RUNNING; /* A stopped job that is reaped again has been continued or has finished */
+  if (pid == job->pid) job->status = status;
+  job_index_remove(jobs, pid); /* The pid may be reused by a new child from now on */
+  if (--job->live_procs == 0) {
+    job->state = JOB_DONE;
+    job->finished_at = *when;
+  }
+}
+
+/* Find a job from a wait/fg/bg argument: %n for a job number, otherwise a process id
+ * Parameters: struct job_table *jobs, char const *spec
+ * Returns: the job, or NULL if no job matches */
+static struct job *job_find_spec(struct job_table *jobs, char const *spec) {
+  char *end;
+  if (spec[0] == '%') {
+    long number = strtol(spec + 1, &end, 10);
+    if (*end != '\0' || end == spec + 1) return NULL;
+    for (size_t i = 0; i < jobs->num_slots; ++i) {
+      if (jobs->slots[i].pid != 0 && jobs->slots[i].number == number) return &jobs->slots[i];
+    }
+    return NULL;
+  }
+  long pid = strtol(spec, &end, 10);
+  if (*end != '\0' || end == spec || pid <= 0) return NULL;
+  struct job *job = job_find_pid(jobs, (pid_t) pid);
+  // Finished jobs have left the index; they are few and only named by wait, so scan for them
+  for (size_t i = 0; !job && i < jobs->num_slots; ++i) {
+    if (jobs->slots[i].pid == pid && jobs->slots[i].state == JOB_DONE) job = &jobs->slots[i];
+  }
+  return job;
+}
+
+/* Output logs of background jobs. With SMALLSH_JOBLOG set to a size in bytes, the stdout and stderr of each
+ * background pipeline go to a pipe that the event loop drains with nonblocking reads into a ring of that size,
+ * so a log keeps the job's latest output in fixed memory however much it writes. Logs outlive their jobs until
+ * more than JOB_LOG_KEEP finished ones have accumulated, and the oldest are dropped. */
+#define JOB_LOG_KEEP 256
+#define JOB_LOG_MAX ((size_t) 64 << 20) /* Largest ring; a larger SMALLSH_JOBLOG is cut down to it */
+
+struct job_log {
+  pid_t pid;         /* $! of the job */
+  int fd;            /* Nonblocking read end of the job's output pipe, -1 once every writer has closed it */
+  char *ring;        /* NULL once the log has been spilled to a file */
+  size_t size;       /* Bytes in the ring */
+  uint64_t written;  /* Bytes the job has written; the ring holds the last min(written, size) of them */
+  char *spill_path;  /* File the finished log was written to (SMALLSH_JOBLOG_DIR), or NULL */
+};
+
+struct job_logs {
+  struct job_log **logs;   /* Oldest first */
+  size_t count;
+  size_t cap;
+  size_t num_closed;       /* Logs whose pipe has reached end of file */
+  struct job_log **by_fd;  /* Logs with an open pipe, indexed by its read end */
+  size_t by_fd_cap;
+};
+
+/* Find the log of a job, the newest one if the pid has been reused
+ * Parameters: struct job_logs *logs, pid_t pid
+ * Returns: the log, or NULL if there is none */
+static struct job_log *job_log_find(struct job_logs *logs, pid_t pid) {
+  for (size_t i = logs->count; i-- > 0;) {
+    if (logs->logs[i]->pid == pid) return logs->logs[i];
+  }
+  return NULL;
+}
+
+/* Find the log whose pipe a file descriptor reads
+ * Parameters: struct job_logs *logs, int fd
+ * Returns: the log, or NULL if fd is not a log pipe */
+static struct job_log *job_log_for_fd(struct job_logs *logs, int fd) {
+  return fd >= 0 && (size_t) fd < logs->by_fd_cap ? logs->by_fd[fd] : NULL;
+}
+
+/* Write the contents of a ring to a file descriptor, oldest byte first
+ * Parameters: struct job_log const *log (must still have its ring), int fd
+ * Returns: 0 on success, -1 on a write error */
+static int job_log_write(struct job_log const *log, int fd) {
+  size_t len = log->written < log->size ? log->written : log->size;
+  size_t start = log->written > log->size ? log->written % log->size : 0;
+  while (len > 0) {
+    size_t piece = len < log->size - start ? len : log->size - start;
+    ssize_t put = write(fd, log->ring + start, piece);
+    if (put == -1 && errno == EINTR) continue;
+    if (put == -1) return -1;
+    start = (start + put) % log->size;
+    len -= put;
+  }
+  return 0;
+}
+
+/* Release a log that no longer has an open pipe
+ * Parameters: struct job_log *log
+ * Returns: nothing */
+static void job_log_free(struct job_log *log) {
+  free(log->ring);
+  free(log->spill_path);
+  free(log);
+}
+
+/* Convert a wait status to the value stored in $?
+ * Parameters: int status
+ * Returns: exit status, or 128 plus the signal number for a signaled process */
+static int status_to_exit_code(int status) {
+  if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+  if (WIFEXITED(status)) return WEXITSTATUS(status);
+  return 0;
+}
+
+/* Per-command resource accounting. Every launched child is remembered until it is reaped with wait4, and
+ * its wall time, CPU times, exec latency and peak RSS are added to the totals and log2 histograms of its
+ * command name. Bucket 0 counts zeros and bucket i counts values in [2^(i-1), 2^i), the last one open ended. */
+enum stat_metric { STAT_WALL, STAT_USER, STAT_SYS, STAT_EXEC, STAT_RSS, NUM_STAT_METRICS };
+#define STAT_BUCKETS 32
+
+static char const *const stat_metric_names[NUM_STAT_METRICS] = { "wall", "user", "sys", "exec", "maxrss" };
+
+struct command_stats {
+  char *name;
+  size_t count;
+  uint64_t total[NUM_STAT_METRICS]; /* Microseconds, or KiB for STAT_RSS */
+  uint64_t max[NUM_STAT_METRICS];
+  uint32_t histogram[NUM_STAT_METRICS][STAT_BUCKETS];
+};
+
+struct live_child {
+  pid_t pid;                   /* 0 for an empty entry */
+  size_t command;              /* Index into stats_table.commands */
+  struct timespec launched_at; /* CLOCK_MONOTONIC, just before fork or posix_spawn */
+  uint64_t exec_us;            /* Launch until the new program was running */
+  int exec_fd;                 /* Forked child: exec pipe watched until it reaches end of file, else -1 */
+};
+
+struct stats_table {
+  struct command_stats *commands; /* Few distinct names per session, so lookups scan linearly */
+  size_t num_commands;
+  size_t commands_cap;
+  struct live_child *children;    /* Launched and not yet reaped; open addressing by pid, like the job index */
+  size_t num_children;
+  size_t children_cap;            /* Power of two */
+  pid_t *exec_pids;               /* Child each exec pipe belongs to, indexed by fd; 0 where there is none */
+  size_t exec_pids_cap;
+};
+
+/* Microseconds between two CLOCK_MONOTONIC times
+ * Parameters: struct timespec const *start, struct timespec const *end
+ * Returns: end - start in microseconds, 0 if end is earlier */
+static uint64_t elapsed_us(struct timespec const *start, struct timespec const *end) {
+  int64_t ns = (int64_t) (end->tv_sec - start->tv_sec) * 1000000000 + (end->tv_nsec - start->tv_nsec);
+  return ns > 0 ? (uint64_t) ns / 1000 : 0;
+}
+
+/* Convert a struct timeval to microseconds
+ * Parameters: struct timeval const *tv
+ * Returns: microseconds */
+static uint64_t timeval_us(struct timeval const *tv) {
+  return (uint64_t) tv->tv_sec * 1000000 + (uint64_t) tv->tv_usec;
+}
+
+/* Find the live child record for pid, or the empty entry where it belongs
+ * Parameters: struct stats_table *stats (children_cap must be nonzero), pid_t pid
+ * Returns: pointer to the entry */
+static struct live_child *stats_child_entry(struct stats_table *stats, pid_t pid) {
+  size_t mask = stats->children_cap - 1;
+  for (size_t i = ((uint32_t) pid * 2654435761u) & mask;; i = (i + 1) & mask) {
+    if (stats->children[i].pid == 0 || stats->children[i].pid == pid) return &stats->children[i];
+  }
+}
+
+/* Remember a child just launched, so that its resource usage can be charged to its command when reaped
+ * Parameters: struct stats_table *stats, pid_t pid, char const *name (argv[0]),
+ *             struct timespec const *launched_at, struct timespec const *exec_at (when the exec had happened)
+ * Returns: the child's record, valid until the next child is recorded, or NULL if allocation failed */
+static struct live_child *stats_child_launched(struct stats_table *stats, pid_t pid, char const *name,
+                                               struct timespec const *launched_at, struct timespec const *exec_at) {
+  size_t command = 0;
+  while (command < stats->num_commands && strcmp(stats->commands[command].name, name) != 0) command++;
+  if (command == stats->num_commands) {
+    if (stats->num_commands == stats->commands_cap) {
+      size_t new_cap = stats->commands_cap ? stats->commands_cap * 2 : 16;
+      struct command_stats *grown = realloc(stats->commands, sizeof *grown * new_cap);
+      if (!grown) return NULL;
+      stats->commands = grown;
+      stats->commands_cap = new_cap;
+    }
+    struct command_stats *entry = &stats->commands[command];
+    *entry = (struct command_stats) { .name = strdup(name) };
+    if (!entry->name) return NULL;
+    stats->num_commands++;
+  }
+
+  if ((stats->num_children + 1) * 2 > stats->children_cap) {
+    size_t old_cap = stats->children_cap;
+    struct live_child *old_children = stats->children;
+    size_t new_cap = old_cap ? old_cap * 2 : 64;
+    struct live_child *grown = calloc(new_cap, sizeof *grown);
+    if (!grown) return NULL;
+    stats->children = grown;
+    stats->children_cap = new_cap;
+    for (size_t i = 0; i < old_cap; ++i) {
+      if (old_children[i].pid != 0) *stats_child_entry(stats, old_children[i].pid) = old_children[i];
+    }
+    free(old_children);
+  }
+  struct live_child *child = stats_child_entry(stats, pid);
+  if (child->pid == 0) stats->num_children++;
+  *child = (struct live_child) {
+    .pid = pid, .command = command, .launched_at = *launched_at, .exec_us = elapsed_us(launched_at, exec_at),
+    .exec_fd = -1,
+  };
+  return child;
+}
+
+/* Charge a reaped child's resource usage to its command
+ * Parameters: struct stats_table *stats, pid_t pid, struct rusage const *usage (from wait4),
+ *             struct timespec const *reaped_at
+ * Returns: nothing; children the table does not know, such as data stages, are ignored */
+static void stats_child_reaped(struct stats_table *stats, pid_t pid, struct rusage const *usage,
+                               struct timespec const *reaped_at) {
+  if (stats->children_cap == 0) return;
+  struct live_child *record = stats_child_entry(stats, pid);
+  if (record->pid == 0) return;
+  struct live_child child = *record;
+  // Shift later entries of the probe run back into the gap, as job_index_remove does
+  size_t mask = stats->children_cap - 1, gap = record - stats->children;
+  for (size_t i = (gap + 1) & mask; stats->children[i].pid != 0; i = (i + 1) & mask) {
+    size_t home = ((uint32_t) stats->children[i].pid * 2654435761u) & mask;
+    if (((i - home) & mask) >= ((i - gap) & mask)) {
+      stats->children[gap] = stats->children[i];
+      gap = i;
+    }
+  }
+  stats->children[gap].pid = 0;
+  stats->num_children--;
+
+  struct command_stats *entry = &stats->commands[child.command];
+  uint64_t const values[NUM_STAT_METRICS] = {
+    [STAT_WALL] = elapsed_us(&child.launched_at, reaped_at),
+    [STAT_USER] = timeval_us(&usage->ru_utime),
+    [STAT_SYS] = timeval_us(&usage->ru_stime),
+    [STAT_EXEC] = child.exec_us,
+    [STAT_RSS] = (uint64_t) usage->ru_maxrss,
+  };
+  entry->count++;
+  for (size_t metric = 0; metric < NUM_STAT_METRICS; ++metric) {
+    uint64_t value = values[metric];
+    size_t bucket = 0;
+    while (bucket < STAT_BUCKETS - 1 && value >> bucket) bucket++;
+    entry->histogram[metric][bucket]++;
+    entry->total[metric] += value;
+    if (value > entry->max[metric]) entry->max[metric] = value;
+  }
+}
+
+/* Estimate a percentile from a log2 histogram
+ * Parameters: uint32_t const *histogram, size_t count (total of the buckets), double fraction (0.99 for p99)
+ * Returns: upper bound of the bucket holding the percentile */
+static uint64_t histogram_percentile(uint32_t const *histogram, size_t count, double fraction) {
+  size_t rank = (size_t) (fraction * count + 0.999999), seen = 0;
+  for (size_t bucket = 0; bucket < STAT_BUCKETS; ++bucket) {
+    seen += histogram[bucket];
+    if (seen >= rank && seen > 0) return bucket == 0 ? 0 : (uint64_t) 1 << bucket;
+  }
+  return (uint64_t) 1 << (STAT_BUCKETS - 1);
+}
+
+/* Print the per-command statistics table and, optionally, every non-empty histogram
+ * Parameters: struct stats_table const *stats, FILE *out, bool histograms
+ * Returns: 0 on success, -1 if printing failed */
+static int stats_print(struct stats_table const *stats, FILE *out, bool histograms) {
+  if (fprintf(out, "%-16s %7s %10s %10s %10s %10s %10s %9s\n", "command", "count", "wall avg", "wall p99",
+              "user avg", "sys avg", "exec avg", "maxrss") < 0) return -1;
+  for (size_t i = 0; i < stats->num_commands; ++i) {
+    struct command_stats const *entry = &stats->commands[i];
+    if (entry->count == 0) continue;
+    double const ms = 1000.0 * entry->count;
+    if (fprintf(out, "%-16s %7zu %8.2fms %8.2fms %8.2fms %8.2fms %8.2fms %8juK\n", entry->name, entry->count,
+                entry->total[STAT_WALL] / ms,
+                histogram_percentile(entry->histogram[STAT_WALL], entry->count, 0.99) / 1000.0,
+                entry->total[STAT_USER] / ms, entry->total[STAT_SYS] / ms, entry->total[STAT_EXEC] / ms,
+                (uintmax_t) entry->max[STAT_RSS]) < 0) return -1;
+    for (size_t metric = 0; histograms && metric < NUM_STAT_METRICS; ++metric) {
+      char const *unit = metric == STAT_RSS ? "KiB" : "us";
+      for (size_t bucket = 0; bucket < STAT_BUCKETS; ++bucket) {
+        uint32_t n = entry->histogram[metric][bucket];
+        if (n == 0) continue;
+        uint64_t low = bucket == 0 ? 0 : (uint64_t) 1 << (bucket - 1), high = (uint64_t) 1 << bucket;
+        if (fprintf(out, "  %-6s [%10ju, %10ju) %-3s %8u\n", stat_metric_names[metric], (uintmax_t) low,
+                    (uintmax_t) (bucket == 0 ? 1 : high), unit, n) < 0) return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* Clear the collected statistics; names stay so that children still running keep their entry
+ * Parameters: struct stats_table *stats
+ * Returns: nothing */
+static void stats_reset(struct stats_table *stats) {
+  for (size_t i = 0; i < stats->num_commands; ++i) {
+    char *name = stats->commands[i].name;
+    stats->commands[i] = (struct command_stats) { .name = name };
+  }
+}
+
+/* Move one of the shell's own descriptors to 10 or above, out of reach of the N>file and N>&M redirections,
+ * which name descriptors 0 to 9
+ * Parameters: int fd (closed once moved; -1 is passed through)
+ * Returns: the new close-on-exec descriptor, or -1 on failure */
+static int move_fd_high(int fd) {
+  if (fd < 10) {
+    int high_fd = fd == -1 ? -1 : fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    if (fd != -1) close(fd);
+    fd = high_fd;
+  }
+  return fd;
+}
+
+/* Lifecycle trace. With SMALLSH_TRACE set to a file name, timestamped events are recorded into a ring of
+ * preallocated slots and written out in batches whenever the ring fills, and when the shell exits. A name
+ * ending in .json gets the Chrome trace event format (chrome://tracing, Perfetto); anything else gets one
+ * JSON object per line. When tracing is off, recording an event is a single test of the slot pointer. */
+#define TRACE_SLOTS 4096
+
+enum trace_kind {
+  TRACE_LINE_READ, TRACE_TOKENIZE, TRACE_EXPAND, TRACE_SPAWN, TRACE_FORK, TRACE_EXEC, TRACE_REAP, TRACE_STOP,
+  TRACE_SIGCONT,
+};
+
+static struct {
+  char const *name;
+  char const *arg_name; /* Key of the event's argument, or NULL if it has none */
+} const trace_kinds[] = {
+  [TRACE_LINE_READ] = { "line_read", "bytes" },
+  [TRACE_TOKENIZE] = { "tokenize", "cached" },
+  [TRACE_EXPAND] = { "expand", "sites" },
+  [TRACE_SPAWN] = { "spawn", NULL },
+  [TRACE_FORK] = { "fork", NULL },
+  [TRACE_EXEC] = { "exec", NULL },
+  [TRACE_REAP] = { "reap", "status" },
+  [TRACE_STOP] = { "stop", "signal" },
+  [TRACE_SIGCONT] = { "sigcont", NULL },
+};
+
+struct trace_event {
+  uint64_t ts_ns;       /* CLOCK_MONOTONIC */
+  int64_t arg;
+  pid_t pid;            /* Child the event is about, or 0 for the shell */
+  unsigned char kind;   /* enum trace_kind */
+  char command[19];     /* Command name, truncated */
+};
+
+struct trace_ring {
+  struct trace_event *slots; /* NULL when tracing is off */
+  size_t count;              /* Events recorded since the last flush */
+  int fd;
+  bool chrome;               /* Chrome trace event format instead of JSON lines */
+  bool wrote_event;          /* A Chrome event was written, so the next one needs a comma */
+  pid_t shell_pid;
+};
+
+/* Start tracing to the file named by SMALLSH_TRACE, if it is set
+ * Parameters: struct trace_ring *trace
+ * Returns: 0 on success or when tracing is off, -1 if the file could not be opened or the ring allocated */
+static int trace_open(struct trace_ring *trace) {
+  char const *path = getenv("SMALLSH_TRACE");
+  trace->fd = -1;
+  if (!path || !*path) return 0;
+  size_t path_len = strlen(path);
+  trace->chrome = path_len >= 5 && strcmp(path + path_len - 5, ".json") == 0;
+  trace->shell_pid = getpid();
+  if ((trace->fd = move_fd_high(open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666))) == -1) return -1;
+  if (!(trace->slots = malloc(sizeof *trace->slots * TRACE_SLOTS))) return -1;
+  if (trace->chrome && write(trace->fd, "[\n", 2) != 2) return -1;
+  return 0;
+}
+
+/* Write every recorded event to the trace file and empty the ring
+ * Parameters: struct trace_ring *trace
+ * Returns: nothing; a failed write loses the batch rather than disturbing the shell */
+static void trace_flush(struct trace_ring *trace) {
+  char buf[65536];
+  size_t len = 0;
+  for (size_t i = 0; i < trace->count; ++i) {
+    struct trace_event const *event = &trace->slots[i];
+    char const *name = trace_kinds[event->kind].name;
+    char const *arg_name = trace_kinds[event->kind].arg_name;
+    char args[96] = "";
+    int args_len = 0;
+    if (event->command[0]) args_len += snprintf(args, sizeof args, "\"command\": \"%s\"", event->command);
+    if (arg_name) {
+      snprintf(args + args_len, sizeof args - args_len, "%s\"%s\": %" PRId64, args_len ? ", " : "", arg_name,
+               event->arg);
+    }
+
+    size_t room = sizeof buf - len;
+    int written;
+    if (trace->chrome) {
+      written = snprintf(buf + len, room,
+                         "%s{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %" PRIu64 ".%03u, \"pid\": %jd, "
+                         "\"tid\": %jd, \"args\": {%s}}",
+                         trace->wrote_event ? ",\n" : "", name, event->ts_ns / 1000,
+                         (unsigned) (event->ts_ns % 1000), (intmax_t) trace->shell_pid,
+                         (intmax_t) (event->pid ? event->pid : trace->shell_pid), args);
+    } else {
+      written = snprintf(buf + len, room, "{\"ts_ns\": %" PRIu64 ", \"event\": \"%s\", \"pid\": %jd%s%s}\n",
+                         event->ts_ns, name, (intmax_t) event->pid, args[0] ? ", " : "", args);
+    }
+    if (written < 0) break;
+    if ((size_t) written >= room) {
+      // Write out the full buffer and format this event again at its start
+      if (write(trace->fd, buf, len) == -1) break;
+      len = 0;
+      --i;
+      continue;
+    }
+    len += written;
+    trace->wrote_event = true;
+  }
+  if (len > 0) write(trace->fd, buf, len); /* A failed write loses the batch */
+  trace->count = 0;
+}
+
+/* Record an event in the trace ring, flushing the ring first if it is full
+ * Parameters: struct trace_ring *trace, enum trace_kind kind, pid_t pid (0 for the shell itself),
+ *             char const *command (may be NULL), int64_t arg
+ * Returns: nothing */
+static inline void trace_event(struct trace_ring *trace, enum trace_kind kind, pid_t pid, char const *command,
+                               int64_t arg) {
+  if (!trace->slots) return;
+  if (trace->count == TRACE_SLOTS) trace_flush(trace);
+  struct trace_event *event = &trace->slots[trace->count++];
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  event->ts_ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+  event->arg = arg;
+  event->pid = pid;
+  event->kind = kind;
+  event->command[0] = '\0';
+  if (command) {
+    // Only the base name, and nothing a JSON string would need escaped
+    char const *slash = strrchr(command, '/');
+    if (slash && slash[1]) command = slash + 1;
+    size_t len = 0;
+    for (; command[len] && len + 1 < sizeof event->command; ++len) {
+      unsigned char c = command[len];
+      event->command[len] = c < 0x20 || c == '"' || c == '\\' ? '?' : c;
+    }
+    event->command[len] = '\0';
+  }
+}
+
+/* Write out the remaining events and close the trace file
+ * Parameters: struct trace_ring *trace
+ * Returns: nothing */
+static void trace_close(struct trace_ring *trace) {
+  if (trace->slots) {
+    trace_flush(trace);
+    if (trace->chrome) write(trace->fd, "\n]\n", 3);
+    free(trace->slots);
+    trace->slots = NULL;
+  }
+  if (trace->fd >= 0) close(trace->fd);
+  trace->fd = -1;
+}
+
+/* Command history. Lines typed at an interactive shell are appended to the file named by HISTFILE (by default
+ * ~/.smallsh_history), one per line, each with a single write(2) on an O_APPEND descriptor, so shells sharing
+ * the file never mix up each other's lines. At startup the file is only memory-mapped. It is split into
+ * entries on first use, and after that only the bytes appended since then, by this shell or another, are
+ * split. Searches use a trigram index that maps every three-byte sequence to the ascending list of entries
+ * containing it. The index is built on the first search and extended as entries arrive. A search walks the
+ * shortest list among the needle's trigrams from the newest entry backwards, and checks each candidate. */
+#define HISTORY_MIN_TRIGRAMS 4096 /* Initial slots of the trigram table */
+
+struct trigram_postings {
+  uint32_t key;      /* The three bytes with bit 24 set, or 0 for an empty slot */
+  uint32_t count;
+  uint32_t cap;
+  uint32_t *entries; /* Entries containing the trigram, ascending */
+};
+
+struct history {
+  int fd;                            /* -1 when history is off */
+  char *map;                         /* The file as of the last refresh, NULL while it was empty */
+  size_t map_len;
+  size_t scanned;                    /* Bytes of the map split into entries: up to just after a newline */
+  size_t *starts;                    /* Offset of each complete entry in the map */
+  size_t num_entries;
+  size_t starts_cap;
+  struct trigram_postings *trigrams; /* Open addressing, power of two capacity */
+  size_t trigrams_cap;
+  size_t num_trigrams;
+  size_t num_indexed;                /* Entries added to the trigram index */
+};
+
+/* Open the history file and map it
+ * Parameters: struct history *h, struct var_store const *vars (for HISTFILE and HOME)
+ * Returns: 0 on success or when history is turned off with an empty HISTFILE, -1 if the file could not be
+ *          opened or mapped (h->fd is left -1) */
+static int history_open(struct history *h, struct var_store const *vars) {
+  *h = (struct history) { .fd = -1 };
+  char const *path = var_get(vars, "HISTFILE");
+  char default_path[PATH_MAX];
+  if (!path) {
+    char const *home = var_get(vars, "HOME");
+    if (!home || snprintf(default_path, sizeof default_path, "%s/.smallsh_history", home) >= (int) sizeof default_path) {
+      return 0;
+    }
+    path = default_path;
+  }
+  if (!*path) return 0;
+
+  int fd = move_fd_high(open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR));
+  struct stat st;
+  if (fd == -1) return -1;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+  if (st.st_size > 0) {
+    h->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (h->map == MAP_FAILED) {
+      h->map = NULL;
+      close(fd);
+      return -1;
+    }
+    h->map_len = st.st_size;
+  }
+  h->fd = fd;
+  return 0;
+}
+
+/* Forget the entries and the trigram index, and unmap the file
+ * Parameters: struct history *h
+ * Returns: nothing */
+static void history_drop(struct history *h) {
+  for (size_t i = 0; i < h->trigrams_cap; ++i) free(h->trigrams[i].entries);
+  free(h->trigrams);
+  free(h->starts);
+  if (h->map) munmap(h->map, h->map_len);
+  *h = (struct history) { .fd = h->fd };
+}
+
+/* Close the history file and free everything built from it
+ * Parameters: struct history *h
+ * Returns: nothing */
+static void history_close(struct history *h) {
+  history_drop(h);
+  if (h->fd >= 0) close(h->fd);
+  h->fd = -1;
+}
+
+/* Bring the mapping up to the file's current size and split the new complete lines into entries
+ * Parameters: struct history *h (history on)
+ * Returns: 0 on success, -1 if the file could not be mapped or allocation failed */
+static int history_refresh(struct history *h) {
+  struct stat st;
+  if (fstat(h->fd, &st) != 0) return -1;
+  size_t size = st.st_size;
+  if (size < h->map_len) history_drop(h); /* The file was truncated: start over */
+  if (size > h->map_len) {
+    void *map = h->map ? mremap(h->map, h->map_len, size, MREMAP_MAYMOVE)
+                       : mmap(NULL, size, PROT_READ, MAP_SHARED, h->fd, 0);
+    if (map == MAP_FAILED) return -1;
+    h->map = map;
+    h->map_len = size;
+  }
+
+  // A line still missing its newline is left for a later refresh
+  char const *newline;
+  while (h->scanned < h->map_len && (newline = memchr(h->map + h->scanned, '\n', h->map_len - h->scanned))) {
+    if (h->num_entries == h->starts_cap) {
+      size_t new_cap = h->starts_cap ? h->starts_cap * 2 : 1024;
+      size_t *grown = realloc(h->starts, sizeof *grown * new_cap);
+      if (!grown) return -1;
+      h->starts = grown;
+      h->starts_cap = new_cap;
+    }
+    h->starts[h->num_entries++] = h->scanned;
+    h->scanned = newline + 1 - h->map;
+  }
+  return 0;
+}
+
+/* Get an entry's text, which is not NUL terminated
+ * Parameters: struct history const *h, size_t i (0-based entry number), size_t *len (set to its length)
+ * Returns: pointer to the entry in the mapping */
+static char const *history_entry(struct history const *h, size_t i, size_t *len) {
+  size_t end = i + 1 < h->num_entries ? h->starts[i + 1] : h->scanned;
+  *len = end - h->starts[i] - 1;
+  return h->map + h->starts[i];
+}
+
+/* Append a line to the history file with a single write
+ * Parameters: struct history *h, char *line, size_t len (line[len] must be writable; it is restored)
+ * Returns: 0 on success or for a blank line, -1 if the write failed */
+static int history_add(struct history *h, char *line, size_t len) {
+  if (line[strspn(line, " \t")] == '\0') return 0;
+  // The line's terminator briefly becomes its newline, so the entry goes out in one write without a copy
+  line[len] = '\n';
+  ssize_t written = write(h->fd, line, len + 1);
+  line[len] = '\0';
+  return written == (ssize_t) len + 1 ? 0 : -1;
+}
+
+/* Find the slot of a trigram in the index
+ * Parameters: struct history const *h (trigram table allocated: trigrams_cap > 0), uint32_t key
+ * Returns: the slot holding key, or the empty slot where it would go */
+static struct trigram_postings *trigram_slot(struct history const *h, uint32_t key) {
+  assert(h->trigrams_cap > 0);
+  size_t mask = h->trigrams_cap - 1;
+  size_t i = (size_t) ((key * UINT64_C(0x9E3779B97F4A7C15)) >> 32) & mask;
+  while (h->trigrams[i].key && h->trigrams[i].key != key) i = (i + 1) & mask;
+  return &h->trigrams[i];
+}
+
+/* Add the entries that arrived since the last call to the trigram index
+ * Parameters: struct history *h
+ * Returns: 0 on success, -1 on allocation failure (the index stays usable up to the entries already added) */
+static int history_index(struct history *h) {
+  for (; h->num_indexed < h->num_entries; ++h->num_indexed) {
+    size_t len;
+    unsigned char const *text = (unsigned char const *) history_entry(h, h->num_indexed, &len);
+    for (size_t i = 0; i + 3 <= len; ++i) {
+      // Keep the table at most half full
+      if ((h->num_trigrams + 1) * 2 > h->trigrams_cap) {
+        size_t old_cap = h->trigrams_cap;
+        struct trigram_postings *old = h->trigrams;
+        h->trigrams_cap = old_cap ? old_cap * 2 : HISTORY_MIN_TRIGRAMS;
+        if (!(h->trigrams = calloc(h->trigrams_cap, sizeof *h->trigrams))) {
+          h->trigrams = old;
+          h->trigrams_cap = old_cap;
+          return -1;
+        }
+        for (size_t j = 0; j < old_cap; ++j) {
+          if (old[j].key) *trigram_slot(h, old[j].key) = old[j];
+        }
+        free(old);
+      }
+      uint32_t key = UINT32_C(1) << 24 | (uint32_t) text[i] << 16 | (uint32_t) text[i + 1] << 8 | text[i + 2];
+      struct trigram_postings *slot = trigram_slot(h, key);
+      if (!slot->key) {
+        slot->key = key;
+        h->num_trigrams++;
+      }
+      if (slot->count > 0 && slot->entries[slot->count - 1] == h->num_indexed) continue;
+      if (slot->count == slot->cap) {
+        uint32_t new_cap = slot->cap ? slot->cap * 2 : 4;
+        uint32_t *grown = realloc(slot->entries, sizeof *grown * new_cap);
+        if (!grown) return -1;
+        slot->entries = grown;
+        slot->cap = new_cap;
+      }
+      slot->entries[slot->count++] = h->num_indexed;
+    }
+  }
+  return 0;
+}
+
+/* Check whether an entry matches a search
+ * Parameters: struct history const *h, size_t i, char const *needle, size_t len, bool prefix
+ * Returns: true if entry i starts with (prefix) or contains the needle */
+static bool history_matches(struct history const *h, size_t i, char const *needle, size_t len, bool prefix) {
+  size_t entry_len;
+  char const *entry = history_entry(h, i, &entry_len);
+  if (prefix) return entry_len >= len && memcmp(entry, needle, len) == 0;
+  return memmem(entry, entry_len, needle, len) != NULL;
+}
+
+/* Find the newest entry before a given one that starts with or contains a string
+ * Needles of three bytes or more are looked up in the trigram index; shorter ones, or all of them if the
+ * index cannot be extended, are found by checking the entries newest first.
+ * Parameters: struct history *h (refreshed), char const *needle, size_t len, bool prefix (match the start of
+ *             the entry only), size_t before (search entries below this number; num_entries for all)
+ * Returns: the entry number, or SIZE_MAX if there is none */
+static size_t history_search(struct history *h, char const *needle, size_t len, bool prefix, size_t before) {
+  if (len >= 3 && history_index(h) == 0) {
+    // No table means no entry is three bytes long, so none can contain the needle
+    if (h->trigrams_cap == 0) return SIZE_MAX;
+    struct trigram_postings const *shortest = NULL;
+    for (size_t i = 0; i + 3 <= len; ++i) {
+      unsigned char const *t = (unsigned char const *) needle + i;
+      uint32_t key = UINT32_C(1) << 24 | (uint32_t) t[0] << 16 | (uint32_t) t[1] << 8 | t[2];
+      struct trigram_postings const *postings = trigram_slot(h, key);
+      if (!postings->key) return SIZE_MAX;
+      if (!shortest || postings->count < shortest->count) shortest = postings;
+    }
+    // Binary search for the first posting at or above before, then walk down from there
+    size_t low = 0, high = shortest->count;
+    while (low < high) {
+      size_t mid = low + (high - low) / 2;
+      if (shortest->entries[mid] < before) low = mid + 1;
+      else high = mid;
+    }
+    while (low-- > 0) {
+      if (history_matches(h, shortest->entries[low], needle, len, prefix)) return shortest->entries[low];
+    }
+    return SIZE_MAX;
+  }
+  while (before-- > 0) {
+    if (history_matches(h, before, needle, len, prefix)) return before;
+  }
+  return SIZE_MAX;
+}
+
+/* Replace a history event at the start of a line: !! is the newest entry, !N entry N and !prefix the newest
+ * entry starting with prefix. The rest of the line follows the entry, and the new line is echoed to stderr.
+ * Parameters: struct history *h (history on), struct arena *arena (holds a rewritten line),
+ *             char **line, ssize_t *len (replaced by the rewritten line, whose terminator is writable)
+ * Returns: 0 on success (the line is left alone when it starts with no event), 1 if there is no such entry
+ *          (already reported), -1 if printing failed */
+static int history_expand_line(struct history *h, struct arena *arena, char **line, ssize_t *len) {
+  char *start = *line + strspn(*line, " \t");
+  if (start[0] != '!' || !start[1] || start[1] == ' ' || start[1] == '\t' || start[1] == '=') return 0;
+  char const *event = start + 1;
+  size_t event_len = strcspn(event, " \t");
+  size_t found = SIZE_MAX;
+  if (history_refresh(h) != 0) {
+    errno = 0;
+  } else if (event_len == 1 && event[0] == '!') {
+    found = h->num_entries - 1; /* SIZE_MAX when empty */
+  } else if (strspn(event, "0123456789") == event_len) {
+    uintmax_t number = strtoumax(event, NULL, 10);
+    if (number >= 1 && number <= h->num_entries) found = number - 1;
+  } else {
+    found = history_search(h, event, event_len, true, h->num_entries);
+  }
+  if (found == SIZE_MAX) return fprintf(stderr, "!%.*s: event not found\n", (int) event_len, event) < 0 ? -1 : 1;
+
+  size_t entry_len, lead_len = start - *line;
+  char const *entry = history_entry(h, found, &entry_len);
+  char const *rest = event + event_len;
+  size_t rest_len = strlen(rest);
+  char *out = arena_alloc(arena, lead_len + entry_len + rest_len + 1);
+  if (!out) return -1;
+  memcpy(out, *line, lead_len);
+  memcpy(out + lead_len, entry, entry_len);
+  memcpy(out + lead_len + entry_len, rest, rest_len + 1);
+  *line = out;
+  *len = lead_len + entry_len + rest_len;
+  return fprintf(stderr, "%s\n", out) < 0 ? -1 : 0;
+}
+
+/* A child state change collected by the reaper, reported before the next prompt */
+struct child_event {
+  pid_t pid;
+  int status;
+  struct timespec reaped_at; /* CLOCK_MONOTONIC */
+  size_t job_slot;           /* Slot of the job the child belonged to, or SIZE_MAX */
+  pid_t job_pid;             /* That job's pid, to tell whether the slot still holds it */
+};
+
+/* LRU cache of compiled command lines keyed by a hash of the line text, so a line seen again skips the
+ * lexer and parser and is only re-expanded. Entries are chained in hash buckets and kept on a list ordered
+ * from most to least recently used; the least recently used entry is evicted when the cache is full. */
+#define PARSE_CACHE_ENTRIES 256
+#define PARSE_CACHE_BUCKETS 512 /* Power of two */
+
+struct compiled_line;
+
+struct parse_cache {
+  struct compiled_line *buckets[PARSE_CACHE_BUCKETS];
+  struct compiled_line *lru_head;  /* Most recently used */
+  struct compiled_line *lru_tail;  /* Next to be evicted */
+  size_t count;
+  uint64_t ifs_version;            /* IFS table version the cached lines were split with */
+  size_t hits;
+  size_t misses;
+};
+
+/* Shell-wide state needed when launching children */
+struct shell_state {
+  enum launch_mode launch_mode;
+  sigset_t orig_sigmask; /* Signal mask to restore in children; the shell itself blocks SIGCHLD */
+  int sigchld_fd;        /* signalfd for SIGCHLD */
+  int epoll_fd;          /* Waits on sigchld_fd and, while reading a line, on input */
+  struct child_event *events; /* Background state changes not yet reported */
+  size_t num_events;
+  size_t events_cap;
+  pid_t *fg_pids;        /* Foreground stages being waited for; reaped entries are set to 0 */
+  int *fg_statuses;
+  size_t fg_count;
+  size_t fg_remaining;
+  struct sigaction SIGINT_init_disp_sa;  /* Restored in children */
+  struct sigaction SIGTSTP_init_disp_sa;
+  struct path_cache path_cache;
+  struct job_table jobs;
+  int pipe_size; /* Capacity requested with F_SETPIPE_SZ for pipeline pipes, 0 keeps the kernel default */
+  struct stats_table stats;
+  struct ifs_table ifs;    /* Word splitting table, rebuilt when IFS changes */
+  struct var_store vars;   /* Shell variables, imported from the environment at startup */
+  struct parse_cache parse_cache;
+  uint64_t fg_user_us;     /* CPU time of reaped foreground children, for the time prefix */
+  uint64_t fg_sys_us;
+  bool dump_stats;         /* Print the statistics to stderr when the shell exits (SMALLSH_STATS) */
+  int spread_next;         /* CPU to try first for the next background job when SMALLSH_SPREAD is set */
+  struct trace_ring trace; /* Lifecycle events, recorded when SMALLSH_TRACE is set */
+  struct history history;  /* Lines typed at an interactive shell */
+  struct job_logs job_logs; /* Output of background jobs, when SMALLSH_JOBLOG is set */
+};
+
+enum parse_result { PARSE_OK, PARSE_EMPTY, PARSE_ERROR, PARSE_SYNTAX_ERROR, PARSE_BAD_REDIRECTION };
+
+/* Describe a syntax error found while parsing
+ * Parameters: enum parse_result result (PARSE_SYNTAX_ERROR or a later value)
+ * Returns: the message, without the "Syntax error: " prefix */
+static char const *syntax_error_message(enum parse_result result) {
+  return result == PARSE_BAD_REDIRECTION ? "redirection without a target" : "empty command in pipeline";
+}
+
+/* Recognize a redirection operator at the start of a word: [N]<, [N]>, [N]>>, [N]<>, [N]<<<, [N]<<,
+ * [N]>&M, [N]<&M (M of - closes N), &> and &>>. N and M are single digits.
+ * Parameters: char const *word, struct redirection *redir (set to the operator's kind, fd and source_fd),
+ *             bool *both (set for &> and &>>, which also send stderr to the file),
+ *             size_t *op_len (set to the operator's length; the rest of the word, if any, is its target)
+ * Returns: true if the word starts with a redirection operator */
+static bool parse_redirection_op(char const *word, struct redirection *redir, bool *both, size_t *op_len) {
+  char const *c = word;
+  int fd = -1;
+  *both = false;
+  if (c[0] == '&' && c[1] == '>') {
+    *both = true;
+    c++;
+  } else if (isdigit((unsigned char) c[0]) && (c[1] == '<' || c[1] == '>')) {
+    fd = *c++ - '0';
+  }
+  if (*c != '<' && *c != '>') return false;
+
+  *redir = (struct redirection) { .source_fd = -1 };
+  bool is_input = *c == '<';
+  if (strncmp(c, "<<<", 3) == 0) {
+    redir->kind = REDIR_STRING;
+    c += 3;
+  } else if (strncmp(c, "<<", 2) == 0) {
+    redir->kind = REDIR_HEREDOC;
+    c += 2;
+  } else if (strncmp(c, "<>", 2) == 0) {
+    redir->kind = REDIR_READ_WRITE;
+    c += 2;
+  } else if (strncmp(c, ">>", 2) == 0) {
+    redir->kind = REDIR_APPEND;
+    c += 2;
+  } else if (c[1] == '&') {
+    // The source is part of the word: N>&M or N>&-
+    redir->kind = REDIR_DUP;
+    c += 2;
+    if (strcmp(c, "-") == 0) redir->source_fd = -1;
+    else if (isdigit((unsigned char) c[0]) && !c[1]) redir->source_fd = c[0] - '0';
+    else return false;
+    c += strlen(c);
+  } else {
+    redir->kind = is_input ? REDIR_READ : REDIR_WRITE;
+    c++;
+  }
+  if (*both && redir->kind != REDIR_WRITE && redir->kind != REDIR_APPEND) return false;
+  redir->fd = fd != -1 ? fd : is_input ? STDIN_FILENO : STDOUT_FILENO;
+  *op_len = c - word;
+  return true;
+}
+
+/* Split a line's words on | into pipeline stages and take each stage's redirections out of its argv
+ * Redirections may appear anywhere in a stage, any number of times. Each stage's slice of words is rewritten
+ * as its argv, a NULL, then the redirection targets, so the targets stay in the word array for expansion.
+ * A target written in the same word as its operator (>file) is split off into its own word.
+ * Parameters: struct arena *arena (holds the stages and redirections), char **words, size_t count (words[count]
+ *             must be a writable slot; the last stage's final target may be moved into it),
+ *             struct command **stages (set to the new stage array),
+ *             size_t *num_stages
+ * Returns: PARSE_OK, PARSE_SYNTAX_ERROR for an empty stage, PARSE_BAD_REDIRECTION for an operator missing its
+ *          target, or PARSE_ERROR on allocation failure */
+static enum parse_result split_pipeline(struct arena *arena, char **words, size_t count, struct command **stages,
+                                        size_t *num_stages) {
+  *num_stages = 1;
+  for (size_t i = 0; i < count; ++i) {
+    if (strcmp(words[i], "|") == 0) (*num_stages)++;
+  }
+  if (!(*stages = arena_alloc(arena, sizeof **stages * *num_stages))) return PARSE_ERROR;
+  char **argv = arena_alloc(arena, sizeof *argv * (count + 1));
+  char **targets = arena_alloc(arena, sizeof *targets * (count + 1));
+  if (!argv || !targets) return PARSE_ERROR;
+
+  size_t stage = 0, start = 0;
+  for (size_t i = 0; i <= count; ++i) {
+    if (i < count && strcmp(words[i], "|") != 0) continue;
+    struct command *cmd = &(*stages)[stage++];
+    *cmd = (struct command) {0};
+    size_t num_words = i - start, argc = 0, num_targets = 0;
+    if (num_words > 0 && !(cmd->redirs = arena_alloc(arena, sizeof *cmd->redirs * num_words * 2))) return PARSE_ERROR;
+    for (size_t j = start; j < i; ++j) {
+      struct redirection redir;
+      bool both;
+      size_t op_len;
+      if (!parse_redirection_op(words[j], &redir, &both, &op_len)) {
+        argv[argc++] = words[j];
+        continue;
+      }
+      if (redir.kind != REDIR_DUP) {
+        if (words[j][op_len]) redir.target = words[j] + op_len;
+        else if (j + 1 < i) redir.target = words[++j];
+        else return PARSE_BAD_REDIRECTION;
+        targets[num_targets++] = redir.target;
+      }
+      cmd->redirs[cmd->num_redirs++] = redir;
+      if (both) {
+        cmd->redirs[cmd->num_redirs++] = (struct redirection) {
+          .kind = REDIR_DUP, .fd = STDERR_FILENO, .source_fd = STDOUT_FILENO,
+        };
+      }
+    }
+    if (argc == 0 && cmd->num_redirs == 0) return PARSE_SYNTAX_ERROR;
+
+    // Rewrite the slice, including the | or terminator slot: argv, NULL, targets, NULL padding
+    size_t slot = start;
+    for (size_t j = 0; j < argc; ++j) words[slot++] = argv[j];
+    words[slot++] = NULL;
+    for (size_t j = 0; j < num_targets; ++j) words[slot++] = targets[j];
+    while (slot <= i) words[slot++] = NULL;
+    cmd->argv = &words[start];
+    cmd->argc = argc;
+    start = i + 1;
+  }
+  return PARSE_OK;
+}
+
+/* Pathname expansion. After parameter expansion, argv words containing *, ? or [...] are replaced by the
+ * sorted paths they match, or left as they are when nothing matches. Each / separated component of a pattern
+ * is compiled to a short list of match operations, and directories are read with getdents64 into one buffer
+ * per directory. Listings are kept for the rest of the command line, so several words globbing the same
+ * directory read it once. Everything lives in the line's arena: the listing buffer holds the names, and the
+ * matches of one component share a single allocation. */
+#define GLOB_DENTS_BATCH (256 * 1024) /* Bytes requested from each getdents64 call */
+
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+enum glob_op_kind { GLOB_CHAR, GLOB_ANY, GLOB_STAR, GLOB_CLASS };
+
+struct glob_op {
+  enum glob_op_kind kind;
+  unsigned char c;     /* GLOB_CHAR */
+  uint64_t bits[4];    /* GLOB_CLASS: bit b set when byte b is in the class */
+};
+
+/* A directory listing read for the current command line */
+struct glob_dir {
+  struct glob_dir *next;
+  char const *path;      /* Directory as written in the pattern, ending in /, or "" for the current directory */
+  char **names;          /* Point into the getdents64 buffer */
+  unsigned char *types;  /* d_type of each name */
+  size_t count;
+};
+
+struct glob_ctx {
+  struct arena *arena;
+  struct glob_dir *dirs;
+};
+
+/* A growable vector of strings in an arena */
+struct glob_vec {
+  char **items;
+  size_t count;
+  size_t cap;
+};
+
+/* Append a string to a vector, doubling it in the arena when full
+ * Parameters: struct arena *arena, struct glob_vec *vec, char *item
+ * Returns: 0 on success, -1 on allocation failure */
+static int glob_vec_push(struct arena *arena, struct glob_vec *vec, char *item) {
+  if (vec->count == vec->cap) {
+    size_t new_cap = vec->cap ? vec->cap * 2 : 16;
+    char **grown = arena_realloc(arena, vec->items, sizeof *grown * vec->cap, sizeof *grown * new_cap);
+    if (!grown) return -1;
+    vec->items = grown;
+    vec->cap = new_cap;
+  }
+  vec->items[vec->count++] = item;
+  return 0;
+}
+
+/* Compile one pattern component into match operations. An unterminated [ is an ordinary character.
+ * Parameters: struct arena *arena, char const *pattern, size_t len, size_t *num_ops
+ * Returns: the operations, or NULL on allocation failure */
+static struct glob_op *glob_compile(struct arena *arena, char const *pattern, size_t len, size_t *num_ops) {
+  struct glob_op *ops = arena_alloc(arena, sizeof *ops * (len + 1));
+  if (!ops) return NULL;
+  size_t n = 0;
+  for (size_t i = 0; i < len; ++i) {
+    struct glob_op *op = &ops[n];
+    if (pattern[i] == '*') {
+      if (n > 0 && ops[n - 1].kind == GLOB_STAR) continue; /* ** matches what * does */
+      op->kind = GLOB_STAR;
+    } else if (pattern[i] == '?') {
+      op->kind = GLOB_ANY;
+    } else if (pattern[i] == '[') {
+      size_t j = i + 1;
+      bool negate = j < len && (pattern[j] == '!' || pattern[j] == '^');
+      if (negate) j++;
+      size_t first = j;
+      while (j < len && (pattern[j] != ']' || j == first)) j++;
+      if (j == len) { /* No closing ] */
+        op->kind = GLOB_CHAR;
+        op->c = '[';
+        n++;
+        continue;
+      }
+      op->kind = GLOB_CLASS;
+      memset(op->bits, 0, sizeof op->bits);
+      for (size_t k = first; k < j; ++k) {
+        unsigned char lo = pattern[k], hi = lo;
+        if (k + 2 < j && pattern[k + 1] == '-') {
+          hi = pattern[k + 2];
+          k += 2;
+        }
+        for (unsigned c = lo; c <= hi; ++c) op->bits[c >> 6] |= (uint64_t) 1 << (c & 63);
+      }
+      if (negate) {
+        for (size_t w = 0; w < 4; ++w) op->bits[w] = ~op->bits[w];
+      }
+      i = j;
+    } else {
+      op->kind = GLOB_CHAR;
+      op->c = pattern[i];
+    }
+    n++;
+  }
+  *num_ops = n;
+  return ops;
+}
+
+/* Match a name against compiled operations, backtracking only to the most recent *
+ * Parameters: struct glob_op const *ops, size_t num_ops, char const *name
+ * Returns: true if the whole name matches */
+static bool glob_match(struct glob_op const *ops, size_t num_ops, char const *name) {
+  size_t op = 0, star_op = SIZE_MAX;
+  unsigned char const *s = (unsigned char const *) name, *star_s = NULL;
+  while (*s) {
+    if (op < num_ops) {
+      struct glob_op const *o = &ops[op];
+      if (o->kind == GLOB_STAR) {
+        star_op = op++;
+        star_s = s;
+        continue;
+      }
+      if ((o->kind == GLOB_CHAR && o->c == *s) || o->kind == GLOB_ANY ||
+          (o->kind == GLOB_CLASS && ((o->bits[*s >> 6] >> (*s & 63)) & 1))) {
+        op++;
+        s++;
+        continue;
+      }
+    }
+    if (star_op == SIZE_MAX) return false;
+    op = star_op + 1; /* Let the last * absorb one more character */
+    s = ++star_s;
+  }
+  while (op < num_ops && ops[op].kind == GLOB_STAR) op++;
+  return op == num_ops;
+}
+
+/* Get the listing of a directory, reading it with getdents64 the first time it is asked for on this line
+ * Parameters: struct glob_ctx *ctx, char const *path (ending in /, or "" for the current directory)
+ * Returns: the listing (empty if the directory cannot be read), or NULL on allocation failure */
+static struct glob_dir *glob_dir_get(struct glob_ctx *ctx, char const *path) {
+  for (struct glob_dir *dir = ctx->dirs; dir; dir = dir->next) {
+    if (strcmp(dir->path, path) == 0) return dir;
+  }
+  struct glob_dir *dir = arena_alloc(ctx->arena, sizeof *dir);
+  if (!dir) return NULL;
+  *dir = (struct glob_dir) { .path = path, .next = ctx->dirs };
+  ctx->dirs = dir;
+
+  int fd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) return dir;
+  size_t cap = GLOB_DENTS_BATCH, used = 0;
+  char *buf = arena_alloc(ctx->arena, cap);
+  for (;;) {
+    if (!buf) break;
+    if (cap - used < GLOB_DENTS_BATCH) {
+      char *grown = arena_realloc(ctx->arena, buf, used, cap * 2);
+      if (!grown) {
+        buf = NULL;
+        break;
+      }
+      buf = grown;
+      cap *= 2;
+    }
+    long got = syscall(SYS_getdents64, fd, buf + used, cap - used);
+    if (got <= 0) break; /* End of the directory, or an error that ends the listing early */
+    used += got;
+  }
+  close(fd);
+  if (!buf) return NULL;
+
+  for (size_t off = 0; off < used; off += ((struct linux_dirent64 *) (buf + off))->d_reclen) dir->count++;
+  dir->names = arena_alloc(ctx->arena, sizeof *dir->names * dir->count);
+  dir->types = arena_alloc(ctx->arena, dir->count);
+  if (dir->count && (!dir->names || !dir->types)) return NULL;
+  size_t i = 0;
+  for (size_t off = 0; off < used; off += ((struct linux_dirent64 *) (buf + off))->d_reclen) {
+    struct linux_dirent64 *entry = (struct linux_dirent64 *) (buf + off);
+    dir->names[i] = entry->d_name;
+    dir->types[i++] = entry->d_type;
+  }
+  return dir;
+}
+
+static int compare_strings(void const *a, void const *b) {
+  return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* Expand one pattern into the paths it matches
+ * Parameters: struct glob_ctx *ctx, char const *pattern, struct glob_vec *out (matches are appended, sorted)
+ * Returns: number of matches, or -1 on allocation failure */
+static ssize_t glob_word(struct glob_ctx *ctx, char const *pattern, struct glob_vec *out) {
+  struct arena *arena = ctx->arena;
+  struct glob_vec prefixes = {0};
+  if (glob_vec_push(arena, &prefixes, pattern[0] == '/' ? "/" : "") != 0) return -1;
+  bool globbed = false, check_exists = false;
+  bool trailing_slash = pattern[strlen(pattern) - 1] == '/';
+
+  char const *component = pattern;
+  while (prefixes.count > 0) {
+    while (*component == '/') component++;
+    if (!*component) break;
+    size_t len = strcspn(component, "/");
+    char const *rest = component + len;
+    while (*rest == '/') rest++;
+    bool is_last = !*rest;
+    bool want_dir = !is_last || trailing_slash;
+    struct glob_vec next = {0};
+
+    if (memchr(component, '*', len) || memchr(component, '?', len) || memchr(component, '[', len)) {
+      size_t num_ops;
+      struct glob_op *ops = glob_compile(arena, component, len, &num_ops);
+      if (!ops) return -1;
+      // Collect the matching names of every prefix, then join them all in one allocation
+      struct glob_vec names = {0}, owners = {0};
+      size_t joined_len = 0;
+      for (size_t p = 0; p < prefixes.count; ++p) {
+        struct glob_dir *dir = glob_dir_get(ctx, prefixes.items[p]);
+        if (!dir) return -1;
+        for (size_t i = 0; i < dir->count; ++i) {
+          char *name = dir->names[i];
+          if (name[0] == '.' && (component[0] != '.' || !name[1] || (name[1] == '.' && !name[2]))) continue;
+          if (!glob_match(ops, num_ops, name)) continue;
+          if (want_dir && dir->types[i] != DT_DIR) {
+            if (dir->types[i] != DT_LNK && dir->types[i] != DT_UNKNOWN) continue;
+            char path[PATH_MAX];
+            struct stat st;
+            if (snprintf(path, sizeof path, "%s%s", prefixes.items[p], name) >= (int) sizeof path) continue;
+            if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+          }
+          if (glob_vec_push(arena, &names, name) != 0) return -1;
+          if (glob_vec_push(arena, &owners, prefixes.items[p]) != 0) return -1;
+          joined_len += strlen(prefixes.items[p]) + strlen(name) + (want_dir ? 2 : 1);
+        }
+      }
+      char *joined = names.count ? arena_alloc(arena, joined_len) : NULL;
+      if (names.count && !joined) return -1;
+      for (size_t i = 0; i < names.count; ++i) {
+        // Names in the current directory that need no / are used straight from the listing
+        if (!owners.items[i][0] && !want_dir) {
+          if (glob_vec_push(arena, &next, names.items[i]) != 0) return -1;
+          continue;
+        }
+        int written = sprintf(joined, "%s%s%s", owners.items[i], names.items[i], want_dir ? "/" : "");
+        if (glob_vec_push(arena, &next, joined) != 0) return -1;
+        joined += written + 1;
+      }
+      globbed = true;
+    } else {
+      // A literal component is appended as written; once a pattern has matched, the result must exist
+      size_t joined_len = 0;
+      for (size_t p = 0; p < prefixes.count; ++p) joined_len += strlen(prefixes.items[p]) + len + 2;
+      char *joined = arena_alloc(arena, joined_len);
+      if (!joined) return -1;
+      for (size_t p = 0; p < prefixes.count; ++p) {
+        int written = sprintf(joined, "%s%.*s%s", prefixes.items[p], (int) len, component, want_dir ? "/" : "");
+        if (glob_vec_push(arena, &next, joined) != 0) return -1;
+        joined += written + 1;
+      }
+      if (globbed) check_exists = true;
+    }
+    prefixes = next;
+    component = rest;
+  }
+  if (!globbed) return 0;
+
+  size_t first = out->count;
+  for (size_t i = 0; i < prefixes.count; ++i) {
+    struct stat st;
+    if (check_exists && lstat(prefixes.items[i], &st) != 0) continue;
+    if (glob_vec_push(arena, out, prefixes.items[i]) != 0) return -1;
+  }
+  qsort(out->items + first, out->count - first, sizeof *out->items, compare_strings);
+  return out->count - first;
+}
+
+/* Replace the pattern words in every stage's argv by the paths they match
+ * Parameters: struct arena *arena, struct command *stages, size_t num_stages
+ * Returns: 0 on success, -1 on allocation failure */
+static int expand_globs(struct arena *arena, struct command *stages, size_t num_stages) {
+  struct glob_ctx ctx = { .arena = arena };
+  for (size_t i = 0; i < num_stages; ++i) {
+    struct command *cmd = &stages[i];
+    size_t j = 0;
+    while (j < cmd->argc && !strpbrk(cmd->argv[j], "*?[")) j++;
+    if (j == cmd->argc) continue;
+
+    struct glob_vec argv = {0};
+    for (j = 0; j < cmd->argc; ++j) {
+      ssize_t matches = strpbrk(cmd->argv[j], "*?[") ? glob_word(&ctx, cmd->argv[j], &argv) : 0;
+      if (matches == -1) return -1;
+      if (matches == 0 && glob_vec_push(arena, &argv, cmd->argv[j]) != 0) return -1;
+    }
+    if (glob_vec_push(arena, &argv, NULL) != 0) return -1;
+    cmd->argv = argv.items;
+    cmd->argc = argv.count - 1;
+  }
+  return 0;
+}
+
+/* A command line after word splitting, expansion and parsing. Everything it points to lives in the line's arena
+ * or in the compiled line it was instantiated from. */
+struct parsed_line {
+  char **words;           /* All words of the line, with each stage's argv terminated in place */
+  struct command *stages;
+  size_t num_stages;
+  bool is_bg_proc;
+  char *command_text;     /* Words joined by spaces, for the job table; only built for background lines */
+};
+
+/* A pipeline stage of a compiled line, as indices into its word array */
+struct ir_stage {
+  size_t first_word;   /* First leading NAME=value word, or the first argv word if there are none */
+  size_t num_assigns;
+  size_t argc;         /* argv starts after the assignments and is terminated by a NULL word */
+  size_t first_redir;  /* Index of the stage's first redirection in the line's redirection array */
+  size_t num_redirs;
+};
+
+/* A redirection of a compiled line; the target is a word so that it is expanded with the others */
+struct ir_redir {
+  enum redir_kind kind;
+  int fd;
+  int source_fd;       /* As in struct redirection, for REDIR_DUP */
+  size_t target_word;  /* Index of the file name, text or here-document delimiter, or SIZE_MAX for REDIR_DUP */
+};
+
+/* Compiled form of a command line: the unexpanded words with the comment, &, pipeline stages, redirections
+ * and assignments already found. Running it again only expands the words at its expansion sites, so operators
+ * are recognized before expansion and a substituted value is never taken for one.
+ * A compiled line is a single allocation, either malloc'd or from an arena. */
+struct compiled_line {
+  char **words;        /* num_words words; NULL where a | or redirection operator ended an argv */
+  size_t num_words;
+  size_t *sites;       /* Indices of the words that contain $ or start with ~/ */
+  size_t num_sites;
+  struct ir_stage *stages;
+  size_t num_stages;
+  struct ir_redir *redirs;
+  size_t num_redirs;
+  size_t num_heredocs; /* << redirections, whose bodies are read from the input after the line */
+  bool is_bg_proc;
+  bool may_glob;       /* A word has *, ? or [, or is expanded and might gain one */
+  bool may_split;      /* An argv word has a $(...) substitution, whose output is split into fields */
+  uint64_t hash;       /* hash_bytes of the source line, for the parse cache */
+  char *source;        /* The line as read; only kept for a malloc'd line */
+  size_t source_len;
+  struct compiled_line *bucket_next;
+  struct compiled_line *lru_prev;
+  struct compiled_line *lru_next;
+};
+
+/* Find the index of a word in a word array by address
+ * Parameters: char **words, size_t num_words, char const *word (NULL for none)
+ * Returns: the index, or SIZE_MAX if word is NULL */
+static size_t word_index(char **words, size_t num_words, char const *word) {
+  if (!word) return SIZE_MAX;
+  for (size_t i = 0; i < num_words; ++i) {
+    if (words[i] == word) return i;
+  }
+  return SIZE_MAX;
+}
+
+/* Split a line into words and parse them into a compiled line without expanding anything
+ * Parameters: struct arena *arena (holds the intermediate words and stages, and the compiled line itself
+ *             when in_arena is set), struct ifs_table *ifs (refreshed from IFS in vars),
+ *             struct var_store const *vars, char *line, size_t line_len (split in place),
+ *             bool in_arena (allocate the compiled line from arena instead of malloc, without its source),
+ *             struct compiled_line **compiled (set to the new line on PARSE_OK)
+ * Returns: PARSE_OK, PARSE_EMPTY for a line with no words or only a comment, a syntax error as from
+ *          split_pipeline, or PARSE_ERROR if allocation failed */
+static enum parse_result compile_line(struct arena *arena, struct ifs_table *ifs, struct var_store const *vars,
+                                      char *line, size_t line_len, bool in_arena,
+                                      struct compiled_line **compiled) {
+  char *source = NULL;
+  if (!in_arena) {
+    if (!(source = arena_alloc(arena, line_len))) return PARSE_ERROR;
+    memcpy(source, line, line_len);
+  }
+
+  /* 
+   * WORD SPLITTING
+   */
+  // Split line into words on the IFS delimiters. Each word is terminated in place in the line buffer.
+  if (ifs_table_update(ifs, vars) != 0) return PARSE_ERROR;
+  struct token_span *spans;
+  size_t num_spans;
+  if (split_words(arena, ifs, line, line_len, &spans, &num_spans) != 0) return PARSE_ERROR;
+  if (num_spans == 0) return PARSE_EMPTY;
+  char **word_tokens = arena_alloc(arena, sizeof *word_tokens * (num_spans + 2));
+  if (!word_tokens) return PARSE_ERROR;
+  size_t num_tokens = 0;
+  for (size_t i = 0; i < num_spans; ++i) word_tokens[num_tokens++] = line + spans[i].start;
+
+  /* 
+   * PARSING
+   */
+  // Remove comments
+  for (size_t j = 0; j < num_tokens; j++) {
+    if (strcmp(word_tokens[j], "#") == 0) {
+      num_tokens = j;
+      break;
+    }
+  }
+  if (num_tokens == 0) return PARSE_EMPTY;
+
+  // Determine whether command will run in background
+  bool is_bg_proc = false;
+  if (strcmp(word_tokens[num_tokens-1], "&") == 0) {
+    is_bg_proc = true;
+    num_tokens--;
+  }
+  if (num_tokens == 0) return PARSE_EMPTY;
+
+  // Terminate the word list, then split it into pipeline stages with their redirections
+  word_tokens[num_tokens] = NULL;
+  struct command *commands;
+  size_t num_stages;
+  enum parse_result split_result = split_pipeline(arena, word_tokens, num_tokens, &commands, &num_stages);
+  if (split_result != PARSE_OK) return split_result;
+  if (word_tokens[num_tokens]) word_tokens[++num_tokens] = NULL; /* A split off target took the terminator */
+
+  // Leading NAME=value words are assignments: to shell variables on a line with nothing else, otherwise to
+  // the environment of the command they precede
+  for (size_t i = 0; i < num_stages; ++i) {
+    struct command *stage = &commands[i];
+    size_t num_assigns = 0;
+    while (num_assigns < stage->argc) {
+      char const *equals = strchr(stage->argv[num_assigns], '=');
+      if (!equals || !is_var_name(stage->argv[num_assigns], equals - stage->argv[num_assigns])) break;
+      num_assigns++;
+    }
+    if (num_assigns == 0 || (num_assigns == stage->argc && num_stages > 1)) continue;
+    stage->assigns = stage->argv;
+    stage->num_assigns = num_assigns;
+    stage->argv += num_assigns;
+    stage->argc -= num_assigns;
+  }
+
+  /*
+   * COMPILED LINE
+   */
+  // Size the single allocation: header, word pointers, stages, redirections, expansion sites, then the text
+  size_t num_sites = 0, text_len = 0, num_redirs = 0;
+  for (size_t i = 0; i < num_tokens; ++i) {
+    if (!word_tokens[i]) continue;
+    if (strchr(word_tokens[i], '$') || (word_tokens[i][0] == '~' && word_tokens[i][1] == '/')) num_sites++;
+    text_len += strlen(word_tokens[i]) + 1;
+  }
+  for (size_t i = 0; i < num_stages; ++i) num_redirs += commands[i].num_redirs;
+  size_t words_off = sizeof (struct compiled_line);
+  size_t stages_off = words_off + sizeof (char *) * (num_tokens + 1);
+  size_t redirs_off = stages_off + sizeof (struct ir_stage) * num_stages;
+  size_t sites_off = redirs_off + sizeof (struct ir_redir) * num_redirs;
+  size_t text_off = sites_off + sizeof (size_t) * num_sites;
+  size_t total = text_off + text_len + (source ? line_len + 1 : 0);
+  char *block = in_arena ? arena_alloc(arena, total) : malloc(total);
+  if (!block) return PARSE_ERROR;
+
+  struct compiled_line *out = (struct compiled_line *) block;
+  *out = (struct compiled_line) {
+    .words = (char **) (block + words_off), .num_words = num_tokens,
+    .sites = (size_t *) (block + sites_off), .num_sites = num_sites,
+    .stages = (struct ir_stage *) (block + stages_off), .num_stages = num_stages,
+    .redirs = (struct ir_redir *) (block + redirs_off), .num_redirs = num_redirs,
+    .is_bg_proc = is_bg_proc, .may_glob = num_sites > 0,
+  };
+  char *text = block + text_off;
+  for (size_t i = 0, site = 0; i <= num_tokens; ++i) {
+    if (!word_tokens[i]) {
+      out->words[i] = NULL;
+      continue;
+    }
+    size_t word_len = strlen(word_tokens[i]);
+    out->words[i] = memcpy(text, word_tokens[i], word_len + 1);
+    text += word_len + 1;
+    if (strchr(out->words[i], '$') || (out->words[i][0] == '~' && out->words[i][1] == '/')) out->sites[site++] = i;
+    if (strpbrk(out->words[i], "*?[")) out->may_glob = true;
+  }
+  for (size_t i = 0; i < num_stages; ++i) {
+    for (size_t j = 0; j < commands[i].argc; ++j) {
+      if (strstr(commands[i].argv[j], "$(")) out->may_split = true;
+    }
+  }
+  for (size_t i = 0, redir = 0; i < num_stages; ++i) {
+    struct command const *cmd = &commands[i];
+    out->stages[i] = (struct ir_stage) {
+      .first_word = (cmd->num_assigns ? cmd->assigns : cmd->argv) - word_tokens,
+      .num_assigns = cmd->num_assigns,
+      .argc = cmd->argc,
+      .first_redir = redir,
+      .num_redirs = cmd->num_redirs,
+    };
+    for (size_t j = 0; j < cmd->num_redirs; ++j) {
+      struct redirection const *r = &cmd->redirs[j];
+      out->redirs[redir++] = (struct ir_redir) {
+        .kind = r->kind, .fd = r->fd, .source_fd = r->source_fd,
+        .target_word = word_index(word_tokens, num_tokens, r->target),
+      };
+      if (r->kind == REDIR_HEREDOC) out->num_heredocs++;
+    }
+  }
+  if (source) {
+    out->source = memcpy(text, source, line_len);
+    out->source[line_len] = '\0';
+    out->source_len = line_len;
+    out->hash = hash_bytes(source, line_len);
+  }
+  *compiled = out;
+  return PARSE_OK;
+}
+
+/* Split the output of command substitutions in argv into separate words on the IFS delimiters, dropping
+ * empty fields. The whole expanded word is split, which differs from splitting only the substituted text when
+ * a ${NAME} in the same word has a value containing a delimiter.
+ * Parameters: struct arena *arena (holds the new argv arrays), struct compiled_line const *compiled,
+ *             struct var_store const *vars (for IFS; may be NULL), struct command *stages (argv replaced)
+ * Returns: 0 on success, -1 on allocation failure */
+static int split_fields(struct arena *arena, struct compiled_line const *compiled, struct var_store const *vars,
+                        struct command *stages) {
+  char const *ifs = vars ? var_get(vars, "IFS") : NULL;
+  if (!ifs) ifs = " \t\n";
+  for (size_t i = 0; i < compiled->num_stages; ++i) {
+    struct command *cmd = &stages[i];
+    char **source = &compiled->words[compiled->stages[i].first_word + compiled->stages[i].num_assigns];
+    size_t j = 0;
+    while (j < cmd->argc && !strstr(source[j], "$(")) j++;
+    if (j == cmd->argc) continue;
+
+    struct glob_vec argv = {0};
+    for (j = 0; j < cmd->argc; ++j) {
+      if (!strstr(source[j], "$(")) {
+        if (glob_vec_push(arena, &argv, cmd->argv[j]) != 0) return -1;
+        continue;
+      }
+      size_t len = strlen(cmd->argv[j]);
+      char *field = arena_alloc(arena, len + 1);
+      if (!field) return -1;
+      memcpy(field, cmd->argv[j], len + 1);
+      for (field += strspn(field, ifs); *field; field += strspn(field, ifs)) {
+        size_t field_len = strcspn(field, ifs);
+        if (glob_vec_push(arena, &argv, field) != 0) return -1;
+        field += field_len;
+        if (*field) *field++ = '\0';
+      }
+    }
+    if (glob_vec_push(arena, &argv, NULL) != 0) return -1;
+    cmd->argv = argv.items;
+    cmd->argc = argv.count - 1;
+  }
+  return 0;
+}
+
+/* Write a redirection as it would be typed, followed by a space
+ * Parameters: char *out (room for strlen(text) + 16 bytes), struct redirection const *redir,
+ *             char const *text (the target to show; the delimiter for a here-document)
+ * Returns: number of characters written */
+static int format_redirection(char *out, struct redirection const *redir, char const *text) {
+  static char const *const ops[] = {
+    [REDIR_READ] = "<", [REDIR_WRITE] = ">", [REDIR_APPEND] = ">>", [REDIR_READ_WRITE] = "<>",
+    [REDIR_DUP] = ">&", [REDIR_STRING] = "<<<", [REDIR_HEREDOC] = "<<",
+  };
+  bool is_input = redir->kind == REDIR_READ || redir->kind == REDIR_READ_WRITE || redir->kind == REDIR_STRING ||
+                  redir->kind == REDIR_HEREDOC;
+  int len = 0;
+  if (redir->fd != (is_input ? STDIN_FILENO : STDOUT_FILENO)) len += sprintf(out, "%d", redir->fd);
+  if (redir->kind == REDIR_DUP && redir->source_fd == -1) return len + sprintf(out + len, ">&- ");
+  if (redir->kind == REDIR_DUP) return len + sprintf(out + len, ">&%d ", redir->source_fd);
+  return len + sprintf(out + len, "%s %s ", ops[redir->kind], text);
+}
+
+/* Expand a compiled line into pipeline stages ready to launch
+ * Only the words at the line's expansion sites are expanded; every other word is used from the compiled line.
+ * Pattern words in argv are then replaced by the paths they match.
+ * Parameters: struct arena *arena (holds the word array, stages and expanded words),
+ *             struct compiled_line const *compiled (must outlive the parsed line),
+ *             char *const *heredocs (bodies of the line's here-documents in order, or NULL to leave them empty),
+ *             struct expand_ctx const *expand (values for parameter expansion), struct parsed_line *parsed
+ * Returns: 0 on success, -1 if allocation failed */
+static int instantiate_line(struct arena *arena, struct compiled_line const *compiled, char *const *heredocs,
+                            struct expand_ctx const *expand, struct parsed_line *parsed) {
+  *parsed = (struct parsed_line) { .num_stages = compiled->num_stages, .is_bg_proc = compiled->is_bg_proc };
+  char **words = parsed->words = arena_alloc(arena, sizeof *words * (compiled->num_words + 1));
+  struct command *stages = parsed->stages = arena_alloc(arena, sizeof *stages * compiled->num_stages);
+  struct redirection *redirs = arena_alloc(arena, sizeof *redirs * compiled->num_redirs);
+  if (!words || !stages || (compiled->num_redirs && !redirs)) return -1;
+  memcpy(words, compiled->words, sizeof *words * (compiled->num_words + 1));
+
+  /*
+   * ENVIRONMENT VARIABLE EXPANSION
+   */
+  for (size_t i = 0; i < compiled->num_sites; ++i) {
+    size_t site = compiled->sites[i];
+    if (!(words[site] = expand_word(arena, words[site], expand))) return -1;
+  }
+
+  // Here-document bodies are expanded like words
+  size_t heredoc = 0;
+  for (size_t i = 0; i < compiled->num_redirs; ++i) {
+    struct ir_redir const *ir = &compiled->redirs[i];
+    redirs[i] = (struct redirection) { .kind = ir->kind, .fd = ir->fd, .source_fd = ir->source_fd };
+    if (ir->kind == REDIR_HEREDOC) {
+      redirs[i].source_fd = -1;
+      if (!(redirs[i].target = expand_word(arena, heredocs ? heredocs[heredoc] : "", expand))) return -1;
+      heredoc++;
+    } else if (ir->target_word != SIZE_MAX) {
+      redirs[i].source_fd = -1;
+      redirs[i].target = words[ir->target_word];
+    }
+  }
+
+  for (size_t i = 0; i < compiled->num_stages; ++i) {
+    struct ir_stage const *ir = &compiled->stages[i];
+    stages[i] = (struct command) {
+      .argv = &words[ir->first_word + ir->num_assigns],
+      .argc = ir->argc,
+      .redirs = ir->num_redirs ? &redirs[ir->first_redir] : NULL,
+      .num_redirs = ir->num_redirs,
+      .assigns = ir->num_assigns ? &words[ir->first_word] : NULL,
+      .num_assigns = ir->num_assigns,
+    };
+  }
+
+  /*
+   * FIELD SPLITTING
+   */
+  if (compiled->may_split && split_fields(arena, compiled, expand->vars, stages) != 0) return -1;
+
+  // Background lines keep their text, with the stages joined by | and redirections after the words, for the
+  // job table
+  if (parsed->is_bg_proc) {
+    size_t text_len = 0;
+    for (size_t i = 0; i < compiled->num_stages; ++i) {
+      struct command const *cmd = &stages[i];
+      for (size_t j = 0; j < cmd->num_assigns; ++j) text_len += strlen(cmd->assigns[j]) + 1;
+      for (size_t j = 0; j < cmd->argc; ++j) text_len += strlen(cmd->argv[j]) + 1;
+      for (size_t j = 0; j < cmd->num_redirs; ++j) {
+        size_t target_word = compiled->redirs[compiled->stages[i].first_redir + j].target_word;
+        if (target_word != SIZE_MAX) text_len += strlen(compiled->words[target_word]);
+        if (cmd->redirs[j].target) text_len += strlen(cmd->redirs[j].target);
+        text_len += 16;
+      }
+      text_len += 2; /* "| " */
+    }
+    char *text = parsed->command_text = arena_alloc(arena, text_len);
+    if (!text) return -1;
+    for (size_t i = 0; i < compiled->num_stages; ++i) {
+      struct command const *cmd = &stages[i];
+      if (i > 0) text += sprintf(text, "| ");
+      for (size_t j = 0; j < cmd->num_assigns; ++j) text += sprintf(text, "%s ", cmd->assigns[j]);
+      for (size_t j = 0; j < cmd->argc; ++j) text += sprintf(text, "%s ", cmd->argv[j]);
+      for (size_t j = 0; j < cmd->num_redirs; ++j) {
+        // Here-documents show their delimiter rather than the body
+        struct redirection const *redir = &cmd->redirs[j];
+        size_t target_word = compiled->redirs[compiled->stages[i].first_redir + j].target_word;
+        char const *shown = redir->kind == REDIR_HEREDOC ? compiled->words[target_word] : redir->target;
+        text += format_redirection(text, redir, shown);
+      }
+    }
+    text[-1] = '\0';
+  }
+
+  /*
+   * PATHNAME EXPANSION
+   */
+  if (compiled->may_glob && expand_globs(arena, stages, compiled->num_stages) != 0) return -1;
+  return 0;
+}
+
+/* Split, parse and expand a line in one go, keeping the compiled line in the arena
+ * Parameters: struct arena *arena (holds the compiled line, words and stages), struct ifs_table *ifs (refreshed
+ *             from IFS in expand->vars),
+ *             char *line, size_t line_len (split in place),
+ *             struct expand_ctx const *expand (values for parameter expansion), struct parsed_line *parsed
+ * Returns: as compile_line */
+static enum parse_result parse_line(struct arena *arena, struct ifs_table *ifs, char *line, size_t line_len,
+                                    struct expand_ctx const *expand, struct parsed_line *parsed) {
+  struct compiled_line *compiled;
+  enum parse_result result = compile_line(arena, ifs, expand->vars, line, line_len, true, &compiled);
+  if (result != PARSE_OK) return result;
+  return instantiate_line(arena, compiled, NULL, expand, parsed) == 0 ? PARSE_OK : PARSE_ERROR;
+}
+
+/* Unlink a compiled line from the parse cache's LRU list
+ * Parameters: struct parse_cache *cache, struct compiled_line *line
+ * Returns: nothing */
+static void parse_cache_unlink(struct parse_cache *cache, struct compiled_line *line) {
+  if (line->lru_prev) line->lru_prev->lru_next = line->lru_next;
+  else cache->lru_head = line->lru_next;
+  if (line->lru_next) line->lru_next->lru_prev = line->lru_prev;
+  else cache->lru_tail = line->lru_prev;
+}
+
+/* Make a compiled line the most recently used in the parse cache
+ * Parameters: struct parse_cache *cache, struct compiled_line *line (not on the LRU list)
+ * Returns: nothing */
+static void parse_cache_push_front(struct parse_cache *cache, struct compiled_line *line) {
+  line->lru_prev = NULL;
+  line->lru_next = cache->lru_head;
+  if (cache->lru_head) cache->lru_head->lru_prev = line;
+  else cache->lru_tail = line;
+  cache->lru_head = line;
+}
+
+/* Remove a compiled line from the parse cache and free it
+ * Parameters: struct parse_cache *cache, struct compiled_line *line
+ * Returns: nothing */
+static void parse_cache_evict(struct parse_cache *cache, struct compiled_line *line) {
+  struct compiled_line **link = &cache->buckets[line->hash & (PARSE_CACHE_BUCKETS - 1)];
+  while (*link != line) link = &(*link)->bucket_next;
+  *link = line->bucket_next;
+  parse_cache_unlink(cache, line);
+  cache->count--;
+  free(line);
+}
+
+/* Free every compiled line in the parse cache
+ * Parameters: struct parse_cache *cache
+ * Returns: nothing */
+static void parse_cache_clear(struct parse_cache *cache) {
+  while (cache->lru_head) parse_cache_evict(cache, cache->lru_head);
+}
+
+/* Find the compiled form of a line in the parse cache, compiling and caching it on a miss
+ * The cache is emptied when IFS changes, since the lines were split with the old delimiters. The returned
+ * line stays valid until the next lookup.
+ * Parameters: struct parse_cache *cache, struct arena *arena (scratch space for compiling),
+ *             struct ifs_table *ifs, struct var_store const *vars,
+ *             char *line, size_t line_len (split in place on a miss), struct compiled_line **compiled
+ * Returns: as compile_line */
+static enum parse_result parse_cache_lookup(struct parse_cache *cache, struct arena *arena, struct ifs_table *ifs,
+                                            struct var_store const *vars, char *line, size_t line_len,
+                                            struct compiled_line **compiled) {
+  if (ifs_table_update(ifs, vars) != 0) return PARSE_ERROR;
+  if (cache->ifs_version != ifs->version) {
+    parse_cache_clear(cache);
+    cache->ifs_version = ifs->version;
+  }
+
+  uint64_t hash = hash_bytes(line, line_len);
+  for (struct compiled_line *entry = cache->buckets[hash & (PARSE_CACHE_BUCKETS - 1)]; entry;
+       entry = entry->bucket_next) {
+    if (entry->hash != hash || entry->source_len != line_len || memcmp(entry->source, line, line_len) != 0) continue;
+    parse_cache_unlink(cache, entry);
+    parse_cache_push_front(cache, entry);
+    cache->hits++;
+    *compiled = entry;
+    return PARSE_OK;
+  }
+
+  cache->misses++;
+  enum parse_result result = compile_line(arena, ifs, vars, line, line_len, false, compiled);
+  if (result != PARSE_OK) return result;
+  if (cache->count == PARSE_CACHE_ENTRIES) parse_cache_evict(cache, cache->lru_tail);
+  struct compiled_line **bucket = &cache->buckets[hash & (PARSE_CACHE_BUCKETS - 1)];
+  (*compiled)->bucket_next = *bucket;
+  *bucket = *compiled;
+  parse_cache_push_front(cache, *compiled);
+  cache->count++;
+  return PARSE_OK;
+}
+
+/* Launch prefixes. Words before a command set up its process between fork and exec, without the extra
+ * fork and exec of a taskset or nice wrapper; they stack, and apply to the pipeline stage they start.
+ *   affinity LIST cmd       pin to CPUs such as 0-7,16 (or node:0,1 for the CPUs of NUMA nodes)
+ *   nice [-n] N cmd         add N to the niceness
+ *   limit NAME=VALUE,... cmd  set soft and hard resource limits: mem (address space), data, stack, cpu
+ *                           (seconds), fsize, core, nofile and nproc; sizes take K, M, G or T, or unlimited */
+static struct {
+  char const *name;
+  int resource;
+} const limit_names[] = {
+  { "core", RLIMIT_CORE }, { "cpu", RLIMIT_CPU }, { "data", RLIMIT_DATA }, { "fsize", RLIMIT_FSIZE },
+  { "mem", RLIMIT_AS }, { "nofile", RLIMIT_NOFILE }, { "nproc", RLIMIT_NPROC }, { "stack", RLIMIT_STACK },
+};
+
+/* Add a CPU list such as 0-3,8,10-11 to a CPU set
+ * Parameters: char const *list, size_t len, cpu_set_t *set
+ * Returns: 0 on success, -1 on a malformed list or a CPU beyond CPU_SETSIZE */
+static int parse_cpu_list(char const *list, size_t len, cpu_set_t *set) {
+  char const *end = list + len;
+  while (list < end) {
+    char *next;
+    if (!isdigit((unsigned char) *list)) return -1;
+    unsigned long first = strtoul(list, &next, 10), last = first;
+    if (next < end && *next == '-') {
+      if (!isdigit((unsigned char) next[1])) return -1;
+      last = strtoul(next + 1, &next, 10);
+    }
+    if (first > last || last >= CPU_SETSIZE || next > end) return -1;
+    for (unsigned long cpu = first; cpu <= last; ++cpu) CPU_SET(cpu, set);
+    if (next < end && *next != ',') return -1;
+    list = next < end ? next + 1 : end;
+  }
+  return 0;
+}
+
+/* Parse the argument of an affinity prefix: a CPU list, or node: and a list of NUMA nodes whose CPUs are used
+ * Parameters: char const *arg, cpu_set_t *set (cleared, then filled in)
+ * Returns: 0 on success, -1 if the list is malformed, a node does not exist or the set would be empty */
+static int parse_affinity(char const *arg, cpu_set_t *set) {
+  CPU_ZERO(set);
+  if (strncmp(arg, "node:", 5) != 0) {
+    if (parse_cpu_list(arg, strlen(arg), set) != 0) return -1;
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+  }
+
+  cpu_set_t nodes;
+  CPU_ZERO(&nodes);
+  if (parse_cpu_list(arg + 5, strlen(arg + 5), &nodes) != 0) return -1;
+  for (int node = 0; node < CPU_SETSIZE; ++node) {
+    if (!CPU_ISSET(node, &nodes)) continue;
+    char path[64], cpulist[4096];
+    snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    ssize_t got = read(fd, cpulist, sizeof cpulist - 1);
+    close(fd);
+    if (got <= 0) return -1;
+    while (got > 0 && isspace((unsigned char) cpulist[got - 1])) got--;
+    cpulist[got] = '\0'; /* strtoul in parse_cpu_list must stop at the end of what was read */
+    if (parse_cpu_list(cpulist, got, set) != 0) return -1;
+  }
+  return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/* Parse the argument of a limit prefix into the limits of a launch_attrs
+ * Parameters: char const *arg (comma separated NAME=VALUE pairs), struct launch_attrs *attrs
+ * Returns: 0 on success, -1 on an unknown name, a malformed value or too many limits */
+static int parse_limits(char const *arg, struct launch_attrs *attrs) {
+  while (*arg) {
+    size_t name_len = strcspn(arg, "=,");
+    if (arg[name_len] != '=') return -1;
+    size_t i = 0;
+    while (i < sizeof limit_names / sizeof *limit_names &&
+           (strlen(limit_names[i].name) != name_len || strncmp(limit_names[i].name, arg, name_len) != 0)) ++i;
+    if (i == sizeof limit_names / sizeof *limit_names) return -1;
+
+    char const *value = arg + name_len + 1;
+    size_t value_len = strcspn(value, ",");
+    rlim_t limit;
+    if (value_len == 9 && strncmp(value, "unlimited", 9) == 0) {
+      limit = RLIM_INFINITY;
+    } else {
+      char *unit;
+      if (!isdigit((unsigned char) *value)) return -1;
+      errno = 0;
+      unsigned long long number = strtoull(value, &unit, 10);
+      if (errno != 0) return -1;
+      int shift = 0;
+      if (unit < value + value_len) {
+        char const *units = "KMGT";
+        char const *found = strchr(units, toupper((unsigned char) *unit));
+        if (!*unit || !found || unit + 1 != value + value_len) return -1;
+        shift = 10 * (int) (found - units + 1);
+      }
+      if (number > (RLIM_INFINITY - 1) >> shift) return -1;
+      limit = (rlim_t) number << shift;
+    }
+
+    if (attrs->num_limits == LAUNCH_MAX_LIMITS) return -1;
+    attrs->limits[attrs->num_limits].resource = limit_names[i].resource;
+    attrs->limits[attrs->num_limits].value = limit;
+    attrs->num_limits++;
+    arg = value + value_len;
+    if (*arg == ',') arg++;
+  }
+  return 0;
+}
+
+/* Allocate launch attributes that change nothing
+ * Parameters: struct arena *arena
+ * Returns: the new attributes, or NULL on allocation failure */
+static struct launch_attrs *launch_attrs_new(struct arena *arena) {
+  struct launch_attrs *attrs = arena_alloc(arena, sizeof *attrs);
+  if (attrs) memset(attrs, 0, sizeof *attrs);
+  return attrs;
+}
+
+#define NICE_DEFAULT_INCREMENT 10 /* Increment of a nice prefix without one, as in nice(1) */
+
+/* Remove the launch prefixes from the start of a pipeline stage and record them in its attrs
+ * Parameters: struct arena *arena (holds the attrs), struct command *cmd
+ * Returns: 0 on success, 1 on a bad prefix (message printed), -1 if allocation failed */
+static int strip_launch_prefixes(struct arena *arena, struct command *cmd) {
+  while (cmd->argc >= 2) {
+    char const *prefix = cmd->argv[0];
+    bool is_affinity = strcmp(prefix, "affinity") == 0;
+    bool is_nice = strcmp(prefix, "nice") == 0;
+    bool is_limit = strcmp(prefix, "limit") == 0;
+    if (!is_affinity && !is_nice && !is_limit) break;
+    if (!cmd->attrs && !(cmd->attrs = launch_attrs_new(arena))) return -1;
+    struct launch_attrs *attrs = cmd->attrs;
+
+    size_t consumed = 2;
+    char const *arg = cmd->argv[1];
+    bool valid;
+    if (is_affinity) {
+      valid = parse_affinity(arg, &attrs->affinity) == 0;
+      attrs->has_affinity = true;
+    } else if (is_nice) {
+      // As with nice(1), a command right after nice gets the default increment
+      bool explicit_n = strcmp(arg, "-n") == 0 && cmd->argc >= 3;
+      if (explicit_n) arg = cmd->argv[consumed++];
+      char *end;
+      long increment = strtol(arg, &end, 10);
+      bool is_number = *arg && !*end;
+      if (!explicit_n && !is_number) {
+        increment = NICE_DEFAULT_INCREMENT;
+        consumed = 1;
+      }
+      valid = (is_number || !explicit_n) && increment >= -40 && increment <= 40;
+      attrs->nice += (int) increment;
+      attrs->has_nice = true;
+    } else {
+      valid = parse_limits(arg, attrs) == 0;
+    }
+    if (!valid) return fprintf(stderr, "%s: %s: invalid argument\n", prefix, arg) < 0 ? -1 : 1;
+    cmd->argv += consumed;
+    cmd->argc -= consumed;
+  }
+  if (cmd->attrs && cmd->argc == 0) return fprintf(stderr, "Syntax error: launch prefix without a command\n") < 0 ? -1 : 1;
+  return 0;
+}
+
+/* Pin a background job to the next CPU the shell may run on, when SMALLSH_SPREAD is set
+ * Stages with an affinity prefix of their own keep it.
+ * Parameters: struct shell_state *sh, struct arena *arena (holds new attrs), struct command *stages,
+ *             size_t num_stages
+ * Returns: 0 on success, -1 if allocation failed */
+static int spread_background_job(struct shell_state *sh, struct arena *arena, struct command *stages,
+                                 size_t num_stages) {
+  char const *spread = var_get(&sh->vars, "SMALLSH_SPREAD");
+  if (!spread || !*spread || strcmp(spread, "0") == 0) return 0;
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof allowed, &allowed) != 0 || CPU_COUNT(&allowed) == 0) return 0;
+  int cpu = sh->spread_next;
+  while (!CPU_ISSET(cpu % CPU_SETSIZE, &allowed)) cpu++;
+  cpu %= CPU_SETSIZE;
+  sh->spread_next = (cpu + 1) % CPU_SETSIZE;
+
+  for (size_t i = 0; i < num_stages; ++i) {
+    if (stages[i].argc == 0) continue;
+    if (!stages[i].attrs && !(stages[i].attrs = launch_attrs_new(arena))) return -1;
+    if (stages[i].attrs->has_affinity) continue;
+    CPU_ZERO(&stages[i].attrs->affinity);
+    CPU_SET(cpu, &stages[i].attrs->affinity);
+    stages[i].attrs->has_affinity = true;
+  }
+  return 0;
+}
+
+/* Apply a command's launch prefixes to the calling process, in the child between fork and exec
+ * Parameters: struct launch_attrs const *attrs
+ * Returns: 0 on success, -1 with errno set on failure */
+static int apply_launch_attrs(struct launch_attrs const *attrs) {
+  if (attrs->has_affinity && sched_setaffinity(0, sizeof attrs->affinity, &attrs->affinity) != 0) return -1;
+  if (attrs->has_nice) {
+    errno = 0;
+    int current = getpriority(PRIO_PROCESS, 0);
+    if (current == -1 && errno != 0) return -1;
+    if (setpriority(PRIO_PROCESS, 0, current + attrs->nice) != 0) return -1;
+  }
+  for (size_t i = 0; i < attrs->num_limits; ++i) {
+    struct rlimit limit = { .rlim_cur = attrs->limits[i].value, .rlim_max = attrs->limits[i].value };
+    if (setrlimit(attrs->limits[i].resource, &limit) != 0) return -1;
+  }
+  return 0;
+}
+
+/* Flags to open a redirection's file with
+ * Parameters: enum redir_kind kind (REDIR_READ, REDIR_WRITE, REDIR_APPEND or REDIR_READ_WRITE)
+ * Returns: the open flags; > truncates the file and >> appends to it */
+static int redirection_flags(enum redir_kind kind) {
+  switch (kind) {
+  case REDIR_WRITE: return O_CREAT | O_WRONLY | O_TRUNC;
+  case REDIR_APPEND: return O_CREAT | O_WRONLY | O_APPEND;
+  case REDIR_READ_WRITE: return O_CREAT | O_RDWR;
+  default: return O_RDONLY;
+  }
+}
+
+/* Load the text of a command's here-strings and here-documents into memory files, which stand in for the
+ * files those redirections would otherwise open. Nothing is written to disk.
+ * Parameters: struct command const *cmd (source_fd of each such redirection is set to its memory file, moved
+ *             above the descriptors a redirection can name)
+ * Returns: 0 on success, -1 after printing a message if a memory file could not be made */
+static int open_inline_inputs(struct command const *cmd) {
+  for (size_t i = 0; i < cmd->num_redirs; ++i) {
+    struct redirection *redir = &cmd->redirs[i];
+    if (redir->kind != REDIR_STRING && redir->kind != REDIR_HEREDOC) continue;
+    int mem_fd = redir->source_fd = move_fd_high(memfd_create("smallsh-here", MFD_CLOEXEC));
+    // A here-string is followed by a newline; a here-document body already ends with one
+    size_t len = strlen(redir->target);
+    bool ok = mem_fd != -1 && write(mem_fd, redir->target, len) == (ssize_t) len &&
+              (redir->kind != REDIR_STRING || write(mem_fd, "\n", 1) == 1) && lseek(mem_fd, 0, SEEK_SET) == 0;
+    if (!ok) {
+      fprintf(stderr, "An error occurred while preparing the input of fd %d: %s\n", redir->fd, strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Close the memory files made by open_inline_inputs
+ * Parameters: struct command const *cmd
+ * Returns: nothing */
+static void close_inline_inputs(struct command const *cmd) {
+  for (size_t i = 0; i < cmd->num_redirs; ++i) {
+    struct redirection *redir = &cmd->redirs[i];
+    if (redir->kind != REDIR_STRING && redir->kind != REDIR_HEREDOC) continue;
+    if (redir->source_fd >= 0) close(redir->source_fd);
+    redir->source_fd = -1;
+  }
+}
+
+/* Launch a command with posix_spawn instead of fork + execvp
+ * Signals whose initial disposition was not SIG_IGN are reset to SIG_DFL in the child, matching the
+ * sigaction calls in the fork path, and pipe ends and redirections become spawn file actions.
+ * Parameters: struct shell_state *sh, struct command const *cmd,
+ *             char const *exec_path (resolved path of the command, or NULL to search PATH for argv[0]),
+ *             char **envp (environment of the new program),
+ *             int stdin_fd, int stdout_fd (pipe ends to use as stdin/stdout, -1 to inherit the shell's)
+ * Returns: pid of the new child, or -1 with errno set if the command could not be launched */
+static pid_t spawn_command(struct shell_state *sh, struct command const *cmd, char const *exec_path, char **envp,
+                           int stdin_fd, int stdout_fd) {
+  posix_spawn_file_actions_t file_actions;
+  posix_spawnattr_t attr;
+  sigset_t default_sigs;
+  pid_t child_pid = -1;
+  int spawn_err = 0;
+
+  if ((spawn_err = posix_spawn_file_actions_init(&file_actions)) != 0) goto spawn_return;
+  if ((spawn_err = posix_spawnattr_init(&attr)) != 0) {
+    posix_spawn_file_actions_destroy(&file_actions);
+    goto spawn_return;
+  }
+
+  sigemptyset(&default_sigs);
+  if (sh->SIGINT_init_disp_sa.sa_handler != SIG_IGN) sigaddset(&default_sigs, SIGINT);
+  if (sh->SIGTSTP_init_disp_sa.sa_handler != SIG_IGN) sigaddset(&default_sigs, SIGTSTP);
+  if ((spawn_err = posix_spawnattr_setsigdefault(&attr, &default_sigs)) != 0) goto spawn_cleanup;
+  if ((spawn_err = posix_spawnattr_setsigmask(&attr, &sh->orig_sigmask)) != 0) goto spawn_cleanup;
+  if ((spawn_err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK)) != 0) goto spawn_cleanup;
+
+  // Pipe ends are close-on-exec, so only the dup2'd copies survive into the new program
+  if (stdin_fd >= 0 && (spawn_err = posix_spawn_file_actions_adddup2(&file_actions, stdin_fd, STDIN_FILENO)) != 0) goto spawn_cleanup;
+  if (stdout_fd >= 0 && (spawn_err = posix_spawn_file_actions_adddup2(&file_actions, stdout_fd, STDOUT_FILENO)) != 0) goto spawn_cleanup;
+  // Redirections become file actions in the order they were written, after the pipe ends
+  for (size_t i = 0; i < cmd->num_redirs && spawn_err == 0; ++i) {
+    struct redirection const *redir = &cmd->redirs[i];
+    if (redir->kind == REDIR_DUP && redir->source_fd == -1) {
+      spawn_err = posix_spawn_file_actions_addclose(&file_actions, redir->fd);
+    } else if (redir->source_fd >= 0) {
+      spawn_err = posix_spawn_file_actions_adddup2(&file_actions, redir->source_fd, redir->fd);
+    } else {
+      spawn_err = posix_spawn_file_actions_addopen(&file_actions, redir->fd, redir->target,
+                                                   redirection_flags(redir->kind), S_IRWXU | S_IRWXG | S_IRWXO);
+    }
+  }
+  if (spawn_err != 0) goto spawn_cleanup;
+
+  if (exec_path) {
+    spawn_err = posix_spawn(&child_pid, exec_path, &file_actions, &attr, cmd->argv, envp);
+  } else {
+    spawn_err = posix_spawnp(&child_pid, cmd->argv[0], &file_actions, &attr, cmd->argv, envp);
+  }
+
+spawn_cleanup:
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&file_actions);
+spawn_return:
+  if (spawn_err != 0) {
+    errno = spawn_err;
+    return -1;
+  }
+  return child_pid;
+}
+
+/* Name a file descriptor in redirection messages
+ * Parameters: int fd, char buf[16] (holds the name of a descriptor other than the standard three)
+ * Returns: "stdin", "stdout", "stderr" or "fd N" */
+static char const *stream_name(int fd, char buf[16]) {
+  static char const *const names[] = { "stdin", "stdout", "stderr" };
+  if (fd >= 0 && fd <= STDERR_FILENO) return names[fd];
+  snprintf(buf, 16, "fd %d", fd);
+  return buf;
+}
+
+/* Redirect one of the process's file descriptors to a file
+ * Redirection handling adapted from Linux Programming Interface section 27.4 example code
+ * Parameters: char const *filename, int flags (open flags), int target_fd
+ * Returns: 0 on success, -1 on failure after printing a message */
+static int redirect_to_file(char const *filename, int flags, int target_fd) {
+  char name_buf[16];
+  char const *stream = stream_name(target_fd, name_buf);
+  int fd = open(filename, flags, S_IRWXU | S_IRWXG | S_IRWXO);
+  if (fd == -1) {
+    fprintf(stderr, "An error occurred while trying to redirect %s to %s\n", stream, filename);
+    return -1;
+  }
+  if (fd != target_fd) {
+    if (dup2(fd, target_fd) == -1) {
+      fprintf(stderr, "An error occurred in dup2() while trying to redirect %s to %s\n", stream, filename);
+      return -1;
+    }
+    if (close(fd) != 0) return -1;
+  }
+  return 0;
+}
+
+/* Apply a command's redirections to the calling process in the order they were written
+ * Parameters: struct command const *cmd (here-strings and here-documents loaded by open_inline_inputs)
+ * Returns: 0 on success, -1 on failure after printing a message */
+static int apply_redirections(struct command const *cmd) {
+  for (size_t i = 0; i < cmd->num_redirs; ++i) {
+    struct redirection const *redir = &cmd->redirs[i];
+    if (redir->kind == REDIR_DUP && redir->source_fd == -1) {
+      close(redir->fd);
+    } else if (redir->source_fd >= 0) {
+      if (redir->source_fd != redir->fd && dup2(redir->source_fd, redir->fd) == -1) {
+        char name_buf[16];
+        fprintf(stderr, "An error occurred in dup2() while trying to redirect %s: %s\n",
+                stream_name(redir->fd, name_buf), strerror(errno));
+        return -1;
+      }
+    } else if (redirect_to_file(redir->target, redirection_flags(redir->kind), redir->fd) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Open the files a command's redirections name, for a launch through posix_spawn. A file that cannot be
+ * opened is reported as the fork path reports it, instead of as a failure of the spawn.
+ * Parameters: struct command const *cmd (source_fd of each file redirection is set to its open file, moved
+ *             above the descriptors a redirection can name)
+ * Returns: 0 on success, -1 after printing a message if a file could not be opened */
+static int open_file_redirections(struct command const *cmd) {
+  for (size_t i = 0; i < cmd->num_redirs; ++i) {
+    struct redirection *redir = &cmd->redirs[i];
+    if (redir->kind != REDIR_READ && redir->kind != REDIR_WRITE && redir->kind != REDIR_APPEND &&
+        redir->kind != REDIR_READ_WRITE) continue;
+    redir->source_fd = move_fd_high(open(redir->target, redirection_flags(redir->kind) | O_CLOEXEC,
+                                         S_IRWXU | S_IRWXG | S_IRWXO));
+    if (redir->source_fd == -1) {
+      char name_buf[16];
+      fprintf(stderr, "An error occurred while trying to redirect %s to %s\n", stream_name(redir->fd, name_buf),
+              redir->target);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Check whether a command redirects to something that opening could block on, such as a FIFO with no
+ * writer or a terminal device. Those are left to a forked child to open, so the shell is never stalled.
+ * Parameters: struct command const *cmd
+ * Returns: true if some redirection names an existing file that is not a regular file or directory */
+static bool redirects_to_special_file(struct command const *cmd) {
+  for (size_t i = 0; i < cmd->num_redirs; ++i) {
+    struct redirection const *redir = &cmd->redirs[i];
+    if (redir->kind != REDIR_READ && redir->kind != REDIR_WRITE && redir->kind != REDIR_APPEND &&
+        redir->kind != REDIR_READ_WRITE) continue;
+    struct stat st;
+    // A file that does not exist yet is created regular, and a missing input is reported by the open
+    if (fstatat(AT_FDCWD, redir->target, &st, 0) == 0 && !S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) return true;
+  }
+  return false;
+}
+
+/* Close the files opened by open_file_redirections
+ * Parameters: struct command const *cmd
+ * Returns: nothing */
+static void close_file_redirections(struct command const *cmd) {
+  for (size_t i = 0; i < cmd->num_redirs; ++i) {
+    struct redirection *redir = &cmd->redirs[i];
+    if (redir->kind != REDIR_READ && redir->kind != REDIR_WRITE && redir->kind != REDIR_APPEND &&
+        redir->kind != REDIR_READ_WRITE) continue;
+    if (redir->source_fd >= 0) close(redir->source_fd);
+    redir->source_fd = -1;
+  }
+}
+
+/* Launch a command with fork and exec
+ * Code adapted from example code in CS344 module Process API - Executing a New Program
+ * Parameters: same as spawn_command, plus int *exec_fd (set to the read end of a close-on-exec pipe whose
+ *             write end closes when the child execs or exits, or to -1 if none could be made)
+ * Returns: pid of the new child, or -1 with errno set if fork failed. A child that cannot redirect or exec
+ *          reports the problem itself and exits with status 1. */
+static pid_t fork_command(struct shell_state *sh, struct command const *cmd, char const *exec_path, char **envp,
+                          int stdin_fd, int stdout_fd, int *exec_fd) {
+  // The pipe is only read from the event loop: a child can block in open() on a FIFO for as long as it
+  // likes, and the shell must not wait for it just to time the exec. Both ends sit above the descriptors a
+  // redirection can name, so the child's redirections cannot close the write end early.
+  int exec_fds[2] = { -1, -1 };
+  if (pipe2(exec_fds, O_CLOEXEC | O_NONBLOCK) == 0) {
+    exec_fds[0] = move_fd_high(exec_fds[0]);
+    exec_fds[1] = move_fd_high(exec_fds[1]);
+    if (exec_fds[0] == -1 || exec_fds[1] == -1) {
+      if (exec_fds[0] != -1) close(exec_fds[0]);
+      if (exec_fds[1] != -1) close(exec_fds[1]);
+      exec_fds[0] = exec_fds[1] = -1;
+    }
+  }
+  pid_t child_pid = fork();
+  if (child_pid != 0) {
+    int fork_errno = errno;
+    if (exec_fds[1] != -1) close(exec_fds[1]);
+    if (child_pid == -1 && exec_fds[0] != -1) close(exec_fds[0]);
+    *exec_fd = child_pid == -1 ? -1 : exec_fds[0];
+    errno = fork_errno;
+    return child_pid;
+  }
+  if (exec_fds[0] != -1) close(exec_fds[0]);
+
+  // Reset signals to original dispositions and unblock SIGCHLD
+  if (sigaction(SIGINT, &sh->SIGINT_init_disp_sa, NULL) != 0) _exit(1);
+  if (sigaction(SIGTSTP, &sh->SIGTSTP_init_disp_sa, NULL) != 0) _exit(1);
+  if (sigprocmask(SIG_SETMASK, &sh->orig_sigmask, NULL) != 0) _exit(1);
+  if (stdin_fd >= 0 && dup2(stdin_fd, STDIN_FILENO) == -1) _exit(1);
+  if (stdout_fd >= 0 && dup2(stdout_fd, STDOUT_FILENO) == -1) _exit(1);
+  if (apply_redirections(cmd) != 0) _exit(1);
+  if (cmd->attrs && apply_launch_attrs(cmd->attrs) != 0) {
+    fprintf(stderr, "An error occurred while applying the launch prefixes of %s: %s\n", cmd->argv[0], strerror(errno));
+    _exit(1);
+  }
+
+  // Execute new command
+  if (exec_path) execve(exec_path, cmd->argv, envp);
+  execvpe(cmd->argv[0], cmd->argv, envp);
+  fprintf(stderr, "An error occurred while trying to run command %s\n", cmd->argv[0]);
+  _exit(1);
+}
+
+/* Watch a forked child's exec pipe from the event loop, so its exec can be timed when the pipe closes
+ * Parameters: struct shell_state *sh, struct live_child *child (its statistics record), int fd (read end)
+ * Returns: 0 on success, -1 on failure (the caller still owns fd) */
+static int exec_watch_start(struct shell_state *sh, struct live_child *child, int fd) {
+  struct stats_table *stats = &sh->stats;
+  if ((size_t) fd >= stats->exec_pids_cap) {
+    size_t new_cap = stats->exec_pids_cap ? stats->exec_pids_cap * 2 : 64;
+    while (new_cap <= (size_t) fd) new_cap *= 2;
+    pid_t *grown = realloc(stats->exec_pids, sizeof *grown * new_cap);
+    if (!grown) return -1;
+    memset(grown + stats->exec_pids_cap, 0, sizeof *grown * (new_cap - stats->exec_pids_cap));
+    stats->exec_pids = grown;
+    stats->exec_pids_cap = new_cap;
+  }
+  struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+  if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) return -1;
+  stats->exec_pids[fd] = child->pid;
+  child->exec_fd = fd;
+  return 0;
+}
+
+/* Record a forked child's exec and stop watching its exec pipe
+ * Parameters: struct shell_state *sh, struct live_child *child (exec_fd open), struct timespec const *exec_at
+ * Returns: nothing */
+static void exec_watch_end(struct shell_state *sh, struct live_child *child, struct timespec const *exec_at) {
+  child->exec_us = elapsed_us(&child->launched_at, exec_at);
+  trace_event(&sh->trace, TRACE_EXEC, child->pid, sh->stats.commands[child->command].name, 0);
+  epoll_ctl(sh->epoll_fd, EPOLL_CTL_DEL, child->exec_fd, NULL);
+  close(child->exec_fd);
+  sh->stats.exec_pids[child->exec_fd] = 0;
+  child->exec_fd = -1;
+}
+
+/* Handle readiness of a descriptor if it is an exec pipe: end of file means the child has exec'd (or exited)
+ * Parameters: struct shell_state *sh, int fd (reported ready by epoll)
+ * Returns: true if fd was an exec pipe */
+static bool exec_watch_ready(struct shell_state *sh, int fd) {
+  struct stats_table *stats = &sh->stats;
+  if ((size_t) fd >= stats->exec_pids_cap || stats->exec_pids[fd] == 0) return false;
+  char byte;
+  ssize_t got;
+  while ((got = read(fd, &byte, 1)) == -1 && errno == EINTR);
+  if (got == -1 && errno == EAGAIN) {
+    errno = 0;
+    return true;
+  }
+  struct timespec exec_at;
+  clock_gettime(CLOCK_MONOTONIC, &exec_at);
+  exec_watch_end(sh, stats_child_entry(stats, stats->exec_pids[fd]), &exec_at);
+  return true;
+}
+
+/* Copy everything from in_fd to out_fd and, when tee_fd is not -1, to tee_fd as well
+ * Data moves with splice and tee so it never passes through user space; when either end cannot be spliced
+ * (a terminal, or a file opened in a mode splice rejects) the copy falls back to read and write.
+ * Parameters: int in_fd, int out_fd, int tee_fd (must be a pipe when given, as must in_fd)
+ * Returns: 0 on success, -1 on a read or write error */
+static int splice_all(int in_fd, int out_fd, int tee_fd) {
+  size_t const chunk = 1 << 20;
+  for (;;) {
+    ssize_t moved;
+    if (tee_fd >= 0) {
+      moved = tee(in_fd, tee_fd, chunk, 0);
+      if (moved == 0) return 0;
+      if (moved == -1) break;
+      // Consume exactly the bytes just duplicated into tee_fd
+      for (ssize_t left = moved; left > 0; left -= moved) {
+        moved = splice(in_fd, NULL, out_fd, NULL, left, SPLICE_F_MOVE);
+        if (moved <= 0) return -1;
+      }
+    } else {
+      moved = splice(in_fd, NULL, out_fd, NULL, chunk, SPLICE_F_MOVE);
+      if (moved == 0) return 0;
+      if (moved == -1) break;
+    }
+  }
+  if (errno != EINVAL) return -1;
+
+  char buf[65536];
+  for (;;) {
+    ssize_t got = read(in_fd, buf, sizeof buf);
+    if (got == 0) return 0;
+    if (got == -1) return -1;
+    for (ssize_t done = 0, put; done < got; done += put) {
+      if ((put = write(out_fd, buf + done, got - done)) == -1) return -1;
+    }
+    for (ssize_t done = 0, put; tee_fd >= 0 && done < got; done += put) {
+      if ((put = write(tee_fd, buf + done, got - done)) == -1) return -1;
+    }
+  }
+}
+
+/* Launch a pipeline stage made only of redirections, in which the shell itself moves the data:
+ * "< file | cmd" feeds file into the pipeline, "cmd | > file | cmd" copies the stream into file while
+ * passing it on, and a final "| > file" writes the stream to file. Here-strings and >> work the same way.
+ * Parameters: struct shell_state *sh, struct command const *cmd,
+ *             int stdin_fd, int stdout_fd (pipe ends, -1 at the ends of the pipeline),
+ *             int unused_fd (pipe end the child must close, or -1)
+ * Returns: pid of the helper child, or -1 with errno set if fork failed */
+static pid_t launch_data_stage(struct shell_state *sh, struct command const *cmd, int stdin_fd, int stdout_fd,
+                               int unused_fd) {
+  pid_t child_pid = fork();
+  if (child_pid != 0) return child_pid;
+  // A stage whose words all expanded to nothing does nothing
+  if (cmd->num_redirs == 0) _exit(0);
+
+  if (sigaction(SIGINT, &sh->SIGINT_init_disp_sa, NULL) != 0) _exit(1);
+  if (sigaction(SIGTSTP, &sh->SIGTSTP_init_disp_sa, NULL) != 0) _exit(1);
+  if (sigprocmask(SIG_SETMASK, &sh->orig_sigmask, NULL) != 0) _exit(1);
+  if (unused_fd >= 0) close(unused_fd);
+  // The stage's own redirections apply on top of its pipe ends; when it redirects stdout as well, the
+  // stream is still passed on down the pipeline through a copy of the pipe end kept out of their way
+  bool redirects_stdout = false;
+  for (size_t i = 0; i < cmd->num_redirs; ++i) redirects_stdout |= cmd->redirs[i].fd == STDOUT_FILENO;
+  int tee_fd = redirects_stdout && stdout_fd >= 0 ? fcntl(stdout_fd, F_DUPFD_CLOEXEC, 10) : -1;
+  if (stdin_fd >= 0 && dup2(stdin_fd, STDIN_FILENO) == -1) _exit(1);
+  if (stdout_fd >= 0 && dup2(stdout_fd, STDOUT_FILENO) == -1) _exit(1);
+  if (apply_redirections(cmd) != 0) _exit(1);
+  _exit(splice_all(STDIN_FILENO, STDOUT_FILENO, tee_fd) == 0 ? 0 : 1);
+}
+
+/* Check whether an environment entry sets a variable that one of a list of NAME=value prefixes sets too
+ * Parameters: char const *entry (NAME=value), char **assigns, size_t num_assigns
+ * Returns: true if some prefix names the same variable */
+static bool env_entry_overridden(char const *entry, char **assigns, size_t num_assigns) {
+  char const *equals = strchr(entry, '=');
+  size_t name_len = equals ? (size_t) (equals - entry) + 1 : strlen(entry);
+  for (size_t a = 0; a < num_assigns; ++a) {
+    if (strncmp(assigns[a], entry, name_len) == 0) return true;
+  }
+  return false;
+}
+
+/* Build the environment of a command with NAME=value prefixes: the exported variables the prefixes do not
+ * override, followed by the prefixes themselves. Each name appears once; the last prefix for a name wins.
+ * Parameters: char **envp (the shell's exported variables), char **assigns, size_t num_assigns
+ * Returns: malloc'd NULL terminated array borrowing its strings, or NULL if allocation failed */
+static char **env_with_assigns(char **envp, char **assigns, size_t num_assigns) {
+  size_t count = 0;
+  while (envp[count]) count++;
+  char **env = malloc(sizeof *env * (count + num_assigns + 1));
+  if (!env) return NULL;
+  size_t n = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (!env_entry_overridden(envp[i], assigns, num_assigns)) env[n++] = envp[i];
+  }
+  for (size_t a = 0; a < num_assigns; ++a) {
+    // A=1 A=2 cmd passes only A=2
+    if (!env_entry_overridden(assigns[a], assigns + a + 1, num_assigns - a - 1)) env[n++] = assigns[a];
+  }
+  env[n] = NULL;
+  return env;
+}
+
+/* Launch one stage with the configured engine, resolving the command through the PATH cache
+ * Parameters: same as spawn_command, plus int unused_fd (pipe end a forked helper must close, or -1)
+ * Returns: pid of the new child, or -1 after printing a message if it could not be launched */
+static pid_t launch_command(struct shell_state *sh, struct command const *cmd, int stdin_fd, int stdout_fd,
+                            int unused_fd) {
+  pid_t child_pid;
+  if (cmd->argc == 0) {
+    child_pid = launch_data_stage(sh, cmd, stdin_fd, stdout_fd, unused_fd);
+  } else {
+    // The PATH cache supplies the absolute path of every command named without a slash
+    char const *exec_path = path_cache_lookup(&sh->path_cache, &sh->vars, cmd->argv[0]);
+    // execvp and posix_spawnp would search the PATH the shell was started with, not the shell variable
+    if (!exec_path && !strchr(cmd->argv[0], '/')) {
+      fprintf(stderr, "An error occurred while trying to run command %s: %s\n", cmd->argv[0], strerror(ENOENT));
+      errno = 0;
+      return -1;
+    }
+    // The exported variables' envp is only rebuilt after one of them has changed
+    char **envp = var_envp(&sh->vars);
+    char **cmd_envp = envp && cmd->num_assigns ? env_with_assigns(envp, cmd->assigns, cmd->num_assigns) : envp;
+    if (!cmd_envp) {
+      fprintf(stderr, "An error occurred while building the environment of command %s\n", cmd->argv[0]);
+      return -1;
+    }
+    struct timespec launched_at, exec_at;
+    int exec_fd = -1;
+    clock_gettime(CLOCK_MONOTONIC, &launched_at);
+    // posix_spawn has no attributes for affinity, niceness or limits, so prefixed commands always fork, as
+    // do commands redirected to a FIFO or device, whose open must not block the shell
+    bool use_spawn = sh->launch_mode == LAUNCH_SPAWN && !cmd->attrs && !redirects_to_special_file(cmd);
+    trace_event(&sh->trace, use_spawn ? TRACE_SPAWN : TRACE_FORK, 0, cmd->argv[0], 0);
+    if (use_spawn) {
+      // Files are opened here rather than as spawn file actions, so a missing one is named in the message
+      if (open_file_redirections(cmd) != 0) {
+        close_file_redirections(cmd);
+        if (cmd_envp != envp) free(cmd_envp);
+        return -1;
+      }
+      child_pid = spawn_command(sh, cmd, exec_path, cmd_envp, stdin_fd, stdout_fd);
+      int spawn_errno = errno;
+      close_file_redirections(cmd);
+      if (child_pid == -1) {
+        fprintf(stderr, "An error occurred while trying to run command %s: %s\n", cmd->argv[0], strerror(spawn_errno));
+        if (cmd_envp != envp) free(cmd_envp);
+        return -1;
+      }
+    } else {
+      child_pid = fork_command(sh, cmd, exec_path, cmd_envp, stdin_fd, stdout_fd, &exec_fd);
+    }
+    if (cmd_envp != envp) free(cmd_envp);
+    // posix_spawn returns once the child has exec'd; a forked child's exec is recorded when its pipe closes
+    clock_gettime(CLOCK_MONOTONIC, &exec_at);
+    if (child_pid > 0) {
+      struct live_child *record = stats_child_launched(&sh->stats, child_pid, cmd->argv[0], &launched_at, &exec_at);
+      if (exec_fd != -1 && (!record || exec_watch_start(sh, record, exec_fd) != 0)) {
+        close(exec_fd);
+        exec_fd = -1;
+      }
+      if (exec_fd == -1) trace_event(&sh->trace, TRACE_EXEC, child_pid, cmd->argv[0], 0);
+    }
+    if (child_pid != -1) return child_pid;
+  }
+  if (child_pid == -1) fprintf(stderr, "An error occurred when calling fork()\n");
+  return child_pid;
+}
+
+/* Create a close-on-exec pipe for a pipeline, applying the configured pipe size
+ * Parameters: struct shell_state *sh, int fds[2]
+ * Returns: 0 on success, -1 on failure */
+static int make_pipe(struct shell_state *sh, int fds[2]) {
+  if (pipe2(fds, O_CLOEXEC) == -1) return -1;
+  if (sh->pipe_size > 0) fcntl(fds[1], F_SETPIPE_SZ, sh->pipe_size); /* Best effort: may exceed pipe-max-size */
+  return 0;
+}
+
+/* Size of the log ring for a background job about to start
+ * Parameters: struct var_store const *vars
+ * Returns: SMALLSH_JOBLOG in bytes, at most JOB_LOG_MAX, or 0 when job logs are off */
+static size_t job_log_size(struct var_store const *vars) {
+  char const *value = var_get(vars, "SMALLSH_JOBLOG");
+  if (!value || !isdigit((unsigned char) value[0])) return 0;
+  char *end;
+  errno = 0;
+  unsigned long long size = strtoull(value, &end, 10);
+  if (*end != '\0') return 0;
+  if (errno == ERANGE || size > JOB_LOG_MAX) size = JOB_LOG_MAX;
+  errno = 0;
+  return size;
+}
+
+/* Create the pipe a background job writes its log into: the write end for the job's stdout and stderr, and a
+ * nonblocking read end for the shell, moved to 10 or above
+ * Parameters: struct shell_state *sh, int fds[2]
+ * Returns: 0 on success, -1 on failure */
+static int job_log_pipe(struct shell_state *sh, int fds[2]) {
+  if (make_pipe(sh, fds) == -1) return -1;
+  if ((fds[0] = move_fd_high(fds[0])) == -1 || fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1) {
+    int saved_errno = errno;
+    if (fds[0] != -1) close(fds[0]);
+    close(fds[1]);
+    fds[0] = fds[1] = -1;
+    errno = saved_errno;
+    return -1;
+  }
+  return 0;
+}
+
+/* Start the log of a background job and watch its pipe in the event loop
+ * Parameters: struct shell_state *sh, pid_t pid ($! of the job), int fd (read end from job_log_pipe),
+ *             char *ring (size bytes from malloc), size_t size (ring size in bytes). The log owns fd and ring
+ *             once it has started; on failure they stay the caller's.
+ * Returns: 0 on success, -1 on failure */
+static int job_log_start(struct shell_state *sh, pid_t pid, int fd, char *ring, size_t size) {
+  struct job_logs *logs = &sh->job_logs;
+  struct job_log *log = malloc(sizeof *log);
+  if (!log) goto fail;
+  if (logs->count == logs->cap) {
+    size_t new_cap = logs->cap ? logs->cap * 2 : 16;
+    struct job_log **grown = realloc(logs->logs, sizeof *grown * new_cap);
+    if (!grown) goto fail;
+    logs->logs = grown;
+    logs->cap = new_cap;
+  }
+  if ((size_t) fd >= logs->by_fd_cap) {
+    size_t new_cap = logs->by_fd_cap ? logs->by_fd_cap * 2 : 64;
+    while (new_cap <= (size_t) fd) new_cap *= 2;
+    struct job_log **grown = realloc(logs->by_fd, sizeof *grown * new_cap);
+    if (!grown) goto fail;
+    memset(grown + logs->by_fd_cap, 0, sizeof *grown * (new_cap - logs->by_fd_cap));
+    logs->by_fd = grown;
+    logs->by_fd_cap = new_cap;
+  }
+  struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+  if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) goto fail;
+  *log = (struct job_log) { .pid = pid, .fd = fd, .ring = ring, .size = size };
+  logs->logs[logs->count++] = log;
+  logs->by_fd[fd] = log;
+  return 0;
+
+fail:
+  free(log);
+  return -1;
+}
+
+/* Write a finished log to SMALLSH_JOBLOG_DIR/PID.log when that is set, freeing its ring. A log that cannot be
+ * written stays in memory.
+ * Parameters: struct shell_state *sh, struct job_log *log
+ * Returns: 0 on success, when spilling is off or after reporting a failure, -1 on a fatal error */
+static int job_log_spill(struct shell_state *sh, struct job_log *log) {
+  char const *dir = var_get(&sh->vars, "SMALLSH_JOBLOG_DIR");
+  if (!dir || !*dir) return 0;
+  size_t path_size = strlen(dir) + 32;
+  char *path = malloc(path_size);
+  if (!path) return -1;
+  snprintf(path, path_size, "%s/%jd.log", dir, (intmax_t) log->pid);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd == -1 || job_log_write(log, fd) != 0 || close(fd) != 0) {
+    int print_result = fprintf(stderr, "smallsh: cannot write job log %s: %s\n", path, strerror(errno));
+    free(path);
+    errno = 0;
+    return print_result < 0 ? -1 : 0;
+  }
+  free(log->ring);
+  log->ring = NULL;
+  log->spill_path = path;
+  return 0;
+}
+
+/* Stop watching a log's pipe once the job has closed it, spill the log, and drop the oldest finished logs
+ * beyond JOB_LOG_KEEP
+ * Parameters: struct shell_state *sh, struct job_log *log (may be freed)
+ * Returns: 0 on success, -1 on failure */
+static int job_log_close(struct shell_state *sh, struct job_log *log) {
+  struct job_logs *logs = &sh->job_logs;
+  epoll_ctl(sh->epoll_fd, EPOLL_CTL_DEL, log->fd, NULL);
+  close(log->fd);
+  logs->by_fd[log->fd] = NULL;
+  log->fd = -1;
+  logs->num_closed++;
+  int result = job_log_spill(sh, log);
+
+  size_t kept = 0;
+  for (size_t i = 0; i < logs->count; ++i) {
+    struct job_log *entry = logs->logs[i];
+    if (entry->fd == -1 && logs->num_closed > JOB_LOG_KEEP) {
+      job_log_free(entry);
+      logs->num_closed--;
+    } else {
+      logs->logs[kept++] = entry;
+    }
+  }
+  logs->count = kept;
+  return result;
+}
+
+/* Read everything a job has written so far into its log, closing the log at end of file
+ * Parameters: struct shell_state *sh, struct job_log *log (must have an open pipe; freed if it closes)
+ * Returns: 0 on success, -1 on failure */
+static int job_log_drain(struct shell_state *sh, struct job_log *log) {
+  for (;;) {
+    // Reads go straight into the ring, wrapping at its end
+    size_t pos = log->written % log->size;
+    ssize_t got = read(log->fd, log->ring + pos, log->size - pos);
+    if (got > 0) {
+      log->written += got;
+      continue;
+    }
+    if (got == -1 && errno == EINTR) continue;
+    if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      errno = 0;
+      return 0;
+    }
+    return job_log_close(sh, log); /* A read error ends the log just like end of file */
+  }
+}
+
+/* Drain the log pipes that have output waiting, without blocking
+ * Parameters: struct shell_state *sh
+ * Returns: 0 on success, -1 on failure */
+static int job_logs_poll(struct shell_state *sh) {
+  if (sh->job_logs.count == sh->job_logs.num_closed) return 0;
+  struct epoll_event events[32];
+  int num_ready = epoll_wait(sh->epoll_fd, events, 32, 0);
+  if (num_ready == -1) {
+    if (errno != EINTR) return -1;
+    errno = 0;
+  }
+  for (int i = 0; i < num_ready; ++i) {
+    struct job_log *log = job_log_for_fd(&sh->job_logs, events[i].data.fd);
+    if (log && job_log_drain(sh, log) != 0) return -1;
+  }
+  return 0;
+}
+
+/* Block SIGCHLD and route it through a signalfd watched by an epoll instance, so children are reaped as soon
+ * as they change state instead of by polling waitpid before each prompt
+ * Parameters: struct shell_state *sh
+ * Returns: 0 on success, -1 on failure */
+static int events_init(struct shell_state *sh) {
+  sigset_t sigchld_set;
+  sigemptyset(&sigchld_set);
+  sigaddset(&sigchld_set, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &sigchld_set, &sh->orig_sigmask) != 0) return -1;
+  if ((sh->sigchld_fd = move_fd_high(signalfd(-1, &sigchld_set, SFD_NONBLOCK | SFD_CLOEXEC))) == -1) return -1;
+  if ((sh->epoll_fd = move_fd_high(epoll_create1(EPOLL_CLOEXEC))) == -1) return -1;
+  struct epoll_event ev = { .events = EPOLLIN, .data.fd = sh->sigchld_fd };
+  return epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, sh->sigchld_fd, &ev);
+}
+
+/* Reap every child that has changed state since the last call
+ * Foreground stages have their status stored for run_pipeline. Background children are queued for reporting
+ * before the next prompt, and stopped ones are sent SIGCONT straight away. Each call costs one read of the
+ * signalfd plus one wait4 per reaped child, however many children are running.
+ * Parameters: struct shell_state *sh
+ * Returns: 0 on success, -1 on failure */
+static int reap_children(struct shell_state *sh) {
+  struct signalfd_siginfo info[16];
+  while (read(sh->sigchld_fd, info, sizeof info) > 0); /* SIGCHLD coalesces, so the contents do not matter */
+
+  pid_t child_proc_pid;
+  int child_proc_status;
+  struct rusage usage;
+  // Checking for child process status based on CS344 modules and Linux Programming Interface text
+  // wait4 is waitpid that also returns the resource usage of a child that has terminated
+  while ((child_proc_pid = wait4(-1, &child_proc_status, WUNTRACED | WNOHANG, &usage)) > 0) {
+    struct timespec reaped_at;
+    clock_gettime(CLOCK_MONOTONIC, &reaped_at);
+    struct job *job = job_find_pid(&sh->jobs, child_proc_pid);
+    if (job) job_update(&sh->jobs, job, child_proc_pid, child_proc_status, &reaped_at);
+    bool terminated = !WIFSTOPPED(child_proc_status);
+    // A child whose exec pipe has not been read yet exec'd or exited by now, which is the best time known
+    struct live_child *record = sh->stats.children_cap ? stats_child_entry(&sh->stats, child_proc_pid) : NULL;
+    if (terminated && record && record->pid != 0 && record->exec_fd != -1) exec_watch_end(sh, record, &reaped_at);
+    if (terminated) stats_child_reaped(&sh->stats, child_proc_pid, &usage, &reaped_at);
+    if (terminated) trace_event(&sh->trace, TRACE_REAP, child_proc_pid, NULL, status_to_exit_code(child_proc_status));
+    else trace_event(&sh->trace, TRACE_STOP, child_proc_pid, NULL, WSTOPSIG(child_proc_status));
+
+    bool is_fg = false;
+    for (size_t i = 0; i < sh->fg_count; ++i) {
+      if (sh->fg_pids[i] != child_proc_pid) continue;
+      sh->fg_statuses[i] = child_proc_status;
+      sh->fg_pids[i] = 0;
+      sh->fg_remaining--;
+      if (terminated) {
+        sh->fg_user_us += timeval_us(&usage.ru_utime);
+        sh->fg_sys_us += timeval_us(&usage.ru_stime);
+      }
+      is_fg = true;
+      break;
+    }
+    if (is_fg) continue;
+
+    if (WIFSTOPPED(child_proc_status)) {
+      trace_event(&sh->trace, TRACE_SIGCONT, child_proc_pid, NULL, 0);
+      if (kill(child_proc_pid, SIGCONT) == -1) err(errno, "Unable to send SIGCONT signal");
+      if (job) job->state = JOB_RUNNING;
+    }
+    if (job && job->quiet) continue;
+    if (sh->num_events == sh->events_cap) {
+      size_t new_cap = sh->events_cap ? sh->events_cap * 2 : 16;
+      struct child_event *grown = realloc(sh->events, sizeof *grown * new_cap);
+      if (!grown) return -1;
+      sh->events = grown;
+      sh->events_cap = new_cap;
+    }
+    struct child_event *event = &sh->events[sh->num_events++];
+    event->pid = child_proc_pid;
+    event->status = child_proc_status;
+    event->reaped_at = reaped_at;
+    event->job_slot = job ? (size_t) (job - sh->jobs.slots) : SIZE_MAX;
+    event->job_pid = job ? job->pid : 0;
+  }
+
+  // Checking errno taken from Linux Programming Interface wait example, chap. 26
+  // ECHILD indicates there were no unwaited for processes
+  if (child_proc_pid == -1 && errno != ECHILD) return -1;
+  errno = 0;
+  return 0;
+}
+
+/* Print and clear the queued background child state changes, pruning the jobs they finish
+ * Parameters: struct shell_state *sh
+ * Returns: 0 on success, -1 if printing failed */
+static int report_child_events(struct shell_state *sh) {
+  for (size_t i = 0; i < sh->num_events; ++i) {
+    pid_t child_proc_pid = sh->events[i].pid;
+    int child_proc_status = sh->events[i].status;
+    // Once its notice is out, a finished job would only grow the table; wait can still get its status
+    size_t slot = sh->events[i].job_slot;
+    if (slot != SIZE_MAX && sh->jobs.slots[slot].pid == sh->events[i].job_pid &&
+        sh->jobs.slots[slot].state == JOB_DONE) {
+      job_prune(&sh->jobs, &sh->jobs.slots[slot]);
+    }
+    if (WIFEXITED(child_proc_status)) {
+      if (fprintf(stderr, "Child process %jd done. Exit status %d.\n", (intmax_t) child_proc_pid, WEXITSTATUS(child_proc_status)) < 0) return -1;
+    } else if (WIFSIGNALED(child_proc_status)) {
+      if (fprintf(stderr, "Child process %jd done. Signaled %d.\n", (intmax_t) child_proc_pid, WTERMSIG(child_proc_status)) < 0) return -1;
+    } else if (WIFSTOPPED(child_proc_status)) {
+      if (fprintf(stderr, "Child process %jd stopped. Continuing.\n", (intmax_t) child_proc_pid) < 0) return -1;
+    }
+  }
+  sh->num_events = 0;
+  return 0;
+}
+
+/* Wait for events, reaping children whenever SIGCHLD arrives
+ * With an input fd, returns once that fd is readable; without one, returns after handling one batch of events.
+ * Parameters: struct shell_state *sh, int input_fd (-1 to wait only for children)
+ * Returns: 0 on success, -1 on failure or when interrupted by a signal (errno EINTR) */
+static int wait_for_events(struct shell_state *sh, int input_fd) {
+  if (input_fd >= 0) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = input_fd };
+    if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, input_fd, &ev) == -1) {
+      if (errno != EPERM) return -1;
+      errno = 0;
+      return 0; /* Regular files cannot be polled and are always readable */
+    }
+  }
+
+  int result = 0;
+  for (bool input_ready = false; !input_ready;) {
+    struct epoll_event events[8];
+    int num_ready = epoll_wait(sh->epoll_fd, events, 8, -1);
+    if (num_ready == -1) {
+      result = -1;
+      break;
+    }
+    bool reap = false;
+    for (int i = 0; i < num_ready; ++i) {
+      if (events[i].data.fd == sh->sigchld_fd) {
+        reap = true;
+      } else if (events[i].data.fd == input_fd) {
+        input_ready = true;
+      } else if (!exec_watch_ready(sh, events[i].data.fd)) {
+        struct job_log *log = job_log_for_fd(&sh->job_logs, events[i].data.fd);
+        if (log && job_log_drain(sh, log) != 0) result = -1;
+      }
+    }
+    // Reaping comes after the exec pipes of the same batch, so a child that exits straight after its exec
+    // still has the exec timed by its pipe
+    if (reap && reap_children(sh) != 0) result = -1;
+    if (result != 0 || input_fd < 0) break;
+  }
+
+  if (input_fd >= 0) {
+    int saved_errno = errno;
+    epoll_ctl(sh->epoll_fd, EPOLL_CTL_DEL, input_fd, NULL);
+    errno = saved_errno;
+  }
+  return result;
+}
+
+/* line_reader wait hook: reap children while waiting for the next line of interactive input
+ * Parameters: void *arg (struct shell_state *), int fd (input fd)
+ * Returns: 0 when fd is readable, -1 on failure or signal */
+static int wait_for_input(void *arg, int fd) {
+  return wait_for_events(arg, fd);
+}
+
+/* Launch every stage of a pipeline connected by pipes
+ * Parameters: struct shell_state *sh, struct command const *stages, size_t num_stages,
+ *             int stdout_fd (stdout for the final stage, -1 to inherit the shell's), pid_t *stage_pids (filled in)
+ * Returns: number of stages launched; fewer than num_stages means a launch failed and a message was printed */
+static size_t launch_pipeline(struct shell_state *sh, struct command const *stages, size_t num_stages, int stdout_fd,
+                              pid_t *stage_pids) {
+  int prev_read = -1;
+  size_t launched = 0;
+
+  for (size_t i = 0; i < num_stages; ++i) {
+    int fds[2] = { -1, -1 };
+    if (i + 1 < num_stages && make_pipe(sh, fds) == -1) {
+      fprintf(stderr, "An error occurred while creating a pipe\n");
+      break;
+    }
+    if (open_inline_inputs(&stages[i]) != 0) {
+      stage_pids[i] = -1;
+    } else {
+      stage_pids[i] = launch_command(sh, &stages[i], prev_read, i + 1 < num_stages ? fds[1] : stdout_fd, fds[0]);
+    }
+    close_inline_inputs(&stages[i]);
+    if (prev_read >= 0) close(prev_read);
+    if (fds[1] >= 0) close(fds[1]);
+    prev_read = fds[0];
+    if (stage_pids[i] == -1) break;
+    launched++;
+  }
+  if (prev_read >= 0) close(prev_read);
+  errno = 0;
+  return launched;
+}
+
+/* Output of a $(...) command substitution, read into a buffer that doubles in size as it fills */
+struct capture {
+  char *buf;
+  size_t len;
+  size_t cap;
+};
+
+/* Read everything from a file descriptor into a capture buffer
+ * Parameters: struct capture *capture, int fd
+ * Returns: 0 at end of input, -1 on a read or allocation failure */
+static int capture_read(struct capture *capture, int fd) {
+  for (;;) {
+    if (capture->cap - capture->len < 4096) {
+      size_t new_cap = capture->cap ? capture->cap * 2 : 4096;
+      char *grown = realloc(capture->buf, new_cap);
+      if (!grown) return -1;
+      capture->buf = grown;
+      capture->cap = new_cap;
+    }
+    ssize_t got = read(fd, capture->buf + capture->len, capture->cap - capture->len);
+    if (got == 0) return 0;
+    if (got == -1 && errno == EINTR) continue;
+    if (got == -1) return -1;
+    capture->len += got;
+  }
+}
+
+/* Launch every stage of a pipeline connected by pipes, and wait for all of them unless it runs in the background
+ * Parameters: struct shell_state *sh, struct arena *arena (holds the stages' pids and statuses),
+ *             struct command const *stages, size_t num_stages, bool is_bg_proc,
+ *             char const *command (text recorded in the job table for a background pipeline),
+ *             int *last_fg_exit_status (set from the final stage when waited for),
+ *             pid_t *last_bg_proc_pid (set to the final stage's pid for a background pipeline or a stopped stage),
+ *             struct capture *capture (when not NULL, the final stage's stdout is read into it through a pipe
+ *             before the pipeline is waited for)
+ * Returns: 0 on success, -1 if waiting or reading the output failed */
+static int run_pipeline(struct shell_state *sh, struct arena *arena, struct command const *stages, size_t num_stages,
+                        bool is_bg_proc, char const *command, int *last_fg_exit_status, pid_t *last_bg_proc_pid,
+                        struct capture *capture) {
+  // Launched pids, then the copy the reaper clears as stages finish, then their wait statuses
+  pid_t *stage_pids = arena_alloc(arena, sizeof *stage_pids * num_stages * 2);
+  int *stage_statuses = arena_alloc(arena, sizeof *stage_statuses * num_stages);
+  if (!stage_pids || !stage_statuses) return -1;
+  pid_t *waiting_pids = stage_pids + num_stages;
+  int capture_fds[2] = { -1, -1 };
+  if (capture && make_pipe(sh, capture_fds) == -1) return -1;
+  // With SMALLSH_JOBLOG set, a background pipeline writes its stdout and stderr to a log instead
+  size_t log_size = is_bg_proc && !capture ? job_log_size(&sh->vars) : 0;
+  int log_fds[2] = { -1, -1 };
+  char *log_ring = NULL;
+  if (log_size > 0) {
+    // The ring is allocated before launching, so a job that cannot have a log still runs, writing to the terminal
+    log_ring = malloc(log_size);
+    if (!log_ring || job_log_pipe(sh, log_fds) == -1) {
+      if (fprintf(stderr, "joblog: %zu bytes: %s\n", log_size, strerror(errno)) < 0) return -1;
+      free(log_ring);
+      log_ring = NULL;
+      log_size = 0;
+      errno = 0;
+    }
+  }
+  int saved_stderr = -1;
+  if (log_size > 0) {
+    // Every stage inherits the shell's stderr, so it points at the log while they are launched
+    saved_stderr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+    if (dup2(log_fds[1], STDERR_FILENO) == -1) goto log_fail;
+  }
+  size_t launched = launch_pipeline(sh, stages, num_stages, capture ? capture_fds[1] : log_fds[1], stage_pids);
+  if (log_size > 0) {
+    if (saved_stderr == -1) {
+      close(STDERR_FILENO);
+    } else {
+      dup2(saved_stderr, STDERR_FILENO);
+      close(saved_stderr);
+      saved_stderr = -1;
+    }
+    close(log_fds[1]);
+    log_fds[1] = -1;
+  }
+  if (launched < num_stages) *last_fg_exit_status = 1;
+  if (capture) {
+    // Reading to EOF before waiting keeps a stage from blocking on a full pipe
+    close(capture_fds[1]);
+    int read_result = capture_read(capture, capture_fds[0]);
+    close(capture_fds[0]);
+    if (read_result != 0) return -1;
+  }
+  if (is_bg_proc) { /* Do not wait for background process */
+    if (launched == 0) {
+      // The launch failure was reported into the log, which has no job to belong to
+      if (log_fds[0] != -1) {
+        splice_all(log_fds[0], STDERR_FILENO, -1);
+        close(log_fds[0]);
+      }
+      free(log_ring);
+      return 0;
+    }
+    *last_bg_proc_pid = stage_pids[launched - 1];
+    if (!job_add(&sh->jobs, stage_pids, launched, command)) goto log_fail;
+    if (log_fds[0] != -1 && job_log_start(sh, *last_bg_proc_pid, log_fds[0], log_ring, log_size) != 0) goto log_fail;
+    return 0;
+  }
+
+  // Wait for every stage through the event loop, so background children are reaped meanwhile
+  memcpy(waiting_pids, stage_pids, sizeof *stage_pids * num_stages);
+  sh->fg_pids = waiting_pids;
+  sh->fg_statuses = stage_statuses;
+  sh->fg_count = sh->fg_remaining = launched;
+  int wait_result = reap_children(sh);
+  while (wait_result == 0 && sh->fg_remaining > 0) {
+    wait_result = wait_for_events(sh, -1);
+    if (wait_result == -1 && errno == EINTR) wait_result = 0;
+  }
+  sh->fg_count = sh->fg_remaining = 0;
+  if (wait_result != 0) return -1;
+
+  // The pipeline's status is that of its last stage
+  for (size_t i = 0; i < launched; ++i) {
+    int new_child_status = stage_statuses[i];
+    bool is_last = i + 1 == num_stages;
+
+    if (WIFSIGNALED(new_child_status)) {
+      if (is_last) *last_fg_exit_status = 128 + WTERMSIG(new_child_status);
+    } else if (WIFSTOPPED(new_child_status)) {
+      if (fprintf(stderr, "Child process %jd stopped. Continuing.\n", (intmax_t) stage_pids[i]) < 0) return -1;
+      trace_event(&sh->trace, TRACE_SIGCONT, stage_pids[i], stages[i].argv[0], 0);
+      if (kill(stage_pids[i], SIGCONT) == -1) {
+        fprintf(stderr, "Unable to send SICONT to child %jd\n", (intmax_t) stage_pids[i]);
+        return -1;
+      }
+      *last_bg_proc_pid = stage_pids[i];
+      // The stage carries on in the background, so it becomes a job of its own
+      char stage_text[256] = "";
+      for (size_t w = 0; w < stages[i].argc && strlen(stage_text) + strlen(stages[i].argv[w]) + 2 < sizeof stage_text; ++w) {
+        if (w > 0) strcat(stage_text, " ");
+        strcat(stage_text, stages[i].argv[w]);
+      }
+      if (!job_add(&sh->jobs, &stage_pids[i], 1, stage_text)) return -1;
+    } else if (WIFEXITED(new_child_status)) {
+      if (is_last) *last_fg_exit_status = WEXITSTATUS(new_child_status);
+    }
+  }
+  return 0;
+
+log_fail:
+  // Whatever the job log still holds when a background launch fails: stderr back on the terminal, the pipe
+  // and the ring
+  if (saved_stderr != -1) {
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
+  }
+  if (log_fds[1] != -1) close(log_fds[1]);
+  if (log_fds[0] != -1) close(log_fds[0]);
+  free(log_ring);
+  return -1;
+}
+
+/* Seconds elapsed between two CLOCK_MONOTONIC times
+ * Parameters: struct timespec const *start, struct timespec const *end
+ * Returns: end - start in seconds */
+static double elapsed_seconds(struct timespec const *start, struct timespec const *end) {
+  return (double) (end->tv_sec - start->tv_sec) + (double) (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Everything a built-in command may touch. Every builtin has the signature of builtin_fn, sets
+ * *last_fg_exit_status for $?, and returns -1 only for failures that should end the shell. */
+struct builtin_ctx {
+  struct shell_state *sh;
+  struct line_reader *reader;        /* The shell's input */
+  struct arena *line_arena;          /* Holds argv; released by exit before the shell terminates */
+  struct expand_ctx *expand;         /* Refreshed before each line is expanded */
+  bool interactive;
+  bool stdin_redirected;             /* stdin is a < file rather than the shell's input */
+  struct capture *capture;           /* Receives stdout while the command of a $(...) substitution runs */
+  bool substituted;                  /* The line being run has run a command substitution */
+  int *last_fg_exit_status;
+  pid_t *last_bg_proc_pid;
+};
+
+typedef int builtin_fn(struct builtin_ctx *ctx, char **argv, size_t argc);
+
+/* Built-in command jobs: list background jobs with their state and run time. Finished jobs are removed once listed.
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc (arguments are ignored)
+ * Returns: 0 on success, -1 if printing failed */
+static int builtin_jobs(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  (void) argv;
+  (void) argc;
+  struct shell_state *sh = ctx->sh;
+  *ctx->last_fg_exit_status = 0;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  // List in job number order: collect the jobs in use and sort them once
+  struct job **listed = malloc(sizeof *listed * (sh->jobs.count ? sh->jobs.count : 1));
+  if (!listed) return -1;
+  size_t num_listed = 0;
+  for (size_t i = 0; i < sh->jobs.num_slots; ++i) {
+    if (sh->jobs.slots[i].pid != 0) listed[num_listed++] = &sh->jobs.slots[i];
+  }
+  qsort(listed, num_listed, sizeof *listed, compare_job_numbers);
+  int result = 0;
+  for (size_t i = 0; i < num_listed && result == 0; ++i) {
+    struct job *job = listed[i];
+    char state[32];
+    if (job->state == JOB_RUNNING) {
+      snprintf(state, sizeof state, "Running");
+    } else if (job->state == JOB_STOPPED) {
+      snprintf(state, sizeof state, "Stopped");
+    } else if (WIFSIGNALED(job->status)) {
+      snprintf(state, sizeof state, "Signaled %d", WTERMSIG(job->status));
+    } else {
+      snprintf(state, sizeof state, "Done %d", WEXITSTATUS(job->status));
+    }
+    double run_time = elapsed_seconds(&job->started_at, job->state == JOB_DONE ? &job->finished_at : &now);
+    if (printf("[%d] %jd %-12s %8.3fs  %s\n", job->number, (intmax_t) job->pid, state, run_time, job->command) < 0) result = -1;
+    if (job->state == JOB_DONE) job_prune(&sh->jobs, job);
+  }
+  free(listed);
+  return result == 0 && fflush(stdout) == 0 ? 0 : -1;
+}
+
+/* Built-in command joblog: with no arguments, list the logs of background jobs (see SMALLSH_JOBLOG) with the
+ * bytes each job has written; with a job (pid or %n), print the output its log holds
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc
+ * Returns: 0 on success, -1 on failure */
+static int builtin_joblog(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  struct shell_state *sh = ctx->sh;
+  struct job_logs *logs = &sh->job_logs;
+  *ctx->last_fg_exit_status = 0;
+  if (argc > 2) {
+    *ctx->last_fg_exit_status = 1;
+    return fprintf(stderr, "Too many arguments passed to joblog command\n") < 0 ? -1 : 0;
+  }
+  if (argc == 1) {
+    for (size_t i = 0; i < logs->count; ++i) {
+      struct job_log const *log = logs->logs[i];
+      if (printf("%jd %12" PRIu64 " bytes  %-7s  %s\n", (intmax_t) log->pid, log->written,
+                 log->fd == -1 ? "done" : "running", log->spill_path ? log->spill_path : "") < 0) return -1;
+    }
+    return 0;
+  }
+
+  struct job_log *log = NULL;
+  if (argv[1][0] == '%') {
+    struct job *job = job_find_spec(&sh->jobs, argv[1]);
+    if (job) log = job_log_find(logs, job->pid);
+  } else {
+    char *end;
+    long pid = strtol(argv[1], &end, 10);
+    if (*end == '\0' && end != argv[1] && pid > 0) log = job_log_find(logs, (pid_t) pid);
+  }
+  if (!log) {
+    *ctx->last_fg_exit_status = 1;
+    return fprintf(stderr, "joblog: %s: no such log\n", argv[1]) < 0 ? -1 : 0;
+  }
+
+  // Pick up whatever a running job has written since the event loop last ran
+  pid_t pid = log->pid;
+  if (log->fd != -1 && job_log_drain(sh, log) != 0) return -1;
+  if (!(log = job_log_find(logs, pid))) return 0;
+  if (log->written > log->size) {
+    if (fprintf(stderr, "joblog: %s: showing the last %zu of %" PRIu64 " bytes\n", argv[1], log->size,
+                log->written) < 0) return -1;
+  }
+  if (fflush(stdout) != 0) return -1;
+  if (log->ring) return job_log_write(log, STDOUT_FILENO);
+  int fd = open(log->spill_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    *ctx->last_fg_exit_status = 1;
+    return fprintf(stderr, "joblog: %s: %s\n", log->spill_path, strerror(errno)) < 0 ? -1 : 0;
+  }
+  int result = splice_all(fd, STDOUT_FILENO, -1);
+  close(fd);
+  return result;
+}
+
+/* Block until a job has finished, reaping other children meanwhile
+ * Parameters: struct shell_state *sh, size_t slot (slot of the job; the slot array may move while waiting)
+ * Returns: 0 on success, -1 on failure */
+static int wait_for_job(struct shell_state *sh, size_t slot) {
+  while (sh->jobs.slots[slot].state != JOB_DONE) {
+    if (wait_for_events(sh, -1) == -1 && errno != EINTR) return -1;
+  }
+  errno = 0;
+  return 0;
+}
+
+/* Built-in command wait: block until the named jobs (pid or %n), or all jobs, have finished
+ * $? becomes the status of the last job named, 0 when waiting for all, or 127 for an unknown job.
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc
+ * Returns: 0 on success, -1 on failure */
+static int builtin_wait(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  struct shell_state *sh = ctx->sh;
+  int *last_fg_exit_status = ctx->last_fg_exit_status;
+  *last_fg_exit_status = 0;
+  if (argc == 1) {
+    for (size_t i = 0; i < sh->jobs.num_slots; ++i) {
+      if (sh->jobs.slots[i].pid == 0) continue;
+      if (wait_for_job(sh, i) != 0) return -1;
+      job_remove(&sh->jobs, &sh->jobs.slots[i]);
+    }
+    return 0;
+  }
+  for (size_t arg = 1; arg < argc; ++arg) {
+    struct job *job = job_find_spec(&sh->jobs, argv[arg]);
+    char *end;
+    long pid = strtol(argv[arg], &end, 10);
+    int finished_status;
+    if (!job && *end == '\0' && end != argv[arg] && pid > 0 &&
+        job_finished_status(&sh->jobs, (pid_t) pid, &finished_status)) {
+      *last_fg_exit_status = status_to_exit_code(finished_status);
+      continue;
+    }
+    if (!job) {
+      if (fprintf(stderr, "wait: %s: no such job\n", argv[arg]) < 0) return -1;
+      *last_fg_exit_status = 127;
+      continue;
+    }
+    size_t slot = job - sh->jobs.slots;
+    if (wait_for_job(sh, slot) != 0) return -1;
+    *last_fg_exit_status = status_to_exit_code(sh->jobs.slots[slot].status);
+    job_remove(&sh->jobs, &sh->jobs.slots[slot]);
+  }
+  return 0;
+}
+
+/* Built-in commands fg and bg: continue a job (the most recent one by default) if it is stopped, and for fg
+ * wait for it in the foreground
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc, bool foreground
+ * Returns: 0 on success, -1 on failure */
+static int builtin_fg_bg(struct builtin_ctx *ctx, char **argv, size_t argc, bool foreground) {
+  struct shell_state *sh = ctx->sh;
+  int *last_fg_exit_status = ctx->last_fg_exit_status;
+  char const *name = foreground ? "fg" : "bg";
+  struct job *job = NULL;
+  if (argc > 2) {
+    *last_fg_exit_status = 1;
+    return fprintf(stderr, "Too many arguments passed to %s command\n", name) < 0 ? -1 : 0;
+  } else if (argc == 2) {
+    job = job_find_spec(&sh->jobs, argv[1]);
+  } else {
+    for (size_t i = 0; i < sh->jobs.num_slots; ++i) {
+      struct job *candidate = &sh->jobs.slots[i];
+      if (candidate->pid != 0 && (!job || candidate->number > job->number)) job = candidate;
+    }
+  }
+  if (!job) {
+    *last_fg_exit_status = 1;
+    return fprintf(stderr, "%s: no such job\n", name) < 0 ? -1 : 0;
+  }
+
+  if (!foreground && job->state == JOB_DONE) {
+    *last_fg_exit_status = 1;
+    return fprintf(stderr, "bg: job has terminated\n") < 0 ? -1 : 0;
+  }
+  if (job->state == JOB_STOPPED) {
+    if (kill(job->pid, SIGCONT) == -1) {
+      *last_fg_exit_status = 1;
+      return fprintf(stderr, "Unable to send SIGCONT to child %jd\n", (intmax_t) job->pid) < 0 ? -1 : 0;
+    }
+    job->state = JOB_RUNNING;
+  }
+  *last_fg_exit_status = 0;
+  if (!foreground) return printf("[%d] %s &\n", job->number, job->command) < 0 ? -1 : 0;
+
+  if (printf("%s\n", job->command) < 0 || fflush(stdout) != 0) return -1;
+  size_t slot = job - sh->jobs.slots;
+  if (wait_for_job(sh, slot) != 0) return -1;
+  *last_fg_exit_status = status_to_exit_code(sh->jobs.slots[slot].status);
+  job_remove(&sh->jobs, &sh->jobs.slots[slot]);
+  return 0;
+}
+
+/* Built-in command fg, see builtin_fg_bg
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc
+ * Returns: 0 on success, -1 on failure */
+static int builtin_fg(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  return builtin_fg_bg(ctx, argv, argc, true);
+}
+
+/* Built-in command bg, see builtin_fg_bg
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc
+ * Returns: 0 on success, -1 on failure */
+static int builtin_bg(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  return builtin_fg_bg(ctx, argv, argc, false);
+}
+
+/* qsort comparison for doubles
+ * Parameters: void const *a, void const *b
+ * Returns: negative, zero or positive as *a is less than, equal to or greater than *b */
+static int compare_doubles(void const *a, void const *b) {
+  double x = *(double const *) a, y = *(double const *) b;
+  return (x > y) - (x < y);
+}
+
+/* Copy a finished job's captured output from its memfd to stdout
+ * Parameters: int fd (memfd holding the output)
+ * Returns: 0 on success, -1 on failure */
+static int flush_captured_output(int fd) {
+  off_t size = lseek(fd, 0, SEEK_END);
+  if (size == -1) return -1;
+  for (off_t offset = 0; offset < size;) {
+    if (sendfile(STDOUT_FILENO, fd, &offset, size - offset) > 0) continue;
+    // sendfile refuses some outputs, such as files opened with O_APPEND; copy the rest the slow way
+    if (errno != EINVAL || lseek(fd, offset, SEEK_SET) == -1) return -1;
+    return splice_all(fd, STDOUT_FILENO, -1);
+  }
+  return 0;
+}
+
+#define PARALLEL_MAX_JOBS_PER_CPU 64 /* Upper bound of parallel -j, per online CPU */
+
+/* Built-in command parallel: run command lines from a file or stdin with up to N running at once
+ * Usage: parallel [-j N] [-g] [file]. N defaults to the number of online CPUs. With -g each job's stdout is
+ * captured in a memfd and written out in one piece when the job finishes, so output from different jobs is
+ * never interleaved. Lines go through the same splitting, expansion and launch path as the shell's own input,
+ * and a new job starts as soon as the event loop reaps a finished one. A summary with throughput and latency
+ * percentiles is printed to stderr at the end.
+ * $? becomes the number of failed jobs, at most 101. The shell's own reader is shared when it is also stdin.
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc
+ * Returns: 0 on success, -1 on failure */
+static int builtin_parallel(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  struct shell_state *sh = ctx->sh;
+  struct line_reader *shell_reader = ctx->reader;
+  struct expand_ctx const *expand = ctx->expand;
+  int *last_fg_exit_status = ctx->last_fg_exit_status;
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_cpus < 1) num_cpus = 1;
+  long max_jobs = num_cpus;
+  bool group_output = false;
+  char const *input_path = NULL;
+  for (size_t i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-g") == 0) {
+      group_output = true;
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      // Far more jobs than CPUs only adds contention, and each one holds a slot and a process
+      char *arg = argv[++i], *end;
+      errno = 0;
+      max_jobs = strtol(arg, &end, 10);
+      if (errno != 0 || end == arg || *end || max_jobs < 1 || max_jobs > PARALLEL_MAX_JOBS_PER_CPU * num_cpus) {
+        *last_fg_exit_status = 1;
+        errno = 0;
+        return fprintf(stderr, "parallel: -j %s: expected 1 to %ld\n", arg, PARALLEL_MAX_JOBS_PER_CPU * num_cpus) < 0 ? -1 : 0;
+      }
+    } else if (argv[i][0] != '-' && !input_path) {
+      input_path = argv[i];
+    } else {
+      *last_fg_exit_status = 1;
+      return fprintf(stderr, "Usage: parallel [-j N] [-g] [file]\n") < 0 ? -1 : 0;
+    }
+  }
+
+  // Options are parsed before the first read, which may move the shell reader's buffer holding argv
+  struct line_reader own_reader = { .fd = -1 };
+  struct line_reader *reader = shell_reader;
+  if (input_path) {
+    int input_fd = open(input_path, O_RDONLY | O_CLOEXEC);
+    if (input_fd == -1) {
+      *last_fg_exit_status = 1;
+      return fprintf(stderr, "parallel: cannot open %s: %s\n", input_path, strerror(errno)) < 0 ? -1 : 0;
+    }
+    if (reader_open_fd(&own_reader, input_fd) != 0) return -1;
+    reader = &own_reader;
+  } else if (shell_reader->fd != STDIN_FILENO || ctx->stdin_redirected) {
+    if (reader_open_fd(&own_reader, STDIN_FILENO) != 0) return -1;
+    reader = &own_reader;
+  }
+
+  struct running_job {
+    size_t job_slot;
+    int output_fd;
+    bool busy;
+    bool launch_failed;
+  } *slots = calloc(max_jobs, sizeof *slots);
+  if (!slots) {
+    reader_close(&own_reader);
+    return -1;
+  }
+
+  struct arena line_arena = {0};
+  double *latencies = NULL;
+  size_t num_jobs = 0, num_finished = 0, latencies_cap = 0, num_failed = 0;
+  long running = 0;
+  bool input_done = false;
+  int result = 0;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (result == 0 && (!input_done || running > 0)) {
+    // Fill every free slot with the next command line
+    while (!input_done && running < max_jobs) {
+      char *line;
+      ssize_t line_length = reader_next_line(reader, &line);
+      if (line_length == -1) {
+        if (errno != 0 && errno != EINTR) result = -1;
+        input_done = true;
+        break;
+      }
+      arena_reset(&line_arena);
+      trace_event(&sh->trace, TRACE_LINE_READ, 0, NULL, line_length);
+      struct parsed_line parsed;
+      enum parse_result parse_result = parse_line(&line_arena, &sh->ifs, line, line_length, expand, &parsed);
+      trace_event(&sh->trace, TRACE_EXPAND, 0, NULL, 0);
+      if (parse_result == PARSE_EMPTY) continue;
+      if (parse_result == PARSE_ERROR) {
+        result = -1;
+        break;
+      }
+      num_jobs++;
+      if (parse_result >= PARSE_SYNTAX_ERROR) {
+        fprintf(stderr, "Syntax error: %s\n", syntax_error_message(parse_result));
+        num_failed++;
+        continue;
+      }
+      int prefix_result = 0;
+      for (size_t i = 0; i < parsed.num_stages && prefix_result == 0; ++i) {
+        prefix_result = strip_launch_prefixes(&line_arena, &parsed.stages[i]);
+      }
+      if (prefix_result == 0) prefix_result = spread_background_job(sh, &line_arena, parsed.stages, parsed.num_stages);
+      if (prefix_result == -1) {
+        result = -1;
+        break;
+      }
+      if (prefix_result == 1) {
+        num_failed++;
+        continue;
+      }
+
+      int output_fd = group_output ? memfd_create("smallsh-parallel", MFD_CLOEXEC) : -1;
+      pid_t *stage_pids = arena_alloc(&line_arena, sizeof *stage_pids * parsed.num_stages);
+      if (!stage_pids) {
+        if (output_fd >= 0) close(output_fd);
+        result = -1;
+        break;
+      }
+      size_t launched = launch_pipeline(sh, parsed.stages, parsed.num_stages, output_fd, stage_pids);
+      struct job *job = launched > 0 ? job_add(&sh->jobs, stage_pids, launched, "parallel") : NULL;
+      if (!job) {
+        if (output_fd >= 0) close(output_fd);
+        num_failed++;
+        if (launched > 0) result = -1;
+        continue;
+      }
+      job->quiet = true;
+      long free_slot = 0;
+      while (slots[free_slot].busy) free_slot++;
+      slots[free_slot] = (struct running_job) {
+        .job_slot = job - sh->jobs.slots, .output_fd = output_fd, .busy = true,
+        .launch_failed = launched < parsed.num_stages,
+      };
+      running++;
+    }
+
+    // Retire every finished job; the shell reader's wait hook may already have reaped some while reading
+    long retired = 0;
+    for (long i = 0; i < max_jobs; ++i) {
+      if (!slots[i].busy || sh->jobs.slots[slots[i].job_slot].state != JOB_DONE) continue;
+      struct job *job = &sh->jobs.slots[slots[i].job_slot];
+      if (num_finished == latencies_cap) {
+        latencies_cap = latencies_cap ? latencies_cap * 2 : 256;
+        double *grown = realloc(latencies, sizeof *grown * latencies_cap);
+        if (!grown) {
+          result = -1;
+          break;
+        }
+        latencies = grown;
+      }
+      latencies[num_finished++] = elapsed_seconds(&job->started_at, &job->finished_at);
+      if (slots[i].launch_failed || status_to_exit_code(job->status) != 0) num_failed++;
+      if (slots[i].output_fd >= 0) {
+        if (flush_captured_output(slots[i].output_fd) != 0) result = -1;
+        close(slots[i].output_fd);
+      }
+      job_remove(&sh->jobs, job);
+      slots[i].busy = false;
+      running--;
+      retired++;
+    }
+    if (result != 0 || running == 0 || retired > 0) continue;
+
+    // Sleep until children change state
+    if (wait_for_events(sh, -1) == -1 && errno != EINTR) result = -1;
+    errno = 0;
+  }
+
+  // A shared interactive reader only saw the end of this batch, not of the shell's input
+  if (reader == shell_reader && isatty(reader->fd)) reader->eof = false;
+  reader_close(&own_reader);
+  arena_free(&line_arena);
+  free(slots);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double total = elapsed_seconds(&start, &end);
+  if (result == 0 && num_jobs > 0) {
+    qsort(latencies, num_finished, sizeof *latencies, compare_doubles);
+    double const percentiles[] = { 0.50, 0.90, 0.99, 1.0 };
+    double ms[4] = {0};
+    for (size_t i = 0; i < 4 && num_finished > 0; ++i) {
+      size_t rank = (size_t) (percentiles[i] * num_finished + 0.999999);
+      ms[i] = latencies[(rank ? rank : 1) - 1] * 1e3;
+    }
+    fprintf(stderr, "parallel: %zu jobs (%zu failed) in %.3fs, %.1f jobs/s, latency p50 %.2fms p90 %.2fms p99 %.2fms max %.2fms\n",
+            num_jobs, num_failed, total, total > 0 ? num_jobs / total : 0.0, ms[0], ms[1], ms[2], ms[3]);
+  }
+  free(latencies);
+  *last_fg_exit_status = num_failed > 101 ? 101 : (int) num_failed;
+  return result;
+}
+
+/* Print the statistics with their histograms to stderr if SMALLSH_STATS asked for them at exit
+ * Parameters: struct shell_state const *sh
+ * Returns: nothing; the shell is exiting, so a failed write is not reported */
+static void dump_stats_at_exit(struct shell_state const *sh) {
+  if (sh->dump_stats) stats_print(&sh->stats, stderr, true);
+}
+
+/* Print the times collected for a line run with the time prefix, in the format of time -p
+ * The CPU times are those of the line's foreground children plus the shell's own, which covers builtins.
+ * Parameters: struct shell_state const *sh, struct timespec const *start, struct rusage const *self_start
+ * Returns: 0 on success, -1 if printing failed */
+static int report_time(struct shell_state const *sh, struct timespec const *start, struct rusage const *self_start) {
+  struct timespec end;
+  struct rusage self_end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (getrusage(RUSAGE_SELF, &self_end) != 0) return -1;
+  uint64_t user_us = sh->fg_user_us + timeval_us(&self_end.ru_utime) - timeval_us(&self_start->ru_utime);
+  uint64_t sys_us = sh->fg_sys_us + timeval_us(&self_end.ru_stime) - timeval_us(&self_start->ru_stime);
+  return fprintf(stderr, "real %.3f\nuser %.3f\nsys %.3f\n", elapsed_seconds(start, &end), user_us / 1e6,
+                 sys_us / 1e6) < 0 ? -1 : 0;
+}
+
+/* Built-in command exit: signal all children and terminate the shell with the given status, or $? by default
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc
+ * Returns: only on a usage error (0) or failure (-1) */
+static int builtin_exit(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  if (argc > 2) {
+    *ctx->last_fg_exit_status = 1; /* exit code 1 is for general errors */
+    return fprintf(stderr, "Too many arguments passed to exit command\n") < 0 ? -1 : 0;
+  }
+
+  int shell_exit_status = *ctx->last_fg_exit_status;
+  if (argc == 2) {
+    for (char const *c = argv[1]; *c; ++c) {
+      if (isdigit((unsigned char) *c) == 0) {
+        *ctx->last_fg_exit_status = 128; /* exit code 128 for invalid argument to exit */
+        return fprintf(stderr, "Exit status arg (%s) contains non-digits\n", argv[1]) < 0 ? -1 : 0;
+      }
+    }
+    shell_exit_status = atoi(argv[1]);
+    if (shell_exit_status < 0) {
+      errno = -1;
+      fprintf(stderr, "An error occurred in function atoi\n"); /* fprintf not error checked since the shell exits regardless */
+      return -1;
+    }
+  }
+  // There is no subshell for exit to end inside $(...), so there it only sets the status
+  if (ctx->capture) {
+    *ctx->last_fg_exit_status = shell_exit_status;
+    return 0;
+  }
+  if (handle_child_procs_exit() != 0) {
+    fprintf(stderr, "An error occurred while signaling child processes\n");
+    return -1;
+  }
+  *ctx->last_fg_exit_status = shell_exit_status;
+  reader_close(ctx->reader);
+  arena_free(ctx->line_arena);
+  if (ctx->interactive && fprintf(stderr, "\nexit\n") < 0) return -1;
+  dump_stats_at_exit(ctx->sh);
+  trace_close(&ctx->sh->trace);
+  exit(shell_exit_status);
+}
+
+/* Built-in command cd: change to the given directory, or HOME by default
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc
+ * Returns: 0 on success, -1 if printing failed */
+static int builtin_cd(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  *ctx->last_fg_exit_status = 1;
+  if (argc > 2) return fprintf(stderr, "Too many arguments passed to cd command\n") < 0 ? -1 : 0;
+
+  char const *cd_arg = argc == 2 ? argv[1] : var_get(&ctx->sh->vars, "HOME");
+  if (!cd_arg || chdir(cd_arg) != 0) {
+    errno = 0;
+    return fprintf(stderr, "An error occurred while trying to change directory\n") < 0 ? -1 : 0;
+  }
+  *ctx->last_fg_exit_status = 0;
+  return 0;
+}
+
+/* Built-in command hash: list the PATH cache, remember the named commands, or forget everything with -r
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc
+ * Returns: 0 on success, -1 if printing failed */
+static int builtin_hash(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  struct path_cache *cache = &ctx->sh->path_cache;
+  *ctx->last_fg_exit_status = 0;
+  if (argc == 2 && strcmp(argv[1], "-r") == 0) {
+    path_cache_reset(cache);
+  } else if (argc > 1) {
+    // Resolve and remember each named command
+    for (size_t j = 1; j < argc; ++j) {
+      if (!path_cache_lookup(cache, &ctx->sh->vars, argv[j]) && !strchr(argv[j], '/')) {
+        if (fprintf(stderr, "hash: %s: not found\n", argv[j]) < 0) return -1;
+        *ctx->last_fg_exit_status = 1;
+      }
+    }
+  } else {
+    if (printf("hits\tcommand\n") < 0) return -1;
+    for (size_t j = 0; j < cache->capacity; ++j) {
+      struct path_cache_entry *entry = &cache->slots[j];
+      if (entry->path && printf("%4zu\t%s\n", entry->hits, entry->path) < 0) return -1;
+    }
+    if (printf("cache: %zu hits, %zu misses\n", cache->hits, cache->misses) < 0) return -1;
+  }
+  return 0;
+}
+
+/* Built-in command history: list every entry, the last N, or with -s the entries containing some text,
+ * newest first
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc
+ * Returns: 0 on success, -1 if printing failed */
+static int builtin_history(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  struct history *h = &ctx->sh->history;
+  *ctx->last_fg_exit_status = 0;
+  bool search = argc >= 3 && strcmp(argv[1], "-s") == 0;
+  uintmax_t count = UINTMAX_MAX;
+  bool bad_usage = !search && argc > 2;
+  if (!search && argc == 2) {
+    char *end;
+    count = strtoumax(argv[1], &end, 10);
+    bad_usage = !isdigit((unsigned char) argv[1][0]) || *end;
+  }
+  if (bad_usage) {
+    *ctx->last_fg_exit_status = 1;
+    return fprintf(stderr, "Usage: history [N | -s text]\n") < 0 ? -1 : 0;
+  }
+  if (h->fd == -1) return 0;
+  if (history_refresh(h) != 0) {
+    *ctx->last_fg_exit_status = 1;
+    int printed = fprintf(stderr, "history: %s\n", strerror(errno));
+    errno = 0;
+    return printed < 0 ? -1 : 0;
+  }
+
+  size_t len;
+  if (!search) {
+    size_t first = count < h->num_entries ? h->num_entries - count : 0;
+    for (size_t i = first; i < h->num_entries; ++i) {
+      char const *entry = history_entry(h, i, &len);
+      if (printf("%5zu  %.*s\n", i + 1, (int) len, entry) < 0) return -1;
+    }
+    return 0;
+  }
+
+  // The search text is the remaining words joined by single spaces
+  size_t text_len = argc - 3;
+  for (size_t i = 2; i < argc; ++i) text_len += strlen(argv[i]);
+  char *text = arena_alloc(ctx->line_arena, text_len + 1);
+  if (!text) return -1;
+  for (size_t i = 2, at = 0; i < argc; ++i) at += sprintf(text + at, i > 2 ? " %s" : "%s", argv[i]);
+  size_t found = h->num_entries;
+  *ctx->last_fg_exit_status = 1;
+  while ((found = history_search(h, text, text_len, false, found)) != SIZE_MAX) {
+    char const *entry = history_entry(h, found, &len);
+    if (printf("%5zu  %.*s\n", found + 1, (int) len, entry) < 0) return -1;
+    *ctx->last_fg_exit_status = 0;
+  }
+  return 0;
+}
+
+/* Built-in commands true and false
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc (arguments are ignored)
+ * Returns: 0 */
+static int builtin_true(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  (void) argv;
+  (void) argc;
+  *ctx->last_fg_exit_status = 0;
+  return 0;
+}
+
+static int builtin_false(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  (void) argv;
+  (void) argc;
+  *ctx->last_fg_exit_status = 1;
+  return 0;
+}
+
+/* Built-in command echo: print the arguments separated by spaces, with a newline unless the first is -n
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc
+ * Returns: 0 on success, -1 if printing failed */
+static int builtin_echo(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  size_t first = argc > 1 && strcmp(argv[1], "-n") == 0 ? 2 : 1;
+  for (size_t i = first; i < argc; ++i) {
+    if (i > first && putchar(' ') == EOF) return -1;
+    if (fputs(argv[i], stdout) == EOF) return -1;
+  }
+  if (first == 1 && putchar('\n') == EOF) return -1;
+  *ctx->last_fg_exit_status = 0;
+  return 0;
+}
+
+/* Built-in command pwd: print the current working directory
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc (arguments are ignored)
+ * Returns: 0 on success, -1 if printing failed */
+static int builtin_pwd(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  (void) argv;
+  (void) argc;
+  char *cwd = getcwd(NULL, 0);
+  if (!cwd) {
+    *ctx->last_fg_exit_status = 1;
+    int printed = fprintf(stderr, "pwd: %s\n", strerror(errno));
+    errno = 0;
+    return printed < 0 ? -1 : 0;
+  }
+  int printed = printf("%s\n", cwd);
+  free(cwd);
+  *ctx->last_fg_exit_status = 0;
+  return printed < 0 ? -1 : 0;
+}
+
+/* Print the character of one backslash escape for printf
+ * Parameters: char const *p (just after the backslash)
+ * Returns: pointer just after the escape sequence */
+static char const *print_escape(char const *p) {
+  static char const escapes[] = "\\\\a\ab\bf\fn\nr\rt\tv\v";
+  if (*p >= '0' && *p <= '7') {
+    int value = 0;
+    for (int digits = 0; digits < 3 && *p >= '0' && *p <= '7'; ++digits) value = value * 8 + (*p++ - '0');
+    putchar(value);
+    return p;
+  }
+  for (char const *e = escapes; *p && *e; e += 2) {
+    if (*e == *p) {
+      putchar(e[1]);
+      return p + 1;
+    }
+  }
+  putchar('\\');
+  return p;
+}
+
+/* Convert a printf numeric argument; a leading quote yields the value of the following character
+ * Parameters: char const *arg (NULL when arguments ran out, which counts as 0), bool *ok (cleared on bad input)
+ * Returns: the value */
+static intmax_t printf_number(char const *arg, bool *ok) {
+  if (!arg || !*arg) return 0;
+  if (*arg == '\'' || *arg == '"') return (unsigned char) arg[1];
+  char *end;
+  errno = 0;
+  intmax_t value = strtoimax(arg, &end, 0);
+  if (*end != '\0' || errno != 0) {
+    fprintf(stderr, "printf: %s: invalid number\n", arg);
+    *ok = false;
+    errno = 0;
+  }
+  return value;
+}
+
+/* Built-in command printf: format the arguments like printf(1). Supports the %s %b %c %d %i %u %o %x %X
+ * conversions with flags, width and precision, and reuses the format while arguments remain.
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc
+ * Returns: 0 on success, -1 if printing failed */
+static int builtin_printf(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  *ctx->last_fg_exit_status = 1;
+  if (argc < 2) return fprintf(stderr, "Usage: printf format [arguments]\n") < 0 ? -1 : 0;
+
+  bool ok = true;
+  size_t next_arg = 2;
+  do {
+    size_t pass_start = next_arg;
+    for (char const *p = argv[1]; *p;) {
+      if (*p == '\\') {
+        p = print_escape(p + 1);
+        continue;
+      }
+      if (*p != '%' || p[1] == '%') {
+        putchar(*p);
+        p += *p == '%' ? 2 : 1;
+        continue;
+      }
+
+      // Copy the flags, width and precision into a format for the C library, then add the conversion
+      char spec[32];
+      size_t len = 0;
+      spec[len++] = *p++;
+      while (*p && strchr("-+ #0123456789.", *p) && len < sizeof spec - 3) spec[len++] = *p++;
+      char conversion = *p ? *p++ : '\0';
+      char const *arg = next_arg < argc ? argv[next_arg++] : NULL;
+      switch (conversion) {
+        case 's':
+        case 'c':
+          spec[len++] = conversion;
+          spec[len] = '\0';
+          if (conversion == 's') printf(spec, arg ? arg : "");
+          else printf(spec, arg && *arg ? *arg : '\0');
+          break;
+        case 'b':
+          for (char const *b = arg ? arg : ""; *b;) b = *b == '\\' ? print_escape(b + 1) : (putchar(*b), b + 1);
+          break;
+        case 'd':
+        case 'i':
+          spec[len++] = 'j';
+          spec[len++] = conversion;
+          spec[len] = '\0';
+          printf(spec, printf_number(arg, &ok));
+          break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+          spec[len++] = 'j';
+          spec[len++] = conversion;
+          spec[len] = '\0';
+          printf(spec, (uintmax_t) printf_number(arg, &ok));
+          break;
+        default:
+          return fprintf(stderr, "printf: %%%c: invalid conversion\n", conversion) < 0 ? -1 : 0;
+      }
+    }
+    if (next_arg == pass_start) break; /* A format without conversions is printed once */
+  } while (next_arg < argc);
+
+  if (ferror(stdout)) return -1;
+  *ctx->last_fg_exit_status = ok ? 0 : 1;
+  return 0;
+}
+
+/* Evaluate a unary test(1) primary
+ * Parameters: char const *op, char const *operand
+ * Returns: 0 if true, 1 if false, 2 if op is not a unary primary */
+static int test_unary(char const *op, char const *operand) {
+  if (op[0] != '-' || op[1] == '\0' || op[2] != '\0') return 2;
+  struct stat st;
+  switch (op[1]) {
+    case 'n': return operand[0] != '\0' ? 0 : 1;
+    case 'z': return operand[0] == '\0' ? 0 : 1;
+    case 'r': return access(operand, R_OK) == 0 ? 0 : 1;
+    case 'w': return access(operand, W_OK) == 0 ? 0 : 1;
+    case 'x': return access(operand, X_OK) == 0 ? 0 : 1;
+    case 'L':
+    case 'h': return lstat(operand, &st) == 0 && S_ISLNK(st.st_mode) ? 0 : 1;
+    case 'e':
+    case 'f':
+    case 'd':
+    case 's':
+    case 'p':
+      if (stat(operand, &st) != 0) return 1;
+      if (op[1] == 'f') return S_ISREG(st.st_mode) ? 0 : 1;
+      if (op[1] == 'd') return S_ISDIR(st.st_mode) ? 0 : 1;
+      if (op[1] == 's') return st.st_size > 0 ? 0 : 1;
+      if (op[1] == 'p') return S_ISFIFO(st.st_mode) ? 0 : 1;
+      return 0;
+    default: return 2;
+  }
+}
+
+/* Evaluate a binary test(1) primary
+ * Parameters: char const *left, char const *op, char const *right
+ * Returns: 0 if true, 1 if false, 2 if op is not a binary primary or an integer operand is invalid */
+static int test_binary(char const *left, char const *op, char const *right) {
+  if (strcmp(op, "=") == 0) return strcmp(left, right) == 0 ? 0 : 1;
+  if (strcmp(op, "!=") == 0) return strcmp(left, right) != 0 ? 0 : 1;
+
+  static char const *const int_ops[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+  size_t which = 0;
+  while (which < 6 && strcmp(op, int_ops[which]) != 0) which++;
+  if (which == 6) return 2;
+  char *left_end, *right_end;
+  errno = 0;
+  intmax_t a = strtoimax(left, &left_end, 10), b = strtoimax(right, &right_end, 10);
+  if (!*left || !*right || *left_end || *right_end || errno != 0) {
+    errno = 0;
+    return 2;
+  }
+  bool const results[] = { a == b, a != b, a < b, a <= b, a > b, a >= b };
+  return results[which] ? 0 : 1;
+}
+
+/* Evaluate a test(1) expression of up to four arguments, following the POSIX rules by argument count
+ * Parameters: char **args, size_t count
+ * Returns: 0 if true, 1 if false, 2 on a syntax error */
+static int test_eval(char **args, size_t count) {
+  int result;
+  switch (count) {
+    case 0: return 1;
+    case 1: return args[0][0] != '\0' ? 0 : 1;
+    case 2:
+      if (strcmp(args[0], "!") == 0) return test_eval(args + 1, 1) == 0 ? 1 : 0;
+      return test_unary(args[0], args[1]);
+    case 3:
+      if ((result = test_binary(args[0], args[1], args[2])) != 2) return result;
+      if (strcmp(args[0], "!") == 0) break;
+      if (strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0) return test_eval(args + 1, 1);
+      return 2;
+    case 4:
+      if (strcmp(args[0], "!") == 0) break;
+      if (strcmp(args[0], "(") == 0 && strcmp(args[3], ")") == 0) return test_eval(args + 1, 2);
+      return 2;
+    default: return 2;
+  }
+  // Negation of the remaining arguments
+  result = test_eval(args + 1, count - 1);
+  return result == 2 ? 2 : !result;
+}
+
+/* Built-in commands test and [: evaluate a conditional expression; [ requires a closing ]
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc
+ * Returns: 0 on success, -1 if printing failed */
+static int builtin_test(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  if (strcmp(argv[0], "[") == 0) {
+    if (strcmp(argv[argc - 1], "]") != 0) {
+      *ctx->last_fg_exit_status = 2;
+      return fprintf(stderr, "[: missing ]\n") < 0 ? -1 : 0;
+    }
+    argc--;
+  }
+  *ctx->last_fg_exit_status = test_eval(argv + 1, argc - 1);
+  if (*ctx->last_fg_exit_status == 2 && fprintf(stderr, "%s: invalid expression\n", argv[0]) < 0) return -1;
+  return 0;
+}
+
+/* Built-in command export: mark variables for the environment of commands, assigning them with NAME=value;
+ * with no arguments list the exported variables
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc
+ * Returns: 0 on success, -1 on failure */
+static int builtin_export(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  struct var_store *vars = &ctx->sh->vars;
+  *ctx->last_fg_exit_status = 0;
+  if (argc == 1) {
+    for (size_t i = 0; i < vars->capacity; ++i) {
+      struct var_entry const *entry = &vars->slots[i];
+      if (!entry->exported) continue;
+      int printed = entry->has_value ? printf("export %s\n", entry->text)
+                                     : printf("export %.*s\n", (int) entry->name_len, entry->text);
+      if (printed < 0) return -1;
+    }
+    return 0;
+  }
+  for (size_t i = 1; i < argc; ++i) {
+    char const *equals = strchr(argv[i], '=');
+    size_t name_len = equals ? (size_t) (equals - argv[i]) : strlen(argv[i]);
+    if (!is_var_name(argv[i], name_len)) {
+      if (fprintf(stderr, "export: %s: not a valid name\n", argv[i]) < 0) return -1;
+      *ctx->last_fg_exit_status = 1;
+      continue;
+    }
+    if (var_set(vars, argv[i], name_len, equals ? equals + 1 : NULL, true) != 0) return -1;
+  }
+  return 0;
+}
+
+/* Built-in command unset: remove shell variables
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc
+ * Returns: 0 on success, -1 if printing failed */
+static int builtin_unset(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  *ctx->last_fg_exit_status = 0;
+  for (size_t i = 1; i < argc; ++i) {
+    if (!is_var_name(argv[i], strlen(argv[i]))) {
+      if (fprintf(stderr, "unset: %s: not a valid name\n", argv[i]) < 0) return -1;
+      *ctx->last_fg_exit_status = 1;
+      continue;
+    }
+    var_unset(&ctx->sh->vars, argv[i]);
+  }
+  return 0;
+}
+
+/* Built-in command stats: print the per-command resource statistics, with -h their histograms too,
+ * or clear them with -r
+ * Parameters: struct builtin_ctx *ctx, char **argv, size_t argc
+ * Returns: 0 on success, -1 if printing failed */
+static int builtin_stats(struct builtin_ctx *ctx, char **argv, size_t argc) {
+  bool histograms = false, reset = false;
+  for (size_t i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-h") == 0) {
+      histograms = true;
+    } else if (strcmp(argv[i], "-r") == 0) {
+      reset = true;
+    } else {
+      *ctx->last_fg_exit_status = 1;
+      return fprintf(stderr, "Usage: stats [-h] [-r]\n") < 0 ? -1 : 0;
+    }
+  }
+  *ctx->last_fg_exit_status = 0;
+  if (reset) {
+    stats_reset(&ctx->sh->stats);
+    return 0;
+  }
+  return stats_print(&ctx->sh->stats, stdout, histograms);
+}
+
+/* Built-in command table, sorted by name in strcmp order for bsearch. Commands that also exist as standalone
+ * utilities are marked so that a background run can still launch the external program in its own process. */
+struct builtin {
+  char const *name;
+  builtin_fn *fn;
+  bool has_utility;
+};
+
+static struct builtin const builtins[] = {
+  { "[",        builtin_test,     true },
+  { "bg",       builtin_bg,       false },
+  { "cd",       builtin_cd,       false },
+  { "echo",     builtin_echo,     true },
+  { "exit",     builtin_exit,     false },
+  { "export",   builtin_export,   false },
+  { "false",    builtin_false,    true },
+  { "fg",       builtin_fg,       false },
+  { "hash",     builtin_hash,     false },
+  { "history",  builtin_history,  false },
+  { "joblog",   builtin_joblog,   false },
+  { "jobs",     builtin_jobs,     false },
+  { "parallel", builtin_parallel, false },
+  { "printf",   builtin_printf,   true },
+  { "pwd",      builtin_pwd,      true },
+  { "stats",    builtin_stats,    false },
+  { "test",     builtin_test,     true },
+  { "true",     builtin_true,     true },
+  { "unset",    builtin_unset,    false },
+  { "wait",     builtin_wait,     false },
+};
+
+/* bsearch comparison of a command name against a builtin table entry
+ * Parameters: void const *name, void const *entry
+ * Returns: strcmp of the name and the entry's name */
+static int compare_builtin_name(void const *name, void const *entry) {
+  return strcmp(name, ((struct builtin const *) entry)->name);
+}
+
+/* Look up a built-in command
+ * Parameters: char const *name
+ * Returns: the table entry, or NULL if name is not a builtin */
+static struct builtin const *find_builtin(char const *name) {
+  return bsearch(name, builtins, sizeof builtins / sizeof *builtins, sizeof *builtins, compare_builtin_name);
+}
+
+/* Run a built-in command in the shell process. Its redirections are applied to the shell's own descriptors
+ * and undone afterwards, using copies of the original descriptors saved above the ones a redirection can name.
+ * Parameters: struct builtin_ctx *ctx, struct builtin const *builtin, struct command const *cmd
+ * Returns: 0 on success, -1 on failure */
+static int run_builtin(struct builtin_ctx *ctx, struct builtin const *builtin, struct command const *cmd) {
+  // -1 marks a descriptor left alone, -2 one that was closed before the builtin ran
+  int saved_fds[10];
+  for (int fd = 0; fd < 10; ++fd) saved_fds[fd] = -1;
+  int result = 0;
+
+  if (fflush(stdout) != 0 || fflush(stderr) != 0) return -1;
+  bool stdin_redirected = false;
+  for (size_t i = 0; i < cmd->num_redirs; ++i) {
+    int fd = cmd->redirs[i].fd;
+    stdin_redirected |= fd == STDIN_FILENO;
+    if (saved_fds[fd] != -1) continue;
+    if ((saved_fds[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10)) == -1) {
+      if (errno != EBADF) goto failed;
+      saved_fds[fd] = -2;
+    }
+  }
+  if (open_inline_inputs(cmd) != 0 || apply_redirections(cmd) != 0) goto failed;
+
+  ctx->stdin_redirected = stdin_redirected;
+  result = builtin->fn(ctx, cmd->argv, cmd->argc);
+  ctx->stdin_redirected = false;
+  if (fflush(stdout) != 0) result = -1;
+  // With its output redirected, a builtin that cannot write fails by itself instead of ending the shell
+  if (result == -1 && cmd->num_redirs > 0 && ferror(stdout)) {
+    int write_errno = errno;
+    clearerr(stdout);
+    *ctx->last_fg_exit_status = 1;
+    result = fprintf(stderr, "%s: write error: %s\n", cmd->argv[0], strerror(write_errno)) < 0 ? -1 : 0;
+    errno = 0;
+  }
+  goto restore;
+
+failed:
+  *ctx->last_fg_exit_status = 1;
+  errno = 0;
+restore:
+  close_inline_inputs(cmd);
+  fflush(stderr);
+  for (int fd = 0; fd < 10; ++fd) {
+    if (saved_fds[fd] == -2) {
+      close(fd);
+    } else if (saved_fds[fd] >= 0) {
+      if (dup2(saved_fds[fd], fd) == -1) result = -1;
+      close(saved_fds[fd]);
+    }
+  }
+  return result;
+}
+
+/* Run a built-in command in the shell with its stdout captured for a $(...) substitution. The output goes to
+ * a memory file rather than a pipe, since the shell cannot drain a pipe while it is the one writing to it.
+ * Parameters: struct builtin_ctx *ctx (capture set), struct builtin const *builtin, struct command const *cmd
+ * Returns: 0 on success, -1 on failure */
+static int capture_builtin(struct builtin_ctx *ctx, struct builtin const *builtin, struct command const *cmd) {
+  if (fflush(stdout) != 0) return -1;
+  int mem_fd = move_fd_high(memfd_create("smallsh-subst", MFD_CLOEXEC));
+  if (mem_fd == -1) return -1;
+  int saved_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+  if ((saved_fd == -1 && errno != EBADF) || dup2(mem_fd, STDOUT_FILENO) == -1) {
+    if (saved_fd != -1) close(saved_fd);
+    close(mem_fd);
+    return -1;
+  }
+  int result = run_builtin(ctx, builtin, cmd);
+  if (fflush(stdout) != 0) result = -1;
+  if (saved_fd == -1) {
+    close(STDOUT_FILENO);
+  } else {
+    if (dup2(saved_fd, STDOUT_FILENO) == -1) result = -1;
+    close(saved_fd);
+  }
+  if (result == 0 && (lseek(mem_fd, 0, SEEK_SET) != 0 || capture_read(ctx->capture, mem_fd) != 0)) result = -1;
+  close(mem_fd);
+  return result;
+}
+
+/* Refresh the values substituted for ~/, $? and $! before a line is expanded
+ * Parameters: struct builtin_ctx *ctx
+ * Returns: 0 on success, -1 if formatting failed */
+static int refresh_expand_ctx(struct builtin_ctx *ctx) {
+  struct expand_ctx *expand = ctx->expand;
+  expand->home = var_get(&ctx->sh->vars, "HOME");
+  if (!expand->home) expand->home = "";
+  if (snprintf(expand->exit_status, sizeof expand->exit_status, "%d", *ctx->last_fg_exit_status) < 0) return -1;
+  expand->bg_pid[0] = '\0'; /* pid of 0 indicates last_bg_proc_pid has not been set yet, default for $! is an empty string */
+  if (*ctx->last_bg_proc_pid != 0 &&
+      snprintf(expand->bg_pid, sizeof expand->bg_pid, "%jd", (intmax_t) *ctx->last_bg_proc_pid) < 0) return -1;
+  return 0;
+}
+
+/* Run an expanded command line: set variables, run a builtin in the shell, or launch a pipeline
+ * Parameters: struct builtin_ctx *ctx, struct arena *arena (holds the launch prefix settings),
+ *             struct parsed_line *parsed
+ * Returns: 0 on success, -1 on a fatal error */
+static int run_parsed_line(struct builtin_ctx *ctx, struct arena *arena, struct parsed_line *parsed) {
+  struct shell_state *sh = ctx->sh;
+  struct command *stages = parsed->stages;
+  size_t num_stages = parsed->num_stages;
+  bool is_bg_proc = parsed->is_bg_proc;
+
+  // A line of nothing but NAME=value words sets shell variables
+  if (num_stages == 1 && stages[0].argc == 0 && stages[0].num_assigns > 0) {
+    for (size_t i = 0; i < stages[0].num_assigns; ++i) {
+      char const *assign = stages[0].assigns[i];
+      size_t name_len = strchr(assign, '=') - assign;
+      if (var_set(&sh->vars, assign, name_len, assign + name_len + 1, false) != 0) return -1;
+    }
+    if (!ctx->substituted) *ctx->last_fg_exit_status = 0; /* Otherwise the last substitution's status stands */
+    return 0;
+  }
+  // A command whose words all expanded to nothing leaves the status of its substitutions
+  if (num_stages == 1 && stages[0].argc == 0 && stages[0].num_redirs == 0) return 0;
+
+  // A leading time keyword reports the real and CPU time of the rest of a foreground line
+  bool timed = !is_bg_proc && stages[0].argc > 1 && strcmp(stages[0].argv[0], "time") == 0;
+  struct timespec time_start;
+  struct rusage self_start;
+  if (timed) {
+    stages[0].argv++;
+    stages[0].argc--;
+    sh->fg_user_us = sh->fg_sys_us = 0;
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    if (getrusage(RUSAGE_SELF, &self_start) != 0) return -1;
+  }
+
+  // affinity, nice and limit prefixes are taken off every stage; with SMALLSH_SPREAD set, background jobs are
+  // also pinned to CPUs in turn
+  for (size_t i = 0; i < num_stages; ++i) {
+    int prefix_result = strip_launch_prefixes(arena, &stages[i]);
+    if (prefix_result == -1) return -1;
+    if (prefix_result == 1) {
+      *ctx->last_fg_exit_status = 1;
+      return 0;
+    }
+  }
+  if (is_bg_proc && spread_background_job(sh, arena, stages, num_stages) != 0) return -1;
+
+  /*
+   * EXECUTION
+   */
+  // Built-in commands run in the shell itself, so they are only recognized as a lone command. In the
+  // background, a builtin that is also a standalone utility runs as that utility in its own process, as does
+  // one given launch prefixes.
+  struct builtin const *builtin = num_stages == 1 && stages[0].argv[0] && !stages[0].attrs ?
+                                  find_builtin(stages[0].argv[0]) : NULL;
+  if (builtin && !(is_bg_proc && builtin->has_utility)) {
+    if ((ctx->capture ? capture_builtin(ctx, builtin, &stages[0]) : run_builtin(ctx, builtin, &stages[0])) != 0) return -1;
+  } else { /* Branch for non-built-in commands */
+    // Execute non-built-in-commands in new child processes, one per pipeline stage
+    if (fflush(stdout) != 0) return -1;
+    if (fflush(stderr) != 0) return -1;
+    if (run_pipeline(sh, arena, stages, num_stages, is_bg_proc, parsed->command_text,
+                     ctx->last_fg_exit_status, ctx->last_bg_proc_pid, ctx->capture) != 0) return -1;
+  }
+  if (timed && report_time(sh, &time_start, &self_start) != 0) return -1;
+  return 0;
+}
+
+/* Expand a compiled line with the shell's current values and run it
+ * Parameters: struct builtin_ctx *ctx, struct arena *arena (holds the expanded line),
+ *             struct compiled_line const *compiled, char *const *heredocs (as for instantiate_line)
+ * Returns: 0 on success, -1 on a fatal error */
+static int execute_line(struct builtin_ctx *ctx, struct arena *arena, struct compiled_line const *compiled,
+                        char *const *heredocs) {
+  struct parsed_line parsed;
+  if (refresh_expand_ctx(ctx) != 0) return -1;
+  ctx->substituted = false;
+  if (instantiate_line(arena, compiled, heredocs, ctx->expand, &parsed) != 0) return -1;
+  trace_event(&ctx->sh->trace, TRACE_EXPAND, 0, NULL, compiled->num_sites);
+  return run_parsed_line(ctx, arena, &parsed);
+}
+
+/* Run the command of a $(...) substitution and return its output with trailing newlines removed
+ * The command is compiled from a copy of its text and run like a line of its own, sharing the current
+ * line's arena. A builtin runs in the shell without a fork, so cd or a NAME=value there changes the shell
+ * itself; other commands are launched with their stdout on a pipe.
+ * Parameters: struct arena *arena (holds the command and the returned output), struct builtin_ctx *ctx,
+ *             char const *command, size_t len (text between the parentheses)
+ * Returns: the output, or NULL on a fatal error */
+static char *run_substitution(struct arena *arena, struct builtin_ctx *ctx, char const *command, size_t len) {
+  char *line = arena_alloc(arena, len + 1);
+  if (!line) return NULL;
+  memcpy(line, command, len);
+  line[len] = '\0';
+  ctx->substituted = true;
+
+  struct compiled_line *compiled;
+  struct capture capture = {0};
+  enum parse_result parse_result = compile_line(arena, &ctx->sh->ifs, &ctx->sh->vars, line, len, true, &compiled);
+  if (parse_result == PARSE_ERROR) return NULL;
+  if (parse_result >= PARSE_SYNTAX_ERROR) {
+    *ctx->last_fg_exit_status = 1;
+    return fprintf(stderr, "Syntax error: %s\n", syntax_error_message(parse_result)) < 0 ? NULL : "";
+  }
+  if (parse_result == PARSE_EMPTY) {
+    *ctx->last_fg_exit_status = 0;
+    return "";
+  }
+
+  // Substitutions nested in the command run while it is expanded, before its own output is captured
+  struct parsed_line parsed;
+  if (instantiate_line(arena, compiled, NULL, ctx->expand, &parsed) != 0) return NULL;
+  struct capture *outer = ctx->capture;
+  ctx->capture = &capture;
+  int result = run_parsed_line(ctx, arena, &parsed);
+  ctx->capture = outer;
+  // As in other shells, a $? later in the same line sees the substitution's status
+  snprintf(ctx->expand->exit_status, sizeof ctx->expand->exit_status, "%d", *ctx->last_fg_exit_status);
+
+  char *output = NULL;
+  if (result == 0) {
+    while (capture.len > 0 && capture.buf[capture.len - 1] == '\n') capture.len--;
+    if ((output = arena_alloc(arena, capture.len + 1))) {
+      if (capture.len) memcpy(output, capture.buf, capture.len);
+      output[capture.len] = '\0';
+    }
+  }
+  free(capture.buf);
+  return output;
+}
+
+/* Read the bodies of a line's here-documents from the shell's input, each up to its delimiter line.
+ * As in other shells, the end of the input also ends a body.
+ * Parameters: struct builtin_ctx *ctx, struct compiled_line const *compiled (with at least one here-document)
+ * Returns: malloc'd array of the bodies in the order of their redirections, held in one block with its
+ *          strings, or NULL if reading or allocation failed */
+static char **read_heredocs(struct builtin_ctx *ctx, struct compiled_line const *compiled) {
+  char *text = NULL;
+  size_t text_len = 0, text_cap = 0;
+  for (size_t i = 0; i < compiled->num_redirs; ++i) {
+    if (compiled->redirs[i].kind != REDIR_HEREDOC) continue;
+    char const *delimiter = compiled->words[compiled->redirs[i].target_word];
+    for (;;) {
+      char *line;
+      if (ctx->interactive && fprintf(stderr, "> ") < 0) goto fail;
+      ctx->reader->prompt = "> ";
+      ssize_t line_length = reader_next_line(ctx->reader, &line);
+      if (line_length == -1 && errno != 0 && errno != EINTR) goto fail;
+      errno = 0;
+      bool at_end = line_length == -1 || strcmp(line, delimiter) == 0;
+      // Room for the line, its newline and the body's terminator
+      size_t need = text_len + (at_end ? 0 : line_length + 1) + 1;
+      if (need > text_cap) {
+        size_t new_cap = text_cap ? text_cap * 2 : 256;
+        while (new_cap < need) new_cap *= 2;
+        char *new_text = realloc(text, new_cap);
+        if (!new_text) goto fail;
+        text = new_text;
+        text_cap = new_cap;
+      }
+      if (at_end) break;
+      memcpy(text + text_len, line, line_length);
+      text_len += line_length;
+      text[text_len++] = '\n';
+    }
+    text[text_len++] = '\0';
+  }
+
+  char **bodies = malloc(sizeof *bodies * compiled->num_heredocs + text_len);
+  if (!bodies) goto fail;
+  char *copy = memcpy((char *) (bodies + compiled->num_heredocs), text, text_len);
+  for (size_t i = 0; i < compiled->num_heredocs; ++i) {
+    bodies[i] = copy;
+    copy += strlen(copy) + 1;
+  }
+  free(text);
+  return bodies;
+
+fail:
+  free(text);
+  return NULL;
+}
+
+/* Loops. A for or while line starts a loop whose body lines are read up to the matching done line and
+ * compiled once; each iteration only re-expands them.
+ *   for NAME in WORD...     runs the body with NAME set to each word in turn
+ *   while COMMAND...        runs the body as long as the command exits with status 0
+ * An optional do line may follow the loop line. Loops nest, and a body command killed by SIGINT ends every
+ * loop it is in. */
+enum loop_word { LOOP_NONE, LOOP_FOR, LOOP_WHILE, LOOP_DO, LOOP_DONE };
+
+struct loop_item {
+  struct compiled_line *line;  /* A body line, or NULL for a nested loop */
+  char **heredocs;             /* Bodies of the line's here-documents, read along with the loop */
+  struct loop *loop;           /* The nested loop, or NULL for a body line */
+};
+
+struct loop {
+  struct compiled_line *header;
+  enum loop_word kind;         /* LOOP_FOR or LOOP_WHILE */
+  struct loop_item *body;
+  size_t body_len;
+  size_t body_cap;
+};
+
+/* Classify a compiled line by the loop keyword it starts with
+ * Parameters: struct compiled_line const *compiled
+ * Returns: the keyword, or LOOP_NONE for an ordinary command line */
+static enum loop_word loop_keyword(struct compiled_line const *compiled) {
+  struct ir_stage const *stage = &compiled->stages[0];
+  if (compiled->num_stages != 1 || stage->num_assigns != 0 || stage->argc == 0) return LOOP_NONE;
+  char const *word = compiled->words[stage->first_word];
+  if (strcmp(word, "for") == 0) return LOOP_FOR;
+  if (strcmp(word, "while") == 0) return LOOP_WHILE;
+  if (stage->argc == 1 && strcmp(word, "do") == 0) return LOOP_DO;
+  if (stage->argc == 1 && strcmp(word, "done") == 0) return LOOP_DONE;
+  return LOOP_NONE;
+}
+
+/* Free a loop, its nested loops and their compiled lines
+ * Parameters: struct loop *loop (may be NULL)
+ * Returns: nothing */
+static void loop_free(struct loop *loop) {
+  if (!loop) return;
+  for (size_t i = 0; i < loop->body_len; ++i) {
+    loop_free(loop->body[i].loop);
+    free(loop->body[i].heredocs);
+    free(loop->body[i].line);
+  }
+  free(loop->body);
+  free(loop->header);
+  free(loop);
+}
+
+/* Check the shape of a loop line: for needs a variable name and in, while needs a command
+ * Parameters: struct compiled_line const *header, enum loop_word kind
+ * Returns: true if the line can start a loop */
+static bool loop_header_valid(struct compiled_line const *header, enum loop_word kind) {
+  struct ir_stage const *stage = &header->stages[0];
+  char **words = &header->words[stage->first_word];
+  if (header->is_bg_proc || stage->num_redirs != 0) return false;
+  if (kind == LOOP_WHILE) return stage->argc > 1;
+  return stage->argc >= 3 && is_var_name(words[1], strlen(words[1])) && strcmp(words[2], "in") == 0;
+}
+
+/* Read the body of a loop from the shell's input, up to its done line
+ * Parameters: struct builtin_ctx *ctx, struct loop *loop (header and kind set; body lines are appended)
+ * Returns: 0 on success, 1 on a syntax error (already reported) or end of input before done,
+ *          -1 on a fatal error */
+static int read_loop_body(struct builtin_ctx *ctx, struct loop *loop) {
+  bool first_line = true;
+  for (;;) {
+    char *line;
+    if (ctx->interactive && fprintf(stderr, "> ") < 0) return -1;
+    ctx->reader->prompt = "> ";
+    ssize_t line_length = reader_next_line(ctx->reader, &line);
+    if (line_length == -1) {
+      if (errno != 0 && errno != EINTR) return -1;
+      errno = 0;
+      return fprintf(stderr, "Syntax error: missing done\n") < 0 ? -1 : 1;
+    }
+    trace_event(&ctx->sh->trace, TRACE_LINE_READ, 0, NULL, line_length);
+
+    struct compiled_line *compiled;
+    enum parse_result parse_result = compile_line(ctx->line_arena, &ctx->sh->ifs, &ctx->sh->vars, line, line_length,
+                                                  false, &compiled);
+    if (parse_result == PARSE_ERROR) return -1;
+    trace_event(&ctx->sh->trace, TRACE_TOKENIZE, 0, NULL, 0);
+    if (parse_result == PARSE_EMPTY) continue;
+    if (parse_result >= PARSE_SYNTAX_ERROR) {
+      return fprintf(stderr, "Syntax error: %s\n", syntax_error_message(parse_result)) < 0 ? -1 : 1;
+    }
+
+    enum loop_word keyword = loop_keyword(compiled);
+    bool skip_do = keyword == LOOP_DO && first_line;
+    first_line = false;
+    if (keyword == LOOP_DONE || skip_do) {
+      free(compiled);
+      if (keyword == LOOP_DONE) return 0;
+      continue;
+    }
+    if (loop->body_len == loop->body_cap) {
+      size_t new_cap = loop->body_cap ? loop->body_cap * 2 : 8;
+      struct loop_item *new_body = realloc(loop->body, sizeof *new_body * new_cap);
+      if (!new_body) {
+        free(compiled);
+        return -1;
+      }
+      loop->body = new_body;
+      loop->body_cap = new_cap;
+    }
+    struct loop_item *item = &loop->body[loop->body_len++];
+    if (keyword != LOOP_FOR && keyword != LOOP_WHILE) {
+      *item = (struct loop_item) { .line = compiled };
+      if (compiled->num_heredocs > 0 && !(item->heredocs = read_heredocs(ctx, compiled))) return -1;
+      continue;
+    }
+
+    // A nested loop owns its loop line
+    *item = (struct loop_item) { .loop = calloc(1, sizeof *item->loop) };
+    if (!item->loop) {
+      free(compiled);
+      return -1;
+    }
+    item->loop->header = compiled;
+    item->loop->kind = keyword;
+    if (!loop_header_valid(compiled, keyword)) {
+      return fprintf(stderr, "Syntax error: bad %s loop\n", keyword == LOOP_FOR ? "for" : "while") < 0 ? -1 : 1;
+    }
+    int result = read_loop_body(ctx, item->loop);
+    if (result != 0) return result;
+  }
+}
+
+static int run_loop(struct builtin_ctx *ctx, struct arena *arena, struct loop const *loop, bool *interrupted);
+
+/* Run the body of a loop once, each line expanded into a fresh iteration arena
+ * Parameters: struct builtin_ctx *ctx, struct arena *arena (reset here before use), struct loop const *loop,
+ *             bool *interrupted (set when a command was killed by SIGINT)
+ * Returns: 0 on success, -1 on a fatal error */
+static int run_loop_body(struct builtin_ctx *ctx, struct arena *arena, struct loop const *loop, bool *interrupted) {
+  for (size_t i = 0; i < loop->body_len && !*interrupted; ++i) {
+    arena_reset(arena);
+    struct loop_item const *item = &loop->body[i];
+    int result = item->loop ? run_loop(ctx, arena, item->loop, interrupted)
+                            : execute_line(ctx, arena, item->line, item->heredocs);
+    if (result != 0) return -1;
+    if (reap_children(ctx->sh) != 0) return -1;
+    if (report_child_events(ctx->sh) != 0) return -1;
+    if (*ctx->last_fg_exit_status == 128 + SIGINT) *interrupted = true;
+  }
+  return 0;
+}
+
+/* Run a loop until its words run out or its condition fails
+ * The exit status is that of the last body command run, or 0 if the body never ran.
+ * Parameters: struct builtin_ctx *ctx, struct arena *arena (holds the expanded loop line),
+ *             struct loop const *loop, bool *interrupted (set when a command was killed by SIGINT)
+ * Returns: 0 on success, -1 on a fatal error */
+static int run_loop(struct builtin_ctx *ctx, struct arena *arena, struct loop const *loop, bool *interrupted) {
+  struct arena iteration_arena = {0};
+  struct compiled_line const *header = loop->header;
+  int status = 0;
+  int result = 0;
+  if (loop->kind == LOOP_FOR) {
+    // The word list is expanded once, before the first iteration
+    struct parsed_line parsed;
+    if (refresh_expand_ctx(ctx) != 0 || instantiate_line(arena, header, NULL, ctx->expand, &parsed) != 0) return -1;
+    char **argv = parsed.stages[0].argv;
+    for (size_t i = 3; i < parsed.stages[0].argc && !*interrupted; ++i) {
+      if ((result = var_set(&ctx->sh->vars, argv[1], strlen(argv[1]), argv[i], false)) != 0) break;
+      if ((result = run_loop_body(ctx, &iteration_arena, loop, interrupted)) != 0) break;
+      status = *ctx->last_fg_exit_status;
+    }
+  } else {
+    while (!*interrupted) {
+      // The condition is re-expanded and run before every iteration
+      struct parsed_line parsed;
+      arena_reset(&iteration_arena);
+      if (refresh_expand_ctx(ctx) != 0 || instantiate_line(&iteration_arena, header, NULL, ctx->expand, &parsed) != 0) {
+        result = -1;
+        break;
+      }
+      trace_event(&ctx->sh->trace, TRACE_EXPAND, 0, NULL, header->num_sites);
+      parsed.stages[0].argv++;
+      parsed.stages[0].argc--;
+      if ((result = run_parsed_line(ctx, &iteration_arena, &parsed)) != 0) break;
+      if (*ctx->last_fg_exit_status != 0) {
+        if (*ctx->last_fg_exit_status == 128 + SIGINT) *interrupted = true;
+        break;
+      }
+      if ((result = run_loop_body(ctx, &iteration_arena, loop, interrupted)) != 0) break;
+      status = *ctx->last_fg_exit_status;
+    }
+  }
+  arena_free(&iteration_arena);
+  if (!*interrupted) *ctx->last_fg_exit_status = status;
+  return result;
+}
+
+/* Read the body of a loop started by a line of input and run it
+ * Parameters: struct builtin_ctx *ctx, struct compiled_line *header (the loop line, owned by the parse cache;
+ *             no lookups happen while the loop runs, so it is not evicted), enum loop_word kind
+ * Returns: 0 on success or a syntax error (exit status set to 1), -1 on a fatal error */
+static int start_loop(struct builtin_ctx *ctx, struct compiled_line *header, enum loop_word kind) {
+  if (!loop_header_valid(header, kind)) {
+    *ctx->last_fg_exit_status = 1;
+    return fprintf(stderr, "Syntax error: bad %s loop\n", kind == LOOP_FOR ? "for" : "while") < 0 ? -1 : 0;
+  }
+  struct loop *loop = calloc(1, sizeof *loop);
+  if (!loop) return -1;
+  *loop = (struct loop) { .header = header, .kind = kind };
+  int result = read_loop_body(ctx, loop);
+  if (result == 1) {
+    *ctx->last_fg_exit_status = 1;
+    result = 0;
+  } else if (result == 0) {
+    bool interrupted = false;
+    result = run_loop(ctx, ctx->line_arena, loop, &interrupted);
+  }
+  loop->header = NULL; /* Left to the parse cache */
+  loop_free(loop);
+  return result;
+}
+
+/* Index of the executables in PATH for completing command names. It is a sorted array of names, built the
+ * first time a command name is completed. Inotify events on the PATH directories, read before each
+ * completion, keep it current, so only a change of PATH itself or a lost event rebuilds it. */
+#define EXEC_INDEX_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | \
+                           IN_MOVE_SELF | IN_ONLYDIR)
+
+struct exec_name {
+  char *name;
+  uint64_t dirs; /* Bit i set when PATH directory i has it; directories from 63 on share the last bit */
+};
+
+struct exec_index {
+  int inotify_fd;          /* -1 until the index is built */
+  char *path_var;          /* PATH the index was built from */
+  uint64_t generation;     /* Variable store generation PATH was last checked at */
+  char **dirs;             /* PATH directories, each ending in / */
+  int *wds;                /* inotify watch of each directory, -1 if it could not be watched */
+  size_t num_dirs;
+  struct exec_name *names; /* Sorted by name */
+  size_t count;
+  size_t cap;
+  struct arena arena;      /* Names and directories; names of removed entries stay until the next rebuild */
+};
+
+/* Release everything an index holds, leaving it unbuilt
+ * Parameters: struct exec_index *idx
+ * Returns: nothing */
+static void exec_index_reset(struct exec_index *idx) {
+  if (idx->inotify_fd != -1) close(idx->inotify_fd);
+  free(idx->path_var);
+  free(idx->dirs);
+  free(idx->wds);
+  free(idx->names);
+  arena_reset(&idx->arena);
+  *idx = (struct exec_index) { .inotify_fd = -1, .arena = idx->arena };
+}
+
+/* Bit of a PATH directory in exec_name.dirs
+ * Parameters: size_t dir (index of the directory in PATH)
+ * Returns: the bit */
+static uint64_t exec_index_bit(size_t dir) {
+  return (uint64_t) 1 << (dir < 63 ? dir : 63);
+}
+
+/* Find where a name is or belongs in the index; names starting with a prefix follow the prefix's position
+ * Parameters: struct exec_index const *idx, char const *name
+ * Returns: index of the first name not less than name */
+static size_t exec_index_lower_bound(struct exec_index const *idx, char const *name) {
+  size_t low = 0, high = idx->count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (strcmp(idx->names[mid].name, name) < 0) low = mid + 1;
+    else high = mid;
+  }
+  return low;
+}
+
+/* Check whether a directory entry is a regular file the user may execute
+ * Parameters: int dir_fd, char const *name
+ * Returns: true if it is */
+static bool exec_index_is_executable(int dir_fd, char const *name) {
+  struct stat st;
+  return fstatat(dir_fd, name, &st, 0) == 0 && S_ISREG(st.st_mode) && faccessat(dir_fd, name, X_OK, 0) == 0;
+}
+
+/* Make room for one more name
+ * Parameters: struct exec_index *idx
+ * Returns: 0 on success, -1 if allocation failed */
+static int exec_index_reserve(struct exec_index *idx) {
+  if (idx->count < idx->cap) return 0;
+  size_t new_cap = idx->cap ? idx->cap * 2 : 1024;
+  struct exec_name *grown = realloc(idx->names, sizeof *grown * new_cap);
+  if (!grown) return -1;
+  idx->names = grown;
+  idx->cap = new_cap;
+  return 0;
+}
+
+/* Record that a PATH directory has an executable, inserting the name in order if it is new
+ * Parameters: struct exec_index *idx, char const *name, uint64_t bit (of the directory)
+ * Returns: 0 on success, -1 if allocation failed */
+static int exec_index_add(struct exec_index *idx, char const *name, uint64_t bit) {
+  size_t pos = exec_index_lower_bound(idx, name);
+  if (pos < idx->count && strcmp(idx->names[pos].name, name) == 0) {
+    idx->names[pos].dirs |= bit;
+    return 0;
+  }
+  size_t len = strlen(name);
+  char *copy = arena_alloc(&idx->arena, len + 1);
+  if (!copy || exec_index_reserve(idx) != 0) return -1;
+  memcpy(copy, name, len + 1);
+  memmove(idx->names + pos + 1, idx->names + pos, sizeof *idx->names * (idx->count - pos));
+  idx->names[pos] = (struct exec_name) { .name = copy, .dirs = bit };
+  idx->count++;
+  return 0;
+}
+
+/* Record that a PATH directory no longer has an executable, removing the name once no directory has it
+ * Parameters: struct exec_index *idx, char const *name, uint64_t bit (of the directory)
+ * Returns: nothing */
+static void exec_index_drop(struct exec_index *idx, char const *name, uint64_t bit) {
+  size_t pos = exec_index_lower_bound(idx, name);
+  if (pos == idx->count || strcmp(idx->names[pos].name, name) != 0) return;
+  if ((idx->names[pos].dirs &= ~bit) != 0) return;
+  idx->count--;
+  memmove(idx->names + pos, idx->names + pos + 1, sizeof *idx->names * (idx->count - pos));
+}
+
+/* qsort comparison of index entries by name
+ * Parameters: void const *a, void const *b
+ * Returns: strcmp of the names */
+static int compare_exec_names(void const *a, void const *b) {
+  return strcmp(((struct exec_name const *) a)->name, ((struct exec_name const *) b)->name);
+}
+
+/* Build the index from scratch: watch every PATH directory, then list it with getdents64
+ * Parameters: struct exec_index *idx, char const *path_var
+ * Returns: 0 on success, -1 on failure */
+static int exec_index_build(struct exec_index *idx, char const *path_var) {
+  exec_index_reset(idx);
+  size_t max_dirs = 1;
+  for (char const *c = path_var; *c; ++c) max_dirs += *c == ':';
+  idx->path_var = strdup(path_var);
+  idx->dirs = malloc(sizeof *idx->dirs * max_dirs);
+  idx->wds = malloc(sizeof *idx->wds * max_dirs);
+  if (!idx->path_var || !idx->dirs || !idx->wds) return -1;
+  if ((idx->inotify_fd = move_fd_high(inotify_init1(IN_NONBLOCK | IN_CLOEXEC))) == -1) return -1;
+
+  struct arena scan_arena = {0};
+  int result = 0;
+  for (char const *start = path_var; result == 0;) {
+    char const *end = strchr(start, ':');
+    if (!end) end = start + strlen(start);
+    size_t len = end - start;
+    char *dir = len > 0 ? arena_alloc(&idx->arena, len + 2) : NULL;
+    if (len > 0 && !dir) result = -1;
+    if (dir) {
+      memcpy(dir, start, len);
+      if (dir[len - 1] != '/') dir[len++] = '/';
+      dir[len] = '\0';
+      size_t d = idx->num_dirs++;
+      idx->dirs[d] = dir;
+      // The watch comes first, so nothing created while the directory is read is missed
+      idx->wds[d] = inotify_add_watch(idx->inotify_fd, dir, EXEC_INDEX_EVENTS);
+      struct glob_ctx scan = { .arena = &scan_arena };
+      struct glob_dir *listing = glob_dir_get(&scan, dir);
+      int dir_fd = listing ? open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+      if (!listing) result = -1;
+      for (size_t i = 0; result == 0 && dir_fd != -1 && i < listing->count; ++i) {
+        char const *name = listing->names[i];
+        if (listing->types[i] == DT_DIR || !exec_index_is_executable(dir_fd, name)) continue;
+        // Names are appended unsorted here, then sorted and merged once the last directory has been read
+        size_t name_len = strlen(name);
+        char *copy = arena_alloc(&idx->arena, name_len + 1);
+        if (!copy || exec_index_reserve(idx) != 0) {
+          result = -1;
+          break;
+        }
+        memcpy(copy, name, name_len + 1);
+        idx->names[idx->count++] = (struct exec_name) { .name = copy, .dirs = exec_index_bit(d) };
+      }
+      if (dir_fd != -1) close(dir_fd);
+      arena_reset(&scan_arena);
+    }
+    if (!*end) break;
+    start = end + 1;
+  }
+  arena_free(&scan_arena);
+  if (result != 0) return -1;
+
+  qsort(idx->names, idx->count, sizeof *idx->names, compare_exec_names);
+  size_t kept = 0;
+  for (size_t i = 0; i < idx->count; ++i) {
+    if (kept > 0 && strcmp(idx->names[kept - 1].name, idx->names[i].name) == 0) {
+      idx->names[kept - 1].dirs |= idx->names[i].dirs;
+    } else {
+      idx->names[kept++] = idx->names[i];
+    }
+  }
+  idx->count = kept;
+  errno = 0;
+  return 0;
+}
+
+/* Bring the index up to date: build it if it has not been or PATH has changed, otherwise apply the inotify
+ * events that have arrived since the last completion
+ * Parameters: struct exec_index *idx, struct var_store const *vars
+ * Returns: 0 on success, -1 on failure */
+static int exec_index_refresh(struct exec_index *idx, struct var_store const *vars) {
+  char const *path_var = var_get(vars, "PATH");
+  if (!path_var) path_var = "/bin:/usr/bin"; /* Same default search path execvp uses */
+  if (idx->inotify_fd == -1 || (idx->generation != vars->generation && strcmp(idx->path_var, path_var) != 0)) {
+    if (exec_index_build(idx, path_var) != 0) return -1;
+  }
+  idx->generation = vars->generation;
+
+  union {
+    char buf[16384];
+    struct inotify_event align;
+  } events;
+  for (;;) {
+    ssize_t got = read(idx->inotify_fd, events.buf, sizeof events.buf);
+    if (got == -1 && errno == EINTR) continue;
+    if (got == -1 && errno == EAGAIN) break;
+    if (got == -1) return -1;
+    for (ssize_t off = 0; off < got;) {
+      struct inotify_event const *event = (struct inotify_event const *) (events.buf + off);
+      off += sizeof *event + event->len;
+      // A lost event or a PATH directory going away leaves nothing to update from
+      if (event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        return exec_index_build(idx, path_var);
+      }
+      if (event->len == 0 || (event->mask & IN_ISDIR)) continue;
+      // A directory named twice in PATH shares one watch
+      for (size_t d = 0; d < idx->num_dirs; ++d) {
+        if (idx->wds[d] != event->wd) continue;
+        bool executable = false;
+        if (event->mask & (IN_CREATE | IN_MOVED_TO | IN_ATTRIB)) {
+          int dir_fd = open(idx->dirs[d], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+          executable = dir_fd != -1 && exec_index_is_executable(dir_fd, event->name);
+          if (dir_fd != -1) close(dir_fd);
+        }
+        if (!executable) exec_index_drop(idx, event->name, exec_index_bit(d));
+        else if (exec_index_add(idx, event->name, exec_index_bit(d)) != 0) return -1;
+      }
+    }
+  }
+  errno = 0;
+  return 0;
+}
+
+/* Interactive line editor, used when stdin and stderr are terminals. The terminal is in raw mode only while a
+ * line is read, and keys are read through the event loop so children are reaped meanwhile. Every change
+ * redraws the last line of the prompt and the text. Keys: arrows, Home/End, Ctrl-A/E/B/F, Backspace,
+ * Delete, Ctrl-D, Ctrl-K/U/W, Ctrl-L, Up/Down or Ctrl-P/N for history, Ctrl-R to search it, and Tab to
+ * complete command names, builtins and paths (twice to list the candidates). */
+#define EDITOR_LIST_MAX 256 /* Candidates listed by a second Tab; more are only counted */
+
+enum editor_key {
+  KEY_DELETE = 256, /* Keys from escape sequences with no control character of their own */
+};
+
+struct line_editor {
+  struct shell_state *sh;
+  char *buf;               /* The line, kept NUL terminated */
+  size_t len;
+  size_t cap;
+  size_t cursor;
+  char const *prompt;      /* Last line of the prompt, redrawn before the text */
+  unsigned char pending[256]; /* Read from the terminal but not yet handled; kept for the next line */
+  size_t pending_start;
+  size_t pending_end;
+  int esc_state;           /* 0 outside an escape sequence, 1 after ESC, 2 after ESC [ or ESC O */
+  int esc_param;           /* Number in ESC [ N ~ */
+  bool last_was_tab;       /* A second Tab in a row lists the candidates */
+  size_t history_pos;      /* History entry being shown, or SIZE_MAX for the line being typed */
+  char *draft;             /* The line being typed, saved while history is shown */
+  bool searching;          /* In a Ctrl-R search */
+  char query[128];
+  size_t query_len;
+  struct exec_index exec_index;
+  struct arena arena;      /* Completion candidates and directory listings */
+};
+
+/* Set up the line editor
+ * Parameters: struct line_editor *ed, struct shell_state *sh
+ * Returns: 0 on success, -1 if allocation failed */
+static int editor_open(struct line_editor *ed, struct shell_state *sh) {
+  *ed = (struct line_editor) { .sh = sh, .cap = 256, .exec_index = { .inotify_fd = -1 } };
+  ed->buf = malloc(ed->cap);
+  return ed->buf ? 0 : -1;
+}
+
+/* Release the line editor
+ * Parameters: struct line_editor *ed
+ * Returns: nothing */
+static void editor_close(struct line_editor *ed) {
+  exec_index_reset(&ed->exec_index);
+  arena_free(&ed->exec_index.arena);
+  arena_free(&ed->arena);
+  free(ed->draft);
+  free(ed->buf);
+  ed->buf = NULL;
+}
+
+/* Write everything to the terminal
+ * Parameters: char const *data, size_t len
+ * Returns: 0 on success, -1 on a write error */
+static int editor_write(char const *data, size_t len) {
+  while (len > 0) {
+    ssize_t put = write(STDERR_FILENO, data, len);
+    if (put == -1 && errno == EINTR) continue;
+    if (put == -1) return -1;
+    data += put;
+    len -= put;
+  }
+  return 0;
+}
+
+/* Count the terminal columns of some text, one per character of UTF-8
+ * Parameters: char const *text, size_t len
+ * Returns: the number of columns */
+static size_t editor_columns(char const *text, size_t len) {
+  size_t columns = 0;
+  for (size_t i = 0; i < len; ++i) columns += ((unsigned char) text[i] & 0xC0) != 0x80;
+  return columns;
+}
+
+/* Redraw the prompt and the line, or the search prompt and its match, with the cursor in place
+ * Parameters: struct line_editor *ed
+ * Returns: 0 on success, -1 on failure */
+static int editor_refresh(struct line_editor *ed) {
+  size_t prompt_len = strlen(ed->prompt);
+  char *out = malloc(prompt_len + ed->query_len + ed->len + 64);
+  if (!out) return -1;
+  size_t n = 0;
+  out[n++] = '\r';
+  if (ed->searching) {
+    n += sprintf(out + n, "(reverse-i-search)`%.*s': ", (int) ed->query_len, ed->query);
+  } else {
+    memcpy(out + n, ed->prompt, prompt_len);
+    n += prompt_len;
+  }
+  memcpy(out + n, ed->buf, ed->len);
+  n += ed->len;
+  n += sprintf(out + n, "\x1b[K");
+  size_t back = ed->searching ? 0 : editor_columns(ed->buf + ed->cursor, ed->len - ed->cursor);
+  if (back > 0) n += sprintf(out + n, "\x1b[%zuD", back);
+  int result = editor_write(out, n);
+  free(out);
+  return result;
+}
+
+/* Make room for more text in the line
+ * Parameters: struct line_editor *ed, size_t extra (bytes to be added)
+ * Returns: 0 on success, -1 if allocation failed */
+static int editor_reserve(struct line_editor *ed, size_t extra) {
+  if (ed->len + extra + 1 <= ed->cap) return 0;
+  size_t new_cap = ed->cap * 2;
+  while (new_cap < ed->len + extra + 1) new_cap *= 2;
+  char *grown = realloc(ed->buf, new_cap);
+  if (!grown) return -1;
+  ed->buf = grown;
+  ed->cap = new_cap;
+  return 0;
+}
+
+/* Insert text at the cursor and move the cursor past it
+ * Parameters: struct line_editor *ed, char const *text, size_t len
+ * Returns: 0 on success, -1 if allocation failed */
+static int editor_insert(struct line_editor *ed, char const *text, size_t len) {
+  if (editor_reserve(ed, len) != 0) return -1;
+  memmove(ed->buf + ed->cursor + len, ed->buf + ed->cursor, ed->len - ed->cursor + 1);
+  memcpy(ed->buf + ed->cursor, text, len);
+  ed->len += len;
+  ed->cursor += len;
+  return 0;
+}
+
+/* Delete the text between two positions, leaving the cursor where the text was
+ * Parameters: struct line_editor *ed, size_t from, size_t to
+ * Returns: nothing */
+static void editor_delete(struct line_editor *ed, size_t from, size_t to) {
+  memmove(ed->buf + from, ed->buf + to, ed->len - to + 1);
+  ed->len -= to - from;
+  ed->cursor = from;
+}
+
+/* Replace the whole line, with the cursor at its end
+ * Parameters: struct line_editor *ed, char const *text, size_t len
+ * Returns: 0 on success, -1 if allocation failed */
+static int editor_set(struct line_editor *ed, char const *text, size_t len) {
+  ed->len = ed->cursor = 0;
+  ed->buf[0] = '\0';
+  return editor_insert(ed, text, len);
+}
+
+/* Position of the character before or after the cursor, stepping over whole UTF-8 sequences
+ * Parameters: struct line_editor const *ed, bool forward
+ * Returns: the new position, or the cursor when it is already at that end of the line */
+static size_t editor_step(struct line_editor const *ed, bool forward) {
+  size_t pos = ed->cursor;
+  if (forward) {
+    if (pos < ed->len) pos++;
+    while (pos < ed->len && ((unsigned char) ed->buf[pos] & 0xC0) == 0x80) pos++;
+  } else {
+    if (pos > 0) pos--;
+    while (pos > 0 && ((unsigned char) ed->buf[pos] & 0xC0) == 0x80) pos--;
+  }
+  return pos;
+}
+
+/* Show an older or newer history entry, keeping the line being typed to come back to
+ * Parameters: struct line_editor *ed, bool older
+ * Returns: 0 on success (a bell when there is nothing to show), -1 on failure */
+static int editor_history_move(struct line_editor *ed, bool older) {
+  struct history *h = &ed->sh->history;
+  if (h->fd == -1) return editor_write("\a", 1);
+  if (ed->history_pos == SIZE_MAX) {
+    if (!older || history_refresh(h) != 0 || h->num_entries == 0) return editor_write("\a", 1);
+    free(ed->draft);
+    if (!(ed->draft = strdup(ed->buf))) return -1;
+    ed->history_pos = h->num_entries;
+  }
+  if (older && ed->history_pos == 0) return editor_write("\a", 1);
+  ed->history_pos += older ? -1 : 1;
+  size_t len;
+  if (ed->history_pos >= h->num_entries) {
+    ed->history_pos = SIZE_MAX;
+    if (editor_set(ed, ed->draft, strlen(ed->draft)) != 0) return -1;
+  } else {
+    char const *entry = history_entry(h, ed->history_pos, &len);
+    if (editor_set(ed, entry, len) != 0) return -1;
+  }
+  return editor_refresh(ed);
+}
+
+/* Find the next older history entry containing the search text, from a given entry down
+ * Parameters: struct line_editor *ed, size_t before (entries below this number are searched)
+ * Returns: 0 on success (a bell when nothing matches), -1 on failure */
+static int editor_search(struct line_editor *ed, size_t before) {
+  struct history *h = &ed->sh->history;
+  size_t found = history_search(h, ed->query, ed->query_len, false, before);
+  if (found == SIZE_MAX) return editor_write("\a", 1);
+  ed->history_pos = found;
+  size_t len;
+  char const *entry = history_entry(h, found, &len);
+  return editor_set(ed, entry, len);
+}
+
+/* Handle a key during a Ctrl-R search
+ * Parameters: struct line_editor *ed, int key
+ * Returns: 1 if the search handled the key, 0 if it ended and the key is to be handled as usual, -1 on failure */
+static int editor_search_key(struct line_editor *ed, int key) {
+  struct history *h = &ed->sh->history;
+  if (key == 18) { /* Ctrl-R: the next older match */
+    size_t before = ed->history_pos == SIZE_MAX ? h->num_entries : ed->history_pos;
+    if (ed->query_len > 0 && editor_search(ed, before) != 0) return -1;
+  } else if (key == 127 || key == 8) {
+    if (ed->query_len > 0) ed->query_len--;
+    ed->history_pos = SIZE_MAX;
+    if (ed->query_len > 0 && editor_search(ed, h->num_entries) != 0) return -1;
+  } else if (key == 7) { /* Ctrl-G: give up and go back to the line as it was */
+    ed->searching = false;
+    ed->history_pos = SIZE_MAX;
+    if (editor_set(ed, ed->draft, strlen(ed->draft)) != 0) return -1;
+  } else if (key >= 32 && key < 127 && ed->query_len < sizeof ed->query) {
+    // The current match stays if it still contains the longer text
+    ed->query[ed->query_len++] = key;
+    size_t before = ed->history_pos == SIZE_MAX ? h->num_entries : ed->history_pos + 1;
+    if (editor_search(ed, before) != 0) return -1;
+  } else {
+    ed->searching = false;
+    ed->history_pos = SIZE_MAX;
+    return 0;
+  }
+  return editor_refresh(ed) == 0 ? 1 : -1;
+}
+
+/* Collect the command names starting with a prefix: builtins and executables in PATH, merged in order
+ * Parameters: struct line_editor *ed, char const *prefix, struct glob_vec *found
+ * Returns: 0 on success, -1 on failure */
+static int editor_command_candidates(struct line_editor *ed, char const *prefix, struct glob_vec *found) {
+  struct exec_index *idx = &ed->exec_index;
+  if (exec_index_refresh(idx, &ed->sh->vars) != 0) return -1;
+  size_t prefix_len = strlen(prefix);
+  size_t b = 0, num_builtins = sizeof builtins / sizeof *builtins;
+  size_t e = exec_index_lower_bound(idx, prefix);
+  while (b < num_builtins && strncmp(builtins[b].name, prefix, prefix_len) < 0) b++;
+  for (;;) {
+    char const *builtin = b < num_builtins && strncmp(builtins[b].name, prefix, prefix_len) == 0 ? builtins[b].name : NULL;
+    char *exec = e < idx->count && strncmp(idx->names[e].name, prefix, prefix_len) == 0 ? idx->names[e].name : NULL;
+    if (!builtin && !exec) return 0;
+    int order = !builtin ? 1 : !exec ? -1 : strcmp(builtin, exec);
+    if (order <= 0) b++;
+    if (order >= 0) e++;
+    if (glob_vec_push(&ed->arena, found, order < 0 ? (char *) builtin : exec) != 0) return -1;
+  }
+}
+
+/* Collect the names in a directory starting with a prefix, with / after those that are directories
+ * Parameters: struct line_editor *ed, char const *dir (ending in /, or "" for the current directory),
+ *             char const *prefix (names starting with . are only offered when it starts with one),
+ *             struct glob_vec *found
+ * Returns: 0 on success, -1 on failure */
+static int editor_path_candidates(struct line_editor *ed, char const *dir, char const *prefix, struct glob_vec *found) {
+  struct glob_ctx ctx = { .arena = &ed->arena };
+  struct glob_dir *listing = glob_dir_get(&ctx, dir);
+  if (!listing) return -1;
+  size_t prefix_len = strlen(prefix);
+  for (size_t i = 0; i < listing->count; ++i) {
+    char const *name = listing->names[i];
+    if (strncmp(name, prefix, prefix_len) != 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+    if (name[0] == '.' && prefix[0] != '.') continue;
+    size_t name_len = strlen(name);
+    bool is_dir = listing->types[i] == DT_DIR;
+    if (listing->types[i] == DT_LNK || listing->types[i] == DT_UNKNOWN) {
+      char path[PATH_MAX];
+      struct stat st;
+      is_dir = snprintf(path, sizeof path, "%s%s", dir, name) < (int) sizeof path && stat(path, &st) == 0 &&
+               S_ISDIR(st.st_mode);
     }
-    
-    // Replace pattern with substitution and update orig_str_len to correct length
-    memmove(expanded_str + sub_len, expanded_str + pattern_len, orig_str_len + 1 - offset - pattern_len);
-    memcpy(expanded_str, sub, sub_len);
-    orig_str_len = orig_str_len + sub_len - pattern_len;
-    expanded_str += sub_len;
+    char *candidate = arena_alloc(&ed->arena, name_len + 2);
+    if (!candidate) return -1;
+    memcpy(candidate, name, name_len);
+    candidate[name_len] = '/';
+    candidate[name_len + is_dir] = '\0';
+    if (glob_vec_push(&ed->arena, found, candidate) != 0) return -1;
   }
+  qsort(found->items, found->count, sizeof *found->items, compare_strings);
+  return 0;
+}
 
-  expanded_str = *orig_str;
-  if (sub_len < pattern_len) {
-    expanded_str = realloc(*orig_str, sizeof **orig_str * (orig_str_len + 1));
-    if (!expanded_str) {  /* Error check realloc */
-      expanded_str = *orig_str;
-      goto str_gsub_return;
+/* Print completion candidates in columns below the line, then redraw the line
+ * Parameters: struct line_editor *ed, struct glob_vec const *found
+ * Returns: 0 on success, -1 on failure */
+static int editor_list(struct line_editor *ed, struct glob_vec const *found) {
+  if (editor_write("\n", 1) != 0) return -1;
+  if (found->count > EDITOR_LIST_MAX) {
+    char note[64];
+    int n = snprintf(note, sizeof note, "(%zu possibilities)\n", found->count);
+    if (editor_write(note, n) != 0) return -1;
+    return editor_refresh(ed);
+  }
+  struct winsize ws;
+  size_t width = ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+  size_t column = 0;
+  for (size_t i = 0; i < found->count; ++i) {
+    size_t len = editor_columns(found->items[i], strlen(found->items[i]));
+    if (len + 2 > column) column = len + 2;
+  }
+  size_t per_row = column < width ? width / column : 1;
+  size_t rows = (found->count + per_row - 1) / per_row;
+  // Down the columns, like ls
+  for (size_t row = 0; row < rows; ++row) {
+    for (size_t col = 0; col < per_row; ++col) {
+      size_t i = col * rows + row;
+      if (i >= found->count) break;
+      char const *item = found->items[i];
+      size_t len = strlen(item);
+      bool last = col + 1 == per_row || i + rows >= found->count;
+      if (editor_write(item, len) != 0) return -1;
+      for (size_t pad = editor_columns(item, len); !last && pad < column; ++pad) {
+        if (editor_write(" ", 1) != 0) return -1;
+      }
     }
-    *orig_str = expanded_str;
+    if (editor_write("\n", 1) != 0) return -1;
+  }
+  return editor_refresh(ed);
+}
+
+/* Complete the word before the cursor: a command name at the start of the line or after |, otherwise a path
+ * Parameters: struct line_editor *ed
+ * Returns: 0 on success, -1 on failure */
+static int editor_complete(struct line_editor *ed) {
+  size_t start = ed->cursor;
+  while (start > 0 && !isspace((unsigned char) ed->buf[start - 1]) && ed->buf[start - 1] != '|') start--;
+  size_t before = start;
+  while (before > 0 && isspace((unsigned char) ed->buf[before - 1])) before--;
+  bool command = before == 0 || ed->buf[before - 1] == '|';
+  // The target of an attached redirection such as 2>file is a path
+  size_t op = start;
+  while (op < ed->cursor && isdigit((unsigned char) ed->buf[op])) op++;
+  if (op < ed->cursor && strchr("<>&", ed->buf[op])) {
+    while (op < ed->cursor && strchr("<>&", ed->buf[op])) op++;
+    start = op;
+    command = false;
+  }
+
+  arena_reset(&ed->arena);
+  size_t word_len = ed->cursor - start;
+  char *word = arena_alloc(&ed->arena, word_len + 1);
+  if (!word) return -1;
+  memcpy(word, ed->buf + start, word_len);
+  word[word_len] = '\0';
+  char *slash = strrchr(word, '/');
+  struct glob_vec found = {0};
+  char const *base = word;
+  if (command && !slash) {
+    if (editor_command_candidates(ed, word, &found) != 0) return -1;
+  } else {
+    // The directory part is looked up as written, with a leading ~/ standing for HOME
+    base = slash ? slash + 1 : word;
+    size_t dir_len = base - word;
+    char const *home = word[0] == '~' && word[1] == '/' ? var_get(&ed->sh->vars, "HOME") : NULL;
+    size_t home_len = home ? strlen(home) : 0;
+    char *dir = arena_alloc(&ed->arena, home_len + dir_len + 1);
+    if (!dir) return -1;
+    if (home) sprintf(dir, "%s%.*s", home, (int) dir_len - 1, word + 1);
+    else sprintf(dir, "%.*s", (int) dir_len, word);
+    if (editor_path_candidates(ed, dir, base, &found) != 0) return -1;
   }
 
-str_gsub_return:
-  return expanded_str;
+  bool listing = ed->last_was_tab;
+  ed->last_was_tab = true;
+  if (found.count == 0) return editor_write("\a", 1);
+  size_t base_len = strlen(base), common = strlen(found.items[0]);
+  for (size_t i = 1; i < found.count; ++i) {
+    size_t same = 0;
+    while (same < common && found.items[i][same] == found.items[0][same]) same++;
+    common = same;
+  }
+  if (common > base_len || found.count == 1) {
+    if (editor_insert(ed, found.items[0] + base_len, common - base_len) != 0) return -1;
+    // A finished name is followed by a space, unless it is a directory that may go on
+    if (found.count == 1 && found.items[0][common - 1] != '/' && editor_insert(ed, " ", 1) != 0) return -1;
+    ed->last_was_tab = false;
+    return editor_refresh(ed);
+  }
+  return listing ? editor_list(ed, &found) : editor_write("\a", 1);
 }
 
-/* Signal handler for SIGINT that does nothing per project specs 
- * based on examples in CS344's signal handling modules
- * Parameters: int signal_no (signal number)
- * Returns: nothing */
-void handle_SIGINT(int signal_no) {
+/* Turn the bytes of an escape sequence into a key
+ * Parameters: struct line_editor *ed, unsigned char c (the next byte)
+ * Returns: the key, -1 while the sequence goes on, or 0 for a sequence that means nothing here */
+static int editor_escape(struct line_editor *ed, unsigned char c) {
+  if (ed->esc_state == 1) {
+    ed->esc_state = c == '[' || c == 'O' ? 2 : 0;
+    ed->esc_param = 0;
+    return ed->esc_state ? -1 : 0;
+  }
+  if (isdigit(c) || c == ';') {
+    ed->esc_param = c == ';' ? 0 : ed->esc_param * 10 + (c - '0'); /* Modifiers after ; are ignored */
+    return -1;
+  }
+  ed->esc_state = 0;
+  switch (c) {
+    case 'A': return 16; /* Up as Ctrl-P */
+    case 'B': return 14; /* Down as Ctrl-N */
+    case 'C': return 6;  /* Right as Ctrl-F */
+    case 'D': return 2;  /* Left as Ctrl-B */
+    case 'H': return 1;  /* Home as Ctrl-A */
+    case 'F': return 5;  /* End as Ctrl-E */
+    case '~':
+      if (ed->esc_param == 1 || ed->esc_param == 7) return 1;
+      if (ed->esc_param == 4 || ed->esc_param == 8) return 5;
+      if (ed->esc_param == 3) return KEY_DELETE;
+      return 0;
+    default: return 0;
+  }
 }
 
-/* Send all children processes in same process group a SIGINT signal prior to exiting
- * Parameters: None
- * Returns: 0 on success, -1 if an error occurred */
-int handle_child_procs_exit(void) {
-  pid_t proc_pid;
-  int proc_status;
-  while ((proc_pid = waitpid(0, &proc_status, WUNTRACED | WCONTINUED | WNOHANG)) > 0) {
-    if (kill(proc_pid, SIGINT) == -1) err(errno, "Unable to send SIGINT signal");
+/* Handle one byte from the terminal
+ * Parameters: struct line_editor *ed, unsigned char c
+ * Returns: 0 to read on, 1 when the line is finished, 2 at end of input, -1 on failure */
+static int editor_byte(struct line_editor *ed, unsigned char c) {
+  int key = c;
+  if (ed->esc_state) {
+    if ((key = editor_escape(ed, c)) <= 0) return 0;
+  } else if (c == 27) {
+    ed->esc_state = 1;
+    return 0;
+  }
+  if (key != 9) ed->last_was_tab = false;
+  if (ed->searching) {
+    int handled = editor_search_key(ed, key);
+    if (handled != 0) return handled == 1 ? 0 : -1;
+  }
+
+  size_t pos;
+  switch (key) {
+    case '\r':
+    case '\n':
+      ed->cursor = ed->len;
+      if (editor_refresh(ed) != 0 || editor_write("\n", 1) != 0) return -1;
+      return 1;
+    case 4: /* Ctrl-D: end of input on an empty line, otherwise delete */
+      if (ed->len == 0) return 2;
+      /* Fall through */
+    case KEY_DELETE:
+      if (ed->cursor == ed->len) return 0;
+      editor_delete(ed, ed->cursor, editor_step(ed, true));
+      break;
+    case 127:
+    case 8: /* Backspace */
+      if (ed->cursor == 0) return 0;
+      pos = ed->cursor;
+      editor_delete(ed, editor_step(ed, false), pos);
+      break;
+    case 1: ed->cursor = 0; break;
+    case 5: ed->cursor = ed->len; break;
+    case 2: ed->cursor = editor_step(ed, false); break;
+    case 6: ed->cursor = editor_step(ed, true); break;
+    case 11: editor_delete(ed, ed->cursor, ed->len); break;
+    case 21: editor_delete(ed, 0, ed->cursor); break;
+    case 23: /* Ctrl-W: delete the word before the cursor */
+      pos = ed->cursor;
+      while (pos > 0 && isspace((unsigned char) ed->buf[pos - 1])) pos--;
+      while (pos > 0 && !isspace((unsigned char) ed->buf[pos - 1])) pos--;
+      editor_delete(ed, pos, ed->cursor);
+      break;
+    case 12: /* Ctrl-L: clear the screen */
+      if (editor_write("\x1b[H\x1b[2J", 7) != 0) return -1;
+      break;
+    case 16: return editor_history_move(ed, true) == 0 ? 0 : -1;
+    case 14: return editor_history_move(ed, false) == 0 ? 0 : -1;
+    case 18: /* Ctrl-R: search the history */
+      if (ed->sh->history.fd == -1 || history_refresh(&ed->sh->history) != 0) return editor_write("\a", 1) == 0 ? 0 : -1;
+      free(ed->draft);
+      if (!(ed->draft = strdup(ed->buf))) return -1;
+      ed->searching = true;
+      ed->query_len = 0;
+      ed->history_pos = SIZE_MAX;
+      break;
+    case 9: return editor_complete(ed) == 0 ? 0 : -1;
+    default:
+      if (key < 32) return 0;
+      // Typing at the end of the line only needs the character echoed
+      if (ed->cursor == ed->len) {
+        char byte = key;
+        if (editor_insert(ed, &byte, 1) != 0) return -1;
+        return editor_write(&byte, 1) == 0 ? 0 : -1;
+      }
+      char byte = key;
+      if (editor_insert(ed, &byte, 1) != 0) return -1;
+      break;
+  }
+  return editor_refresh(ed) == 0 ? 0 : -1;
+}
+
+/* line_reader edit hook: read a line from the terminal with editing
+ * Parameters: void *arg (struct line_editor *), char const *prompt (already printed), char **line (set to the
+ *             line, valid until the next call)
+ * Returns: length of the line, or -1 at end of input (errno 0), when a signal interrupted it (errno EINTR) or on
+ *          failure */
+static ssize_t editor_read_line(void *arg, char const *prompt, char **line) {
+  struct line_editor *ed = arg;
+  struct termios cooked, raw;
+  if (tcgetattr(STDIN_FILENO, &cooked) == -1) return -1;
+  raw = cooked;
+  raw.c_iflag &= ~(ICRNL | INLCR | IGNCR | IXON);
+  raw.c_lflag &= ~(ICANON | ECHO | IEXTEN); /* ISIG stays, so Ctrl-C still interrupts the read */
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) == -1) return -1;
+
+  char const *last_line = strrchr(prompt, '\n');
+  ed->prompt = last_line ? last_line + 1 : prompt;
+  ed->len = ed->cursor = 0;
+  ed->buf[0] = '\0';
+  ed->esc_state = 0;
+  ed->last_was_tab = ed->searching = false;
+  ed->history_pos = SIZE_MAX;
+  int result = 0;
+  while (result == 0) {
+    if (ed->pending_start == ed->pending_end) {
+      // Children are reaped and job logs drained while waiting for a key
+      if (wait_for_events(ed->sh, STDIN_FILENO) == -1) {
+        result = -1;
+        break;
+      }
+      ssize_t got = read(STDIN_FILENO, ed->pending, sizeof ed->pending);
+      if (got <= 0) {
+        result = got == 0 ? 2 : -1;
+        break;
+      }
+      ed->pending_start = 0;
+      ed->pending_end = got;
+    }
+    result = editor_byte(ed, ed->pending[ed->pending_start++]);
+  }
+
+  int saved_errno = errno;
+  tcsetattr(STDIN_FILENO, TCSANOW, &cooked);
+  errno = saved_errno;
+  if (result == 1) {
+    *line = ed->buf;
+    return ed->len;
+  }
+  if (result == 2) errno = 0;
+  return -1;
+}
+
+/* Resident server mode (smallsh -S socket). One long-lived shell listens on a UNIX seqpacket socket and
+ * multiplexes its connections in the event loop. Each message on a connection is a command line carrying the
+ * client's stdin, stdout and stderr as SCM_RIGHTS. The server forks a worker for it, which takes those fds as
+ * 0, 1 and 2 and runs the line as -c would, so nothing but the fork is paid per command; the worker's exit
+ * status is sent back to the client as an int. A connection has one request in flight at a time. */
+#define SERVER_REQUEST_FDS 3
+
+struct server_conn {
+  bool open;
+  pid_t worker; /* Worker running the connection's request, 0 when idle */
+};
+
+struct server {
+  int listen_fd;
+  int signal_fd;            /* SIGTERM, SIGINT and SIGHUP, which shut the server down */
+  sigset_t stop_set;
+  struct server_conn *conns; /* Indexed by connection fd */
+  size_t conns_cap;
+  struct job_table workers;  /* Only its pid index is used, mapping each running worker to its connection fd */
+};
+
+/* Bind and listen on a UNIX seqpacket socket, replacing a socket file left behind by a server that is gone
+ * Parameters: char const *path
+ * Returns: the nonblocking listening socket, or -1 on failure */
+static int server_listen(char const *path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof addr.sun_path) {
+    errno = ENAMETOOLONG;
     return -1;
   }
+  strcpy(addr.sun_path, path);
+  int fd = move_fd_high(socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+  if (fd == -1) return -1;
+  int bound = bind(fd, (struct sockaddr *) &addr, sizeof addr);
+  if (bound == -1 && errno == EADDRINUSE) {
+    // Nothing accepts on a stale socket file, so connecting to it is refused
+    int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    bool stale = probe != -1 && connect(probe, (struct sockaddr *) &addr, sizeof addr) == -1 && errno == ECONNREFUSED;
+    if (probe != -1) close(probe);
+    if (stale && unlink(path) == 0) bound = bind(fd, (struct sockaddr *) &addr, sizeof addr);
+    else errno = EADDRINUSE;
+  }
+  if (bound == -1 || listen(fd, SOMAXCONN) == -1) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return fd;
+}
+
+/* Watch an fd for input in the shell's epoll instance
+ * Parameters: struct shell_state *sh, int fd
+ * Returns: 0 on success, -1 on failure */
+static int server_watch(struct shell_state *sh, int fd) {
+  struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+  return epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* Close a connection, leaving any worker running its request to finish unreported
+ * Parameters: struct shell_state *sh, struct server *server, int fd
+ * Returns: nothing */
+static void server_close_conn(struct shell_state *sh, struct server *server, int fd) {
+  if (!server->conns[fd].worker) epoll_ctl(sh->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  else job_index_remove(&server->workers, server->conns[fd].worker); /* The fd may be reused before it exits */
+  close(fd);
+  server->conns[fd] = (struct server_conn) {0};
+}
+
+/* Accept every pending connection
+ * Parameters: struct shell_state *sh, struct server *server
+ * Returns: 0 on success, -1 on failure */
+static int server_accept(struct shell_state *sh, struct server *server) {
+  int fd;
+  while ((fd = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+    if ((size_t) fd >= server->conns_cap) {
+      size_t new_cap = server->conns_cap ? server->conns_cap * 2 : 64;
+      while (new_cap <= (size_t) fd) new_cap *= 2;
+      struct server_conn *grown = realloc(server->conns, sizeof *grown * new_cap);
+      if (!grown) {
+        close(fd);
+        return -1;
+      }
+      memset(grown + server->conns_cap, 0, sizeof *grown * (new_cap - server->conns_cap));
+      server->conns = grown;
+      server->conns_cap = new_cap;
+    }
+    if (server_watch(sh, fd) == -1) {
+      close(fd);
+      return -1;
+    }
+    server->conns[fd] = (struct server_conn) { .open = true };
+  }
+  // Running out of descriptors or a connection reset before it was accepted only costs that connection
+  if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+    errno = 0;
+    return 0;
+  }
+  return -1;
+}
+
+/* Send a request's exit status to its client, closing the connection if the client has gone
+ * Parameters: struct shell_state *sh, struct server *server, int fd, int status (exit status)
+ * Returns: 0 on success, -1 on failure */
+static int server_reply(struct shell_state *sh, struct server *server, int fd, int status) {
+  if (send(fd, &status, sizeof status, MSG_NOSIGNAL) != (ssize_t) sizeof status) {
+    server_close_conn(sh, server, fd);
+    errno = 0;
+    return 0;
+  }
+  // A connection stops being watched while a worker runs its request
+  bool was_running = server->conns[fd].worker != 0;
+  server->conns[fd].worker = 0;
+  return was_running ? server_watch(sh, fd) : 0;
+}
+
+/* Turn a forked child into the worker for a request: drop the server's descriptors and signal handling, set up
+ * the worker's own event loop and install the client's fds as stdin, stdout and stderr
+ * Parameters: struct shell_state *sh, struct server *server, int const *fds (the client's, 10 or above)
+ * Returns: 0 on success, -1 on failure */
+static int server_become_worker(struct shell_state *sh, struct server *server, int const *fds) {
+  close(server->listen_fd);
+  close(server->signal_fd);
+  for (size_t i = 0; i < server->conns_cap; ++i) {
+    if (server->conns[i].open) close(i);
+  }
+  free(server->conns);
+  free(server->workers.index);
+  close(sh->epoll_fd);
+  close(sh->sigchld_fd);
+  if (sigprocmask(SIG_SETMASK, &sh->orig_sigmask, NULL) != 0) return -1;
+  if (events_init(sh) != 0) return -1;
+  // The trace file is the server's: a worker writing to it, or closing a Chrome trace's array, would corrupt it
+  free(sh->trace.slots);
+  sh->trace.slots = NULL;
+  close(sh->trace.fd);
+  sh->trace.fd = -1;
+  for (int i = 0; i < SERVER_REQUEST_FDS; ++i) {
+    if (dup2(fds[i], i) == -1) return -1;
+    close(fds[i]);
+  }
+  return 0;
+}
+
+/* Receive a request and fork a worker to run it
+ * Parameters: struct shell_state *sh, struct server *server, int fd (connection with input ready),
+ *             char **line (set in the worker to the request's command line)
+ * A malformed request, or one no worker could be forked for, is answered with status 2.
+ * Returns: 0 in the server, 1 in the worker, -1 on failure */
+static int server_request(struct shell_state *sh, struct server *server, int fd, char **line) {
+  ssize_t len = recv(fd, NULL, 0, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+  if (len <= 0) {
+    // Zero bytes is the end of the connection, as a client never sends an empty request
+    if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) server_close_conn(sh, server, fd);
+    errno = 0;
+    return 0;
+  }
+
+  char *request = malloc(len + 1);
+  if (!request) return -1;
+  union {
+    char buf[CMSG_SPACE(sizeof (int) * SERVER_REQUEST_FDS)];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = request, .iov_len = len };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof control.buf };
+  ssize_t received = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+  if (received == -1) {
+    free(request);
+    server_close_conn(sh, server, fd);
+    errno = 0;
+    return 0;
+  }
+  request[received] = '\0';
+  trace_event(&sh->trace, TRACE_LINE_READ, 0, NULL, received);
+
+  int fds[SERVER_REQUEST_FDS];
+  size_t num_fds = 0;
+  bool well_formed = !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC));
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+    for (size_t i = 0; i < count; ++i) {
+      int received_fd;
+      memcpy(&received_fd, CMSG_DATA(cmsg) + i * sizeof (int), sizeof (int));
+      if (num_fds == SERVER_REQUEST_FDS) {
+        close(received_fd);
+        well_formed = false;
+      } else if ((fds[num_fds++] = move_fd_high(received_fd)) == -1) {
+        well_formed = false;
+      }
+    }
+  }
+
+  pid_t worker = -1;
+  if (well_formed && num_fds == SERVER_REQUEST_FDS && (worker = fork()) == 0) {
+    if (server_become_worker(sh, server, fds) != 0) err(errno, "Unable to start a worker");
+    *line = request;
+    return 1;
+  }
+  int fork_errno = errno;
+  free(request);
+  for (size_t i = 0; i < num_fds; ++i) {
+    if (fds[i] != -1) close(fds[i]);
+  }
+  if (worker == -1) {
+    if (well_formed && num_fds == SERVER_REQUEST_FDS &&
+        fprintf(stderr, "smallsh: cannot fork a worker: %s\n", strerror(fork_errno)) < 0) return -1;
+    errno = 0;
+    return server_reply(sh, server, fd, 2);
+  }
+
+  trace_event(&sh->trace, TRACE_FORK, worker, NULL, 0);
+  if (job_index_add(&server->workers, worker, fd) != 0) return -1;
+  server->conns[fd].worker = worker;
+  // The connection is not read again until its request has been answered
+  return epoll_ctl(sh->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* Reap finished workers and answer their requests
+ * Parameters: struct shell_state *sh, struct server *server
+ * Returns: 0 on success, -1 on failure */
+static int server_reap(struct shell_state *sh, struct server *server) {
+  struct signalfd_siginfo info[16];
+  while (read(sh->sigchld_fd, info, sizeof info) > 0); /* SIGCHLD coalesces, so the contents do not matter */
+
+  pid_t worker;
+  int status;
+  while ((worker = waitpid(-1, &status, WNOHANG)) > 0) {
+    int exit_code = status_to_exit_code(status);
+    trace_event(&sh->trace, TRACE_REAP, worker, NULL, exit_code);
+    // A worker whose connection has closed is no longer in the index
+    if (server->workers.index_cap == 0) continue;
+    struct job_index_entry *entry = job_index_entry(&server->workers, worker);
+    if (entry->pid == 0) continue;
+    int fd = (int) entry->slot;
+    job_index_remove(&server->workers, worker);
+    if (server_reply(sh, server, fd, exit_code) != 0) return -1;
+  }
+  if (worker == -1 && errno != ECHILD) return -1;
+  errno = 0;
   return 0;
 }
 
-static void cleanup_memory(size_t number_tokens, char **word_tokens_array, char *restrict user_inpt_line, char *restrict input_filename, char *restrict output_filename) {
-  if (input_filename != NULL) free(input_filename);
-  if (output_filename != NULL) free(output_filename);
-  if (word_tokens_array && number_tokens > 0) free_word_tokens(word_tokens_array, number_tokens);
-  if (user_inpt_line != NULL) free(user_inpt_line);
+/* Serve requests on a UNIX socket until SIGTERM, SIGINT or SIGHUP arrives
+ * Parameters: struct shell_state *sh (with the event loop set up), char const *path (socket to create),
+ *             char **line (set in a worker to the command line it is to run)
+ * Returns: 1 in a worker, 0 in the server once it has shut down, -1 on failure */
+static int server_run(struct shell_state *sh, char const *path, char **line) {
+  struct server server = { .listen_fd = -1, .signal_fd = -1 };
+  sigemptyset(&server.stop_set);
+  sigaddset(&server.stop_set, SIGTERM);
+  sigaddset(&server.stop_set, SIGINT);
+  sigaddset(&server.stop_set, SIGHUP);
+  if (sigprocmask(SIG_BLOCK, &server.stop_set, NULL) != 0) return -1;
+  if ((server.signal_fd = move_fd_high(signalfd(-1, &server.stop_set, SFD_NONBLOCK | SFD_CLOEXEC))) == -1) return -1;
+  if ((server.listen_fd = server_listen(path)) == -1) {
+    int saved_errno = errno;
+    close(server.signal_fd);
+    errno = saved_errno;
+    return -1;
+  }
+
+  int result = 0;
+  if (server_watch(sh, server.listen_fd) != 0 || server_watch(sh, server.signal_fd) != 0) result = -1;
+  for (bool stopping = false; result == 0 && !stopping;) {
+    struct epoll_event events[32];
+    int num_ready = epoll_wait(sh->epoll_fd, events, 32, -1);
+    if (num_ready == -1) {
+      if (errno == EINTR) continue;
+      result = -1;
+    }
+    for (int i = 0; result == 0 && i < num_ready; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == server.signal_fd) {
+        stopping = true;
+      } else if (fd == sh->sigchld_fd) {
+        result = server_reap(sh, &server);
+      } else if (fd == server.listen_fd) {
+        result = server_accept(sh, &server);
+      } else if ((size_t) fd < server.conns_cap && server.conns[fd].open && !server.conns[fd].worker) {
+        result = server_request(sh, &server, fd, line);
+        if (result == 1) return 1;
+      }
+    }
+  }
+
+  int saved_errno = errno;
+  unlink(path);
+  close(server.listen_fd);
+  close(server.signal_fd);
+  for (size_t fd = 0; fd < server.conns_cap; ++fd) {
+    if (server.conns[fd].open) close(fd);
+  }
+  free(server.conns);
+  free(server.workers.index);
+  errno = saved_errno;
+  return result;
 }
 
-int main(void) {
+/* The benchmark harness (bench.c) includes this file with SMALLSH_NO_MAIN defined to reach the functions above */
+#ifndef SMALLSH_NO_MAIN
+int main(int argc, char *argv[]) {
   // Variables that must maintain value and access outside of main loop
-  size_t max_len_buff = 30; /* For creating a large enough buffer as needed */
-  size_t n = 0; /* For holding allocated size of line var */
-  size_t num_tokens = 0;
-  pid_t shell_pid = getpid();
+  // Non-interactive mode (smallsh script, smallsh -c command) skips the prompt and the SIGINT toggling around
+  // each read, and reads its input through a line_reader
+  bool interactive = true;
+  struct line_reader reader = { .fd = -1 };
+  struct line_editor editor = { .exec_index = { .inotify_fd = -1 } };
   pid_t last_bg_proc_pid = 0; /* Used for $! expansion. */
+  struct shell_state sh = { .launch_mode = get_launch_mode(), .trace = { .fd = -1 }, .history = { .fd = -1 } };
+  char const *pipe_size_str = getenv("SMALLSH_PIPE_SIZE"); /* Bytes per pipeline pipe, applied with F_SETPIPE_SZ */
+  if (pipe_size_str) sh.pipe_size = atoi(pipe_size_str);
+  char const *dump_stats_str = getenv("SMALLSH_STATS"); /* Print the resource statistics when the shell exits */
+  sh.dump_stats = dump_stats_str && *dump_stats_str && strcmp(dump_stats_str, "0") != 0;
   int last_fg_exit_status = 0; /* Used for $? expansion.  Default is 0. */
 
-  char const *restrict ifs_str = "IFS"; /* Environment variable name for getting value of delimiter characters. Used for word splitting. */
   char const *restrict prompt_str = "PS1"; /* Environment variable name for getting value of PS1 variable. Used for PS1 expansino. */
-  char *line = NULL;
-  char **word_tokens = NULL;
+  char *input_line = NULL; /* Line being parsed, split in place in the reader's buffer */
+  ssize_t line_length = 0;
+  struct arena line_arena = {0}; /* Holds the words, stages and redirection filenames of one line */
+  struct expand_ctx expand = { .vars = &sh.vars };
+  struct builtin_ctx builtin_ctx = {
+    .sh = &sh, .reader = &reader, .line_arena = &line_arena, .expand = &expand,
+    .last_fg_exit_status = &last_fg_exit_status, .last_bg_proc_pid = &last_bg_proc_pid,
+  };
+  expand.exec = &builtin_ctx;
+  char const *server_path = NULL; /* Socket to serve requests on with -S */
+
+  if (argc == 3 && strcmp(argv[1], "-c") == 0) {
+    interactive = false;
+    reader_open_string(&reader, argv[2]);
+  } else if (argc == 2 && argv[1][0] != '-') {
+    interactive = false;
+    int script_fd = move_fd_high(open(argv[1], O_RDONLY | O_CLOEXEC));
+    if (script_fd == -1) {
+      fprintf(stderr, "smallsh: cannot open %s: %s\n", argv[1], strerror(errno));
+      return 127;
+    }
+    if (reader_open_fd(&reader, script_fd) != 0) goto exit;
+  } else if (argc == 3 && strcmp(argv[1], "-S") == 0) {
+    interactive = false;
+    server_path = argv[2];
+  } else if (argc != 1) {
+    fprintf(stderr, "Usage: smallsh [-c command | -S socket | script]\n");
+    return 2;
+  }
 
   // Setting up sigaction structs and initial signal handling based on and adapted from
   // Linux Programming Interface chaps. 20 and 21, esp. 20.13 and listing 21-1
   struct sigaction SIGINT_sa;
-  struct sigaction SIGINT_init_disp_sa;
   struct sigaction SIGTSTP_sa;
-  struct sigaction SIGTSTP_init_disp_sa;
 
   if (sigemptyset(&SIGINT_sa.sa_mask) != 0) goto exit;
   if (sigemptyset(&SIGTSTP_sa.sa_mask) != 0) goto exit;
@@ -123,491 +6766,206 @@ int main(void) {
   
   // Set SIGINT handler and record initial disposition of SIGINT
   SIGINT_sa.sa_handler = handle_SIGINT; 
-  if (sigaction(SIGINT, &SIGINT_sa, &SIGINT_init_disp_sa) == -1) goto exit;
+  if (sigaction(SIGINT, &SIGINT_sa, &sh.SIGINT_init_disp_sa) == -1) goto exit;
   
   // Set SIGTSTP to be ignored and record initial disposition of SIGTSTP
   SIGTSTP_sa.sa_handler = SIG_IGN;
-  if (sigaction(SIGTSTP, &SIGTSTP_sa, &SIGTSTP_init_disp_sa) != 0) goto exit; /* SIGTSTP should always be ignored */
+  if (sigaction(SIGTSTP, &SIGTSTP_sa, &sh.SIGTSTP_init_disp_sa) != 0) goto exit; /* SIGTSTP should always be ignored */
 
-  // Explicitly set errno to 0 at start
-  errno = 0;
+  // The shell's pid never changes, so $$ is formatted once
+  if (snprintf(expand.shell_pid, sizeof expand.shell_pid, "%jd", (intmax_t) getpid()) < 0) goto exit;
 
-  for (;;) {
-    // Set SIGINT to be ignored prior to calling getline
-    SIGINT_sa.sa_handler = SIG_IGN;
-    if (sigaction(SIGINT, &SIGINT_sa, NULL) != 0) goto exit;
-    
-    /*
-     * MANAGE BACKGROUND PROCESSES
-     */
-    pid_t child_proc_pid = 0; /* To hold pid of unwaited-for background process */
-    int child_proc_status = 0; /* To hold exit status or signal of unwaited-for backgorund process*/
-    
-    // Checking for child process status based on CS344 modules and Linux Programming Interface text
-    while ((child_proc_pid = waitpid(0, &child_proc_status, WUNTRACED | WNOHANG | WCONTINUED)) > 0) {
-      if (WIFEXITED(child_proc_status)) {
-        if (fprintf(stderr, "Child process %jd done. Exit status %d.\n", (intmax_t) child_proc_pid, WEXITSTATUS(child_proc_status)) < 0) goto exit;
-      } else if (WIFSIGNALED(child_proc_status)) {
-        if (fprintf(stderr, "Child process %jd done. Signaled %d.\n", (intmax_t) child_proc_pid, WTERMSIG(child_proc_status)) < 0) goto exit;
-      } else if (WIFSTOPPED(child_proc_status)) {
-        if (kill(child_proc_pid, SIGCONT) == -1) err(errno, "Unable to send SIGCONT signal");
-        if (fprintf(stderr, "Child process %jd stopped. Continuing.\n", (intmax_t) child_proc_pid) < 0) goto exit;
-      }
-    }
-    
-    // Checking errno taken from Linux Programming Interface wait example, chap. 26
-    // ECHILD indicates there were no unwaited for processes
-    if (errno != ECHILD && errno != 0) goto exit;
-    // Reset errno to remove ECHILD error if it exists
-    errno = 0;
+  // Non-interactive shells ignore SIGINT throughout instead of toggling it around every read
+  SIGINT_sa.sa_handler = SIG_IGN;
+  if (!interactive && sigaction(SIGINT, &SIGINT_sa, NULL) != 0) goto exit;
 
-    /*
-     * PS1 EXPANSIONS/PROMPT DISPLAY
-     */
-    char *prompt = NULL; /* Prompt should not persist through loop iterations. Retrieve on each iteration. */
-    char *temp_prompt = getenv(prompt_str); /* Avoid accidentally overwriting PS1 value. */
-    if (!temp_prompt) {
-      prompt = ""; /* PS1 default value is an empty string */
-    } else {
-      prompt = temp_prompt;
+  if (var_store_import(&sh.vars, environ) != 0) goto exit;
+  if (events_init(&sh) != 0) goto exit;
+  if (trace_open(&sh.trace) != 0) {
+    if (fprintf(stderr, "smallsh: cannot trace to %s: %s\n", getenv("SMALLSH_TRACE"), strerror(errno)) < 0) goto exit;
+    trace_close(&sh.trace);
+    errno = 0;
+  }
+  if (server_path) {
+    // Only forked workers return from serving, each with a request to run like the argument to -c
+    char *request = NULL;
+    int served = server_run(&sh, server_path, &request);
+    if (served == -1) {
+      fprintf(stderr, "smallsh: cannot serve on %s: %s\n", server_path, strerror(errno));
+      trace_close(&sh.trace);
+      return 1;
     }
-    if (fprintf(stderr, "%s", prompt) < 0) goto exit;
-    
-    /*
-     * READ A LINE OF INPUT FROM STDIN
-     */
-    // Set signal handler for SIGINT for correct functionality during getline call
-    SIGINT_sa.sa_handler = handle_SIGINT;
-    if (sigaction(SIGINT, &SIGINT_sa, NULL) != 0) goto exit;
-    ssize_t line_length = getline(&line, &n, stdin);
-    
-    // If signal interrupted during getline, clear errno, print a new line, and reprompt
-    if (errno == EINTR) {
-      clearerr(stdin);
-      errno = 0;
-      if (fprintf(stderr, "\n") < 0) goto exit;
-      continue;
+    if (served == 0) {
+      dump_stats_at_exit(&sh);
+      trace_close(&sh.trace);
+      return 0;
     }
-
-    // After getline call ignore SIGINT
-    SIGINT_sa.sa_handler = SIG_IGN;
-    if (sigaction(SIGINT, &SIGINT_sa, NULL) != 0) goto exit;
-
-    // Clear EOF and error indicators for stdin if EOF encountered, exit smallsh
-    if (feof(stdin) != 0) {
-      clearerr(stdin); /* Per man pages clearerr should not fail */
-      if (handle_child_procs_exit() != 0) {
-        fprintf(stderr, "An error occurred while signaling child processes\n");
-        goto exit;
-      }
-      if (!last_fg_exit_status) last_fg_exit_status = 0;
-      if (fprintf(stderr, "\nexit\n") < 0) goto exit;
-      free(line);
-      exit(last_fg_exit_status);
+    reader_open_string(&reader, request);
+    if (snprintf(expand.shell_pid, sizeof expand.shell_pid, "%jd", (intmax_t) getpid()) < 0) goto exit;
+  }
+  if (interactive) {
+    // Interactive input is read directly from stdin, waiting in the event loop so children are reaped meanwhile
+    if (reader_open_fd(&reader, STDIN_FILENO) != 0) goto exit;
+    reader.wait_input = wait_for_input;
+    reader.wait_arg = &sh;
+    // A terminal gets the line editor; anything else, or a terminal that cannot move the cursor, is read as is
+    char const *term = getenv("TERM");
+    if (isatty(STDIN_FILENO) && isatty(STDERR_FILENO) && !(term && strcmp(term, "dumb") == 0)) {
+      if (editor_open(&editor, &sh) != 0) goto exit;
+      reader.edit_line = editor_read_line;
+      reader.edit_arg = &editor;
     }
-    
-    if (line_length == -1 && errno != EOF) goto exit;
-    // Reset errno in case EOF was encountered when reading from stdin
-    errno = 0;
-    
-    /* 
-     * WORD SPLITTING
-     */
-    // Get IFS environment variable value and set delimiter for use in strtok
-    char *word_delim = NULL; /* Delimiter should not persist through loop iterations. */
-    char *temp_delim = getenv(ifs_str); /* Avoid accidentally overwriting IFS value. */
-    if (!temp_delim) {
-      word_delim = " \t\n"; /* Set delimiter to default of IFS is null */
-    } else {
-      word_delim = temp_delim;
+    if (history_open(&sh.history, &sh.vars) != 0) {
+      if (fprintf(stderr, "smallsh: history is off: %s\n", strerror(errno)) < 0) goto exit;
+      errno = 0;
     }
+  }
 
-    // Split line into words on the given delimiters
-    char *token = strtok(line, word_delim);
-    char *dup_token = NULL;
-    
-    if (!token) continue; /* If there were no words to split, go back to beginning of loop and display prompt. Num_tokens == 0 at this point. Do not reset. */
-    dup_token = strdup(token);
-    if (!dup_token) goto exit; /* Error check strdup. No need to free dup_token on failure. */
-      
-    word_tokens = malloc(sizeof (char **[num_tokens + 1])); /* allocate space in tokens; taken from example in Modern C */
-    if (!word_tokens) { /* Error check malloc and free dup_token if error exists */
-      free(dup_token);
-      goto exit;
-    }
-    
-    word_tokens[num_tokens] = dup_token;
-    num_tokens++;
+  builtin_ctx.interactive = interactive;
 
-    for (;;) {
-      token = strtok(NULL, word_delim);
-      if (!token) break;
-      
-      dup_token = strdup(token);
-      if (!dup_token) goto exit;
+  // Explicitly set errno to 0 at start
+  errno = 0;
 
-      word_tokens = realloc(word_tokens, sizeof (char **[num_tokens + 1])); /* Make sure there is enough space in word_tokens for new pointer */
-      if (!word_tokens) {
-        free(dup_token);
-        goto exit; /* Error checks realloc? Will this lead to losing access to word_tokens if realloc fails? */
-      }
+  for (;;) {
+    // Release everything allocated for the previous line in one step
+    arena_reset(&line_arena);
 
-      word_tokens[num_tokens] = dup_token; /* Add pointer to new_token to word_tokens */
-      num_tokens++;
-    }
+    // Set SIGINT to be ignored prior to calling getline
+    SIGINT_sa.sa_handler = SIG_IGN;
+    if (interactive && sigaction(SIGINT, &SIGINT_sa, NULL) != 0) goto exit;
     
     /*
-     * ENVIRONMENT VARIABLE EXPANSION
+     * MANAGE BACKGROUND PROCESSES
      */
-    for (size_t i = 0; i < num_tokens; ++i) {
-      char *target_pattern = NULL;
-      char *substitution = NULL;
-      char *temp_sub = NULL;
-      // Expand ~/ instances only if ~/ appears at beginning of word
-      if (word_tokens[i][0] == 126 && word_tokens[i][1] == 47) {
-        target_pattern = "~";
-        temp_sub = getenv("HOME");
-
-        if (!temp_sub) {
-          substitution = "";
-        } else {
-          substitution = strdup(temp_sub);
-          if (!substitution) goto exit;
-        }
-        word_tokens[i] = str_gsub(&word_tokens[i], target_pattern, substitution);
-      
-        free(substitution);
-        if (errno != 0) goto exit;
-      }
+    // Children are reaped by the event loop as they exit; pick up any stragglers and report what was collected
+    if (reap_children(&sh) != 0) goto exit;
+    if (report_child_events(&sh) != 0) goto exit;
+    if (job_logs_poll(&sh) != 0) goto exit;
 
-      // Expand $$ instances
-      target_pattern = "$$";
-      char proc_pid_as_str[max_len_buff];
-      char *sub2 = NULL;
-      memset(proc_pid_as_str, '\0', max_len_buff);
-      if (snprintf(proc_pid_as_str, max_len_buff-1, "%jd", (intmax_t) shell_pid) < 0) goto exit;
-      sub2 = proc_pid_as_str;
-      word_tokens[i] = str_gsub(&word_tokens[i], target_pattern, sub2);
-      if (errno != 0) goto exit;
-
-      // Expand $? instances
-      target_pattern = "$?";
-      char exit_status_as_str[max_len_buff];
-      char *sub3 = NULL;
-      memset(exit_status_as_str, '\0', max_len_buff);
-      if (snprintf(exit_status_as_str, max_len_buff-1, "%d", last_fg_exit_status) < 0) goto exit;
-      sub3 = exit_status_as_str;
-      word_tokens[i] = str_gsub(&word_tokens[i], target_pattern, sub3);
-      if (errno != 0) goto exit;
-
-      // Expand $! instances
-      target_pattern = "$!";
-      char *sub4 = NULL;
-      if (last_bg_proc_pid != 0) {
-        sub4 = "";
-        char last_bg_proc_pid_str[max_len_buff];
-        memset(last_bg_proc_pid_str, '\0', max_len_buff);
-        if (snprintf(last_bg_proc_pid_str, max_len_buff-1, "%d", last_bg_proc_pid) < 0) goto exit;
-        sub4 = last_bg_proc_pid_str;
-      
-        word_tokens[i] = str_gsub(&word_tokens[i], target_pattern, sub4);
+    if (!interactive) {
+      /*
+       * READ A LINE OF INPUT FROM THE SCRIPT OR -c STRING
+       */
+      line_length = reader_next_line(&reader, &input_line);
+      if (line_length == -1) {
         if (errno != 0) goto exit;
-      } else { /* pid of 0 indicates last_bg_proc_pid has not been set yet, default for $! is an empty string */
-        sub4 = "";
-        word_tokens[i] = str_gsub(&word_tokens[i], target_pattern, sub4);
-      }
-    }
-    
-    /* 
-     * PARSING
-     */
-    // Remove comments
-    for (size_t j = 0; j < num_tokens; j++) {
-      if (strcmp(word_tokens[j], "#") == 0) {
-        size_t token_count_diff = 0;
-        for (size_t n = j; n < num_tokens; n++) {
-          free(word_tokens[n]);
-          word_tokens[n] = NULL;
-          token_count_diff++;
-        }
-        num_tokens -= token_count_diff;
-        break;
+        reader_close(&reader);
+        arena_free(&line_arena);
+        dump_stats_at_exit(&sh);
+        trace_close(&sh.trace);
+        exit(last_fg_exit_status);
       }
-    }
-    
-    size_t input_ptr_offset = 0;
-    size_t output_ptr_offset = 0;
-    int is_bg_proc = false;
-    // Determine whether command will run in background
-    if (strcmp(word_tokens[num_tokens-1], "&") == 0) {
-      free(word_tokens[num_tokens-1]);
-      word_tokens[num_tokens-1] = NULL;
-      is_bg_proc = true;
-      num_tokens--;
-    }
-
-    // Determine whether stdin/stdout will be redirected 
-    for (size_t j = num_tokens-1; j > 0; --j) {
-      if (num_tokens > 2 && strcmp(word_tokens[j], "<") == 0 && (j == (num_tokens - 2) || j == (num_tokens - 4))) {
-        if (word_tokens[j+1] != NULL) {  
-          input_ptr_offset = j;
-        }
-      } else if (num_tokens > 2 && strcmp(word_tokens[j], ">") == 0 && (j == (num_tokens - 2) || j == (num_tokens - 4))) {
-        if (word_tokens[j+1] != NULL) {
-          output_ptr_offset = j;
-        }
+    } else {
+      /*
+       * PS1 EXPANSIONS/PROMPT DISPLAY
+       */
+      char const *prompt = NULL; /* Prompt should not persist through loop iterations. Retrieve on each iteration. */
+      char const *temp_prompt = var_get(&sh.vars, prompt_str); /* Avoid accidentally overwriting PS1 value. */
+      if (!temp_prompt) {
+        prompt = ""; /* PS1 default value is an empty string */
+      } else {
+        prompt = temp_prompt;
       }
-    }
+      if (fprintf(stderr, "%s", prompt) < 0) goto exit;
     
-    char *input_file = NULL;
-    char *output_file = NULL;
-    // If input/output will be redirected, save that info and remove it from the word_tokens array along with the redirect operator
-    if (input_ptr_offset != 0) {
-      input_file = strdup(word_tokens[input_ptr_offset+1]);
-      free(word_tokens[input_ptr_offset+1]);
-      word_tokens[input_ptr_offset+1] = NULL;
-      free(word_tokens[input_ptr_offset]);
-      word_tokens[input_ptr_offset] = NULL;
-      num_tokens -= 2;
-    }
-
-    if (output_ptr_offset != 0) {
-      output_file = strdup(word_tokens[output_ptr_offset+1]);
-      free(word_tokens[output_ptr_offset+1]);
-      word_tokens[output_ptr_offset+1] = NULL;
-      free(word_tokens[output_ptr_offset]);
-      word_tokens[output_ptr_offset] = NULL;
-      num_tokens -= 2;
-    }
+      /*
+       * READ A LINE OF INPUT FROM STDIN
+       */
+      // Set signal handler for SIGINT for correct functionality while waiting for input
+      SIGINT_sa.sa_handler = handle_SIGINT;
+      if (sigaction(SIGINT, &SIGINT_sa, NULL) != 0) goto exit;
+      reader.prompt = prompt;
+      line_length = reader_next_line(&reader, &input_line);
     
-    /*
-     * EXECUTION
-     */
-    // Insert NULL pointer at end here
-    word_tokens = realloc(word_tokens, sizeof (char **[num_tokens+1]));
-    word_tokens[num_tokens] = NULL;
-
-    // Branch for built-in command exit
-    // First word/token is command
-    if (strcmp(word_tokens[0], "exit") == 0) {
-      if (num_tokens > 2) {
-        if (fprintf(stderr, "Too many arguments passed to exit command\n") < 0) goto exit;
-        cleanup_memory(num_tokens, word_tokens, line, input_file, output_file);
-        last_fg_exit_status = 1; /* exit code 1 is for general errors */
-        num_tokens = 0;
-        n = 0;
-        continue; /* Return to input step */
-      }
-      
-      int shell_exit_status = last_fg_exit_status;
-      if (num_tokens == 2) {
-        char *exit_status_str = NULL;
-        int status_is_digit = true;
-        size_t arg_len = strlen(word_tokens[1]);
-        exit_status_str = malloc(sizeof (size_t) * arg_len);
-        if (!exit_status_str) goto exit; /* error check malloc */
-        for (size_t c = 0; c < arg_len; c++) {
-          if (isdigit(word_tokens[1][c]) != 0) {
-            exit_status_str[c] = word_tokens[1][c];
-          } else {
-            status_is_digit = false;
-            break;
-          }
-        }
-        if (!status_is_digit) {
-            if (fprintf(stderr, "Exit status arg (%s) contains non-digits\n", word_tokens[1]) < 0) goto exit;
-            cleanup_memory(num_tokens, word_tokens, line, input_file, output_file);
-            last_fg_exit_status = 128; /* exit code 128 for invalid argument to exit */
-            num_tokens = 0;
-            n = 0;
-            continue;
-        }
+      // If signal interrupted the read, clear errno, print a new line, and reprompt
+      if (line_length == -1 && errno == EINTR) {
+        errno = 0;
+        if (fprintf(stderr, "\n") < 0) goto exit;
+        continue;
+      }
 
-        shell_exit_status = atoi(exit_status_str);
-        if (shell_exit_status < 0) {
-          errno = -1;
-          fprintf(stderr, "An error occurred in function atoi\n"); /* fprintf not error checked since program goes to exit regardless */
-          goto exit;
-        }
-        if (handle_child_procs_exit() != 0) {
-          fprintf(stderr, "An error occurred while signaling child processes\n");
-          goto exit;
-        }
-        last_fg_exit_status = shell_exit_status;
-        free(exit_status_str);
-        cleanup_memory(num_tokens, word_tokens, line, input_file, output_file);
-        if (fprintf(stderr, "\nexit\n") < 0) goto exit;
-        exit(shell_exit_status);
-      } else if (num_tokens == 1) {
+      // After reading ignore SIGINT
+      SIGINT_sa.sa_handler = SIG_IGN;
+      if (sigaction(SIGINT, &SIGINT_sa, NULL) != 0) goto exit;
+
+      // Exit smallsh if EOF encountered
+      if (line_length == -1) {
+        if (errno != 0) goto exit;
         if (handle_child_procs_exit() != 0) {
           fprintf(stderr, "An error occurred while signaling child processes\n");
           goto exit;
         }
-        cleanup_memory(num_tokens, word_tokens, line, input_file, output_file);
         if (fprintf(stderr, "\nexit\n") < 0) goto exit;
-        exit(shell_exit_status);
-      } 
-    } else if (strcmp(word_tokens[0], "cd") == 0) {  /* Branch for built-in command cd */
-      if (num_tokens > 2) {
-        if (fprintf(stderr, "Too many arguments passed to cd command\n") < 0) goto exit;
-        cleanup_memory(num_tokens, word_tokens, line, input_file, output_file);
-        last_fg_exit_status = 1;
-        num_tokens = 0;
-        n = 0;
-        continue;
+        editor_close(&editor);
+        reader_close(&reader);
+        arena_free(&line_arena);
+        dump_stats_at_exit(&sh);
+        trace_close(&sh.trace);
+        exit(last_fg_exit_status);
       }
+    }
 
-      char *cd_arg = NULL;
-      char *temp_cd_arg = getenv("HOME");
-      if (num_tokens == 2) {
-        cd_arg = word_tokens[1];
-      } else {
-        cd_arg = temp_cd_arg;
-      }
-      
-      if (chdir(cd_arg) != 0) {
-        if (fprintf(stderr, "An error occurred while trying to change directory\n") < 0) goto exit;
-        cleanup_memory(num_tokens, word_tokens, line, input_file, output_file);
+    /*
+     * HISTORY
+     */
+    // An event at the start of the line is replaced from the history, then the line as run is recorded
+    if (sh.history.fd != -1) {
+      int event_result = history_expand_line(&sh.history, &line_arena, &input_line, &line_length);
+      if (event_result == -1) goto exit;
+      if (event_result == 1) {
         last_fg_exit_status = 1;
-        num_tokens = 0;
-        n = 0;
         continue;
       }
-
-    } else { /* Branch for non-built-in commands */
-      // Execute non-built-in-command in a new child process
-      // execvp will search PATH variable for command if command does not start with slash
-      // Code below adapted from exampole code in CS344 module Process API - Executing a New Program
-      int new_child_status;
-      pid_t new_child_pid = fork();
-
-      switch(new_child_pid) {
-        case -1:
-          if (fprintf(stderr, "An error occurred when calling fork()\n") < 0) goto exit;
-          cleanup_memory(num_tokens, word_tokens, line, input_file, output_file);
-          last_fg_exit_status = 1;
-          num_tokens = 0;
-          n = 0;
-          continue;
-          break;
-        case 0: /* Process is child */
-          // Reset signals to original dispositions
-          if (sigaction(SIGINT, &SIGINT_init_disp_sa, NULL) != 0) goto exit;
-          if (sigaction(SIGTSTP, &SIGTSTP_init_disp_sa, NULL) != 0) goto exit;
-          /* Redirection handling adapted from Linux Programming Interface section 27.4 example code */
-          if (input_file) {
-            int in_fd;
-            in_fd = open(input_file, O_RDONLY);
-            if (in_fd == -1) {
-             if (fprintf(stderr, "An error occurred while trying to redirect stdin to %s\n", input_file) < 0) goto exit;
-             cleanup_memory(num_tokens, word_tokens, line, input_file, output_file);
-             num_tokens = 0;
-             n = 0;
-             last_fg_exit_status = 1;
-             continue;
-            }
-
-            if (in_fd != STDIN_FILENO) {
-              if (dup2(in_fd, STDIN_FILENO) == -1) {
-               fprintf(stderr, "An error occurred in dup2() while trying to redirect stdin to %s\n", input_file);
-               goto exit;
-              }
-              if (in_fd != 0) {
-                if (close(in_fd) != 0) goto exit;
-              }
-            }
-          }
-
-          if (output_file) {
-            int out_fd;
-            out_fd = open(output_file, O_CREAT | O_WRONLY, S_IRWXU | S_IRWXG | S_IRWXO);
-            if (out_fd == -1) {
-              if (fprintf(stderr, "An error occurred while trying to redirect stdout to %s\n", output_file) < 0) goto exit;
-              cleanup_memory(num_tokens, word_tokens, line, input_file, output_file);
-              num_tokens = 0;
-              n = 0;
-              last_fg_exit_status = 1;
-              continue;
-            }
-
-            if (out_fd != STDOUT_FILENO) {
-              if (dup2(out_fd, STDOUT_FILENO) == -1) {
-                fprintf(stderr, "An error occurred in dup2() while trying to redirect stdout to %s\n", output_file);
-                goto exit;
-              }
-              if (out_fd != 1) {
-                if (close(out_fd) != 0) goto exit;
-              }
-            }
-          }
-          
-          // Execute new command
-          if (execvp(word_tokens[0], word_tokens) == -1) {
-            if (fprintf(stderr, "An error occurred while trying to run command %s\n", word_tokens[0]) < 0) goto exit;
-            cleanup_memory(num_tokens, word_tokens, line, input_file, output_file);
-            num_tokens = 0;
-            n = 0;
-            last_fg_exit_status = 1;
-            continue;
-          }
-
-          if (errno != 0) {
-            if (fprintf(stderr, "An error occurred in the child process: error number %d\n", errno) < 0) goto exit;
-            cleanup_memory(num_tokens, word_tokens, line, input_file, output_file);
-            num_tokens = 0;
-            n = 0;
-            last_fg_exit_status = 1;
-            errno = 0;
-            continue;
-          }
-          if (fflush(stdin) != 0) goto exit;
-          if (fflush(stdout) != 0) goto exit;
-          if (fflush(stderr) != 0) goto exit;
-          break;
-        default: /* Process is parent */
-          // Perform blocking wait if process is not run in background
-          if (fflush(stdin) != 0) goto exit;
-          if (fflush(stdout) != 0) goto exit;
-          if (fflush(stderr) != 0) goto exit;
-          if (!is_bg_proc) {
-            pid_t waitpid_return_val = waitpid(new_child_pid, &new_child_status, 0);
-            if (waitpid_return_val == -1) goto exit;
-
-            if (WIFSIGNALED(new_child_status)) {
-              last_fg_exit_status = 128 + WTERMSIG(new_child_status);
-            } else if (WIFSTOPPED(new_child_status)) {
-              if (fprintf(stderr, "Child process %jd stopped. Continuing.\n", (intmax_t) new_child_pid) < 0) goto exit;
-              if (kill(new_child_pid, SIGCONT) == -1) {
-                fprintf(stderr, "Unable to send SICONT to child %jd\n", (intmax_t) new_child_pid);
-                goto exit;
-              }
-              last_bg_proc_pid = new_child_pid;
-            } else if (WIFEXITED(new_child_status)) {
-              last_fg_exit_status = WEXITSTATUS(new_child_status);
-            }
-          } else { /* Do not wait for background process */
-            last_bg_proc_pid = new_child_pid;
-          }
-          break;
+      if (history_add(&sh.history, input_line, line_length) != 0) {
+        if (fprintf(stderr, "smallsh: cannot write history: %s\n", strerror(errno)) < 0) goto exit;
+        errno = 0;
       }
     }
 
-    // Free word_tokens and line at end of each loop iteration to avoid memory leaks
-    cleanup_memory(num_tokens, word_tokens, line, input_file, output_file);
-    // Reset num_tokens and n for next loop iteration
-    num_tokens = 0;
-    n = 0;
+    /*
+     * PARSING
+     */
+    // Lines seen before come compiled from the parse cache; the executor only expands and runs them
+    trace_event(&sh.trace, TRACE_LINE_READ, 0, NULL, line_length);
+    size_t cache_hits = sh.parse_cache.hits;
+    struct compiled_line *compiled;
+    enum parse_result parse_result = parse_cache_lookup(&sh.parse_cache, &line_arena, &sh.ifs, &sh.vars,
+                                                        input_line, line_length, &compiled);
+    if (parse_result == PARSE_ERROR) goto exit;
+    trace_event(&sh.trace, TRACE_TOKENIZE, 0, NULL, sh.parse_cache.hits != cache_hits);
+    if (parse_result == PARSE_EMPTY) continue; /* No words or only a comment, go back to beginning of loop and display prompt */
+    if (parse_result >= PARSE_SYNTAX_ERROR) {
+      if (fprintf(stderr, "Syntax error: %s\n", syntax_error_message(parse_result)) < 0) goto exit;
+      last_fg_exit_status = 1;
+      continue;
+    }
+
+    enum loop_word keyword = loop_keyword(compiled);
+    if (keyword == LOOP_FOR || keyword == LOOP_WHILE) {
+      if (start_loop(&builtin_ctx, compiled, keyword) != 0) goto exit;
+      continue;
+    }
+    if (keyword == LOOP_DO || keyword == LOOP_DONE) {
+      if (fprintf(stderr, "Syntax error: %s outside a loop\n", keyword == LOOP_DO ? "do" : "done") < 0) goto exit;
+      last_fg_exit_status = 1;
+      continue;
+    }
+    // Here-document bodies follow the line in the input and are read afresh each time, never cached
+    char **heredocs = NULL;
+    if (compiled->num_heredocs > 0 && !(heredocs = read_heredocs(&builtin_ctx, compiled))) goto exit;
+    int execute_result = execute_line(&builtin_ctx, &line_arena, compiled, heredocs);
+    free(heredocs);
+    if (execute_result != 0) goto exit;
   }
 
 exit:
-  // Free word_tokens and line if needed
-  if (num_tokens > 0 && word_tokens != NULL) {
-    free_word_tokens(word_tokens, num_tokens);
-  }
-  if (n > 0 && line != NULL) {
-    free(line);
-  }
+  // Free line and the arena holding the words
+  trace_close(&sh.trace);
+  history_close(&sh.history);
+  arena_free(&line_arena);
+  editor_close(&editor);
+  reader_close(&reader);
   // Returning errno or 0 depending on if errno is set copied from CS344's tree assignment skeleton code
   return errno ? -1 : 0;
 }
-
+#endif /* SMALLSH_NO_MAIN */
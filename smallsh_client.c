@@ -0,0 +1,118 @@
+/* Client for smallsh's resident server mode (smallsh -S socket)
+ * Sends its arguments, joined by spaces, as one command line together with its own stdin, stdout and stderr,
+ * waits for the server's worker to finish running it and exits with the line's exit status.
+ * Usage: smallsh_client socket command [arg...]; exits 255 when the server cannot be reached. */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define REQUEST_FDS 3
+
+/* Join the command words into one line
+ * Parameters: char *const *words, int num_words
+ * Returns: the malloc'd line, or NULL if allocation failed */
+static char *join_words(char *const *words, int num_words) {
+  size_t len = 0;
+  for (int i = 0; i < num_words; ++i) len += strlen(words[i]) + 1;
+  char *line = malloc(len);
+  if (!line) return NULL;
+  char *end = line;
+  for (int i = 0; i < num_words; ++i) {
+    size_t word_len = strlen(words[i]);
+    memcpy(end, words[i], word_len);
+    end += word_len;
+    *end++ = i + 1 < num_words ? ' ' : '\0';
+  }
+  return line;
+}
+
+/* Connect to the server's socket
+ * Parameters: char const *path
+ * Returns: the connected socket, or -1 on failure */
+static int connect_server(char const *path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof addr.sun_path) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd == -1) return -1;
+  if (connect(fd, (struct sockaddr *) &addr, sizeof addr) == -1) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return fd;
+}
+
+/* Send a command line with the fds it is to run with
+ * Parameters: int sock, char const *line, int const *fds (stdin, stdout and stderr for the line)
+ * Returns: 0 on success, -1 on failure */
+static int send_request(int sock, char const *line, int const *fds) {
+  union {
+    char buf[CMSG_SPACE(sizeof (int) * REQUEST_FDS)];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof control);
+  struct iovec iov = { .iov_base = (void *) line, .iov_len = strlen(line) };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof control.buf };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof (int) * REQUEST_FDS);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof (int) * REQUEST_FDS);
+  ssize_t sent;
+  while ((sent = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+  return sent == (ssize_t) iov.iov_len ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: smallsh_client socket command [arg...]\n");
+    return 2;
+  }
+  char *line = join_words(argv + 2, argc - 2);
+  if (!line) {
+    perror("smallsh_client");
+    return 255;
+  }
+  if (!*line) return 0; /* An empty line runs nothing, and an empty message would read as a hangup */
+
+  // A closed standard fd cannot be passed, so the line gets /dev/null in its place
+  int fds[REQUEST_FDS];
+  for (int i = 0; i < REQUEST_FDS; ++i) {
+    fds[i] = i;
+    if (fcntl(i, F_GETFD) == -1 && (fds[i] = open("/dev/null", i == 0 ? O_RDONLY : O_WRONLY)) == -1) {
+      perror("smallsh_client: /dev/null");
+      return 255;
+    }
+  }
+
+  int sock = connect_server(argv[1]);
+  if (sock == -1) {
+    fprintf(stderr, "smallsh_client: cannot connect to %s: %s\n", argv[1], strerror(errno));
+    return 255;
+  }
+  if (send_request(sock, line, fds) != 0) {
+    fprintf(stderr, "smallsh_client: cannot send to %s: %s\n", argv[1], strerror(errno));
+    return 255;
+  }
+
+  int status;
+  ssize_t received;
+  while ((received = recv(sock, &status, sizeof status, 0)) == -1 && errno == EINTR);
+  if (received != (ssize_t) sizeof status) {
+    fprintf(stderr, "smallsh_client: %s closed the connection\n", argv[1]);
+    return 255;
+  }
+  return status;
+}